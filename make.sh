@@ -4,19 +4,52 @@
 if [ "$UseGpiod" = 1 ]
 then
   gpioLib="gpiod"
+  gpioDef="-DUseGpiod"
 else
   gpioLib="wiringPi"
+  gpioDef=""
 fi
 
 echo Building teensy-pi-plugin
 cd teensy-fs2020-plugin
-g++ -o teensy-pi-plugin -I headers \
+g++ -o teensy-pi-plugin -I headers ${gpioDef} \
     src/io.cpp \
     src/memory.cpp \
+    src/stats.cpp \
     src/TeensyControls.cpp \
     src/thread.cpp \
     src/usb.cpp \
+    src/usbio.cpp \
+    src/capture.cpp \
+    src/simsocket.cpp \
     src/pi.cpp \
     src/gpio.cpp \
+    src/debounce.cpp \
+    src/buttons.cpp \
+    src/nameindex.cpp \
+    src/mapping.cpp \
     -l${gpioLib} -ludev -lpthread || exit
+
+echo Building teensy-bench
+g++ -o teensy-bench -I headers \
+    src/io.cpp \
+    src/memory.cpp \
+    src/stats.cpp \
+    src/thread.cpp \
+    src/usbio.cpp \
+    src/capture.cpp \
+    src/nameindex.cpp \
+    src/mapping.cpp \
+    src/debounce.cpp \
+    src/buttons.cpp \
+    src/bench.cpp \
+    -lpthread || exit
+
+echo Building teensy-virtual
+g++ -o teensy-virtual -I headers \
+    src/virtual.cpp || exit
+
+echo Building teensy-sim
+g++ -o teensy-sim -I headers \
+    src/sim.cpp || exit
 echo Done
@@ -14,6 +14,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <time.h>
+#include <atomic>
 
 // Uncomment the next line to print debugging info
 //#define DEBUG
@@ -51,6 +52,8 @@ typedef struct {
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/select.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <pthread.h>
 #include <time.h>
 #include <libudev.h>	// sudo apt-get install libudev-dev
@@ -67,85 +70,235 @@ typedef struct {
 
 #define STRING_MAX_LEN 58
 
-typedef struct item_struct {
+// Items are stored in two parallel arrays per Teensy. item_t holds the
+// state that the per-frame passes in io.c touch, so a scan walks densely
+// packed memory. item_info_t holds everything else, at the same index.
+typedef struct {
 	int id;				// ID assigned by Teensy
 	int type;			// data type on Teensy, 0=cmd, 1=long, 2=float
+	int dataref;		// XPLMDataRef, -1 if the name is not mapped
+	int changed_by_teensy;		// non-zero if teensy changed data, not yet written to xplane
+	int32_t intval;				// int value, most recent
+	int32_t intval_remote;		// int value, as exists on Teensy
+	double floatval;				// float value, most recent
+	double floatval_remote;		// float value, as exists on Teensy
+	int dirty;					// non-zero if item is in the teensy dirty list
+	double deadband;			// smaller sim changes aren't sent
+	uint32_t min_interval;		// usec between sends, 0 for no limit
+	int priority;				// OUTPUT_URGENT, OUTPUT_NORMAL or OUTPUT_LOW
+} item_t;
+
+typedef struct {
 	int index;			// -1 if not an array, 0 to more for array vars
-	char name[64];		// X-Plane Command or Data name
+	char name[256];		// X-Plane Command or Data name, whole so it can be looked up again
 	int cmdref;			// XPLMCommandRef
 	uint8_t command_queue[128];  // 4=begin, 5=end, 6=once
 	int command_count;	// number of cmds in command_queue
 	int command_began;	// non-zero if command begin but no end yet
-	int dataref;		// XPLMDataRef
 	int datatype;		// XPLMDataTypeID
 	int datawritable;
-	int32_t intval;				// int value, most recent
-	int32_t intval_remote;		// int value, as exists on Teensy
-	double floatval;				// float value, most recent
-	double floatval_remote;		// float value, as exists on Teensy
 	int stringval_len;			// length of most recent string;
 	char  stringval[STRING_MAX_LEN]; // string value, most recent
 	char  dummy;				// null char to terminate string
 	int stringval_remote_len;	// length of remote string
 	char  stringval_remote[STRING_MAX_LEN]; // string value, as exists on Teensy
 	char  dummy2;				// null char to terminate string
-	int changed_by_teensy;		// non-zero if teensy changed data, not yet written to xplane
-	struct item_struct *prev;
-	struct item_struct *next;
-} item_t;
+	uint64_t input_time;		// when the latest Teensy write was read from USB
+	uint64_t decode_time;		// when the latest Teensy write was decoded
+	uint64_t dirty_time;		// when the sim value was first seen changed
+	uint64_t sent_time;			// when the value was last put in an output report
+	int unmapped_logged;		// a Teensy write to it while unbound has been reported
+} item_info_t;
 
 #define INPUT_BUFSIZE 160
 #define OUTPUT_BUFSIZE 50
 #define ID_FRAME_TIMEOUT 5  // number of frames that 
+#define OUTPUT_QUEUE_LIMIT 4	// reports queued ahead of the output thread
+#define CACHE_LINE 64
+#define INPUT_BATCH 32		// max reports the input thread stores at once
+#define BATCH_BUCKETS 7		// reports per wakeup: 1, 2-3, 4-7, ... 64+
+#define LATENCY_BUCKETS 24	// bucket n counts latencies under 2^(n+1) usec
+#define OUTPUT_AGING 250000	// usec a low item waits before it is sent as normal
+
+// Capabilities the plugin offers in byte 3 of the enable message. Older
+// firmware ignores that byte. Firmware that supports one answers with a
+// 0x07 message carrying the bits it accepts, which set output_caps.
+#define OUTPUT_CAP_MULTI_WRITE 0x01	// 0x08 message, many values of one type
+
+// Output priority classes. Urgent items are always sent first and low
+// items that have waited are sent as normal, so they are delayed but
+// never starved.
+enum {
+	OUTPUT_URGENT,
+	OUTPUT_NORMAL,
+	OUTPUT_LOW,
+	OUTPUT_PRIORITIES
+};
+
+// Latency is measured in stages, from a monotonic clock in usec.
+// Teensy to sim: read() -> decode -> dataRefWrite
+// Sim to Teensy: value changed -> packed into a report -> write()
+enum {
+	LATENCY_INPUT_QUEUE,	// read() to decode
+	LATENCY_INPUT_SIM,		// decode to dataRefWrite
+	LATENCY_INPUT_TOTAL,	// read() to dataRefWrite
+	LATENCY_OUTPUT_PACK,	// sim value changed to report queued
+	LATENCY_OUTPUT_USB,		// report queued to write() done
+	LATENCY_OUTPUT_TOTAL,	// sim value changed to write() done
+	LATENCY_STAGES
+};
+
+typedef struct {
+	uint32_t count;
+	uint64_t total;
+	uint64_t max;
+	uint32_t bucket[LATENCY_BUCKETS];
+} latency_hist_t;
+
+// Input and output buffers are single producer, single consumer rings.
+// Head is only written by the producer and tail only by the consumer,
+// each on its own cache line so the two threads don't share a line.
 
 typedef struct teensy_struct {
 	usb_t usb;
 	volatile int online;		// created as 1, set to 0 when device goes offline
-	item_t *items;
-	pthread_mutex_t input_mutex;	// must lock when accessing input head, tail, buffer
+	int index;					// numbered in the order devices are found, for captures
+	item_t *items;			// hot item state, in registration order
+	item_info_t *item_info;	// cold item state, same index as items
+	int item_count;
+	int item_size;			// number of items allocated
 	volatile int input_thread_quit;
-	volatile int input_head;
-	volatile int input_tail;
+	char input_pad0[CACHE_LINE];
+	std::atomic<int> input_head;	// written by input thread
+	char input_pad1[CACHE_LINE - sizeof(std::atomic<int>)];
+	std::atomic<int> input_tail;	// written by main thread
+	char input_pad2[CACHE_LINE - sizeof(std::atomic<int>)];
 	uint8_t input_buffer[64*INPUT_BUFSIZE];
-	pthread_mutex_t output_mutex;	// must lock when accessing output head, tail, buffer
+	uint64_t input_time[INPUT_BUFSIZE];	// when each input report was read
+	uint64_t input_fetch_time;	// read time of the report being decoded
+	uint32_t input_wakeups;		// times the input thread woke with data
+	uint32_t input_reports;		// reports read by the input thread
+	uint32_t input_batch_max;	// most reports read in one wakeup
+	uint32_t input_batch_hist[BATCH_BUCKETS];
+	pthread_mutex_t output_mutex;	// only used to wake an idle output thread
 	pthread_cond_t output_event;
 	volatile int output_thread_quit;
-	volatile int output_thread_waiting;
-	volatile int output_head;
-	volatile int output_tail;
+	std::atomic<int> output_thread_waiting;
+	int output_wake_fd;			// eventfd to signal instead of output_event, or -1
+	char output_pad0[CACHE_LINE];
+	std::atomic<int> output_head;	// written by main thread
+	char output_pad1[CACHE_LINE - sizeof(std::atomic<int>)];
+	std::atomic<int> output_tail;	// written by output thread
+	char output_pad2[CACHE_LINE - sizeof(std::atomic<int>)];
 	uint8_t output_buffer[64*OUTPUT_BUFSIZE];
+	uint64_t output_changed[OUTPUT_BUFSIZE];	// oldest sim change in each report
+	uint64_t output_queued[OUTPUT_BUFSIZE];	// when each report was queued
+	uint64_t output_fetch_changed;	// times of the report being written
+	uint64_t output_fetch_queued;
+	uint32_t output_reports;	// reports written by the output thread
+	uint32_t output_deferred;	// frames held back because output queue was full
+	uint32_t output_suppressed;	// sim changes not sent, inside deadband or over rate
+	uint32_t output_throttled;	// frames held back by the report budget
+	uint32_t output_rate;		// reports a second allowed, 0 for no limit
+	double output_tokens;		// reports that may be sent now, up to OUTPUT_QUEUE_LIMIT
+	uint64_t output_token_time;	// when tokens were last added
+	uint32_t output_values;		// int and float values put in reports
+	int output_caps;			// OUTPUT_CAP_ bits the Teensy accepted
+	int output_multi;			// offset of the open 0x08 message in output_packet, or -1
 	uint8_t output_packet[64];
 	int output_packet_len;
+	uint64_t output_packet_changed;	// oldest sim change in output_packet
+	int output_reports_left;	// reports that may still be queued this frame
 	int unknown_id_heard;
-	//item_t *itemlists[64]; // TODO: rapid lookup by ID....
-	
+	int *itemlist;			// rapid lookup by ID, index into items or -1
+	int itemlist_size;		// number of slots allocated in itemlist
+	int *dirty;				// items changed by sim since last sent to Teensy
+	int dirty_count;
+	int dirty_size;
+	latency_hist_t latency[LATENCY_STAGES];
+	uint64_t plug_time;			// when the device appeared, 0 if present at startup
+	uint64_t found_time;		// when it was probed and its threads started
+	uint64_t first_input_time;	// when its first report was read
+
 	uint8_t input_packet[256];
 	uint8_t expect_fragment_id;
 	uint8_t *input_packet_ptr;
 	int32_t input_packet_bytes_missing;
 	uint32_t frames_without_id;
+	int input_changed;			// items or commands for the sim not yet passed on
 	struct teensy_struct *next;
 } teensy_t;
 
+// A capture record is one report read from or written to a Teensy.
+// usec is since the capture began and device is the teensy_t index.
+enum {
+	CAPTURE_INPUT,		// read from the Teensy
+	CAPTURE_OUTPUT		// written to the Teensy
+};
+
+typedef struct {
+	uint64_t usec;
+	uint8_t device;
+	uint8_t direction;
+	uint8_t report[64];
+} capture_record_t;
+
 // io.c
 void TeensyControls_input(float elapsed, int flags);
 void TeensyControls_update_xplane(float elapsed);
+void TeensyControls_write_xplane(void);
+void TeensyControls_read_xplane(void);
+void TeensyControls_read_xplane_ref(int dataref);
 void TeensyControls_output(float elapsed, int flags);
 
 // usb.c
 void TeensyControls_find_new_usb_devices(void);
 void TeensyControls_usb_close(void);
 
+// usbio.c
+#ifndef _WIN32
+int  TeensyControls_usb_wake_fd(void);
+void TeensyControls_usb_wake(void);
+int  TeensyControls_usb_start_io(teensy_t *t);
+void TeensyControls_usb_stop_io(void);
+#endif
+
 // memory.c
 extern teensy_t * TeensyControls_first_teensy;
 teensy_t * TeensyControls_new_teensy(void);
+teensy_t * TeensyControls_alloc_teensy(void);
+void TeensyControls_add_teensy(teensy_t *n);
 void TeensyControls_delete_offline_teensy(void);
-void TeensyControls_input_store(teensy_t *t, const uint8_t *packet);
+int  TeensyControls_input_store(teensy_t *t, const uint8_t *packet);
+int  TeensyControls_input_store_batch(teensy_t *t, const uint8_t *packets, int count, uint64_t usec);
 int  TeensyControls_input_fetch(teensy_t *t, uint8_t *packet);
-void TeensyControls_output_store(teensy_t *t, const uint8_t *packet);
+const uint8_t * TeensyControls_input_peek(teensy_t *t);
+void TeensyControls_input_release(teensy_t *t);
+int  TeensyControls_output_store(teensy_t *t, const uint8_t *packet, uint64_t changed);
 int  TeensyControls_output_fetch(teensy_t *t, uint8_t *packet);
+int  TeensyControls_output_pending(teensy_t *t);
+void TeensyControls_output_wait(teensy_t *t, int msec);
 void TeensyControls_new_item(teensy_t *t, int id, int type, const char *name, int namelen);
 item_t * TeensyControls_find_item(teensy_t *t, int id);
+item_info_t * TeensyControls_item_info(teensy_t *t, item_t *item);
+void TeensyControls_dirty_item(teensy_t *t, item_t *item);
+void TeensyControls_output_rate(teensy_t *t, uint32_t rate);
+int  TeensyControls_rebind_items(int (*find)(const char *name));
+
+// capture.c
+int  TeensyControls_capture_open(const char *path);
+void TeensyControls_capture(teensy_t *t, int direction, const uint8_t *report, uint64_t usec);
+void TeensyControls_capture_close(void);
+capture_record_t * TeensyControls_capture_load(const char *path, int *count);
+int  TeensyControls_replay_start(const char *path, double speed, int wakefd);
+void TeensyControls_replay_stop(void);
+
+// stats.c
+uint64_t TeensyControls_usec(void);
+void TeensyControls_latency(teensy_t *t, int stage, uint64_t start, uint64_t end);
+void TeensyControls_written_latency(teensy_t *t);
+void TeensyControls_input_batch_stats(teensy_t *t, int count);
+void TeensyControls_print_stats(void);
 
 // thread.c
 int thread_start(void (*function)(void*), void *arg);
@@ -0,0 +1,34 @@
+#ifndef BUTTONS_H_
+#define BUTTONS_H_
+
+#include <stdint.h>
+
+// How a held button repeats. The first repeat comes delayMs after the
+// press, then every repeatMs. Each repeat multiplies the interval by
+// accel, so less than 1 speeds up, until it reaches fastestMs.
+struct ButtonRepeat {
+    int delayMs;
+    int repeatMs;
+    double accel;
+    int fastestMs;
+};
+
+// Repeats are timed from the press on the monotonic clock, not counted
+// in frames, so a slow or late frame catches up rather than slowing the
+// rate down.
+struct ButtonAction {
+    ButtonRepeat repeat;
+    bool held;
+    uint64_t nextTime;      // usec when the next repeat is due
+    double interval;        // usec until the one after
+};
+
+void buttonRepeatDefaults(ButtonRepeat* repeat);
+bool buttonRepeatOption(ButtonRepeat* repeat, const char* option);
+void buttonActionInit(ButtonAction* action, const ButtonRepeat* repeat);
+void buttonActionPress(ButtonAction* action, uint64_t time);
+void buttonActionRelease(ButtonAction* action);
+int buttonActionRun(ButtonAction* action, uint64_t now);
+uint64_t buttonActionNext(const ButtonAction* action);
+
+#endif
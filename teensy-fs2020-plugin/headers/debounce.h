@@ -0,0 +1,25 @@
+#ifndef DEBOUNCE_H_
+#define DEBOUNCE_H_
+
+#include <stdint.h>
+
+// Debounces one button from the changes of its raw level. The first
+// change is taken straight away so a press isn't delayed, then further
+// changes are ignored until the level has been quiet for the debounce
+// time. If it has settled on the other level by then, that is taken too.
+// Levels are as read from the pin, 0 = pressed as pins are pulled up.
+struct Debounce {
+    int state;              // debounced level
+    int level;              // latest raw level
+    uint64_t debounce;      // usec
+    uint64_t changed;       // when state last changed
+    uint64_t edge;          // when level last changed
+    int presses;            // not yet taken
+};
+
+void debounceInit(Debounce* d, int level, int debounceMs, uint64_t now);
+void debounceEdge(Debounce* d, int level, uint64_t time);
+void debounceUpdate(Debounce* d, uint64_t now);
+int debounceTakePresses(Debounce* d);
+
+#endif
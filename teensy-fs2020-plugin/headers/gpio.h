@@ -1,4 +1,10 @@
+#include <stdint.h>
+
 void gpioInit();
-void gpioAdd(int gpioNum);
+void gpioAdd(int gpioNum, int debounceMs);
+void gpioStart();
 void gpioReadAll();
 int gpioGetState(int gpioNum);
+int gpioPresses(int gpioNum);
+uint64_t gpioChangeTime(int gpioNum);
+int gpioEventFd();
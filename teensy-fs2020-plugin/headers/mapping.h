@@ -0,0 +1,46 @@
+#ifndef MAPPING_H_
+#define MAPPING_H_
+
+#include <stddef.h>
+#include "nameindex.h"
+
+// Strings point into the string pool of the MappingTable
+struct DataMapping {
+    char* dataRef;
+    char* readVar;
+    char* readVarUnits;
+    char* writeVar;
+    char* writeVarUnits;
+    double readScale;       // applied to values read from the sim
+    double writeScale;      // applied to values written to the sim
+    int readOffset;
+    double testValue;
+    double testInit;        // testValue as loaded from the file
+    double testAdjust;
+    double setValue;
+    int setDelay;
+    double deadband;        // smaller changes aren't sent to a Teensy
+    int precision;          // decimal places sent to a Teensy, -1 for all
+    int maxRate;            // most updates a second sent to a Teensy, 0 for no limit
+    int priority;           // OUTPUT_URGENT, OUTPUT_NORMAL or OUTPUT_LOW
+};
+
+// A loaded data_mapping.txt. Either parsed from the text, or mapped
+// in from the compiled cache file next to it, in which case the pool
+// and index are in the mapped file.
+struct MappingTable {
+    DataMapping* mapping;
+    int count;
+    NameIndex index;        // Data Ref name to mapping number
+    char* pool;
+    size_t poolSize;
+    void* cache;            // mapped cache file, or NULL if parsed
+    size_t cacheSize;
+};
+
+MappingTable* mappingLoad(const char* path);
+void mappingFree(MappingTable* table);
+int mappingCarryOver(MappingTable* table, const MappingTable* old);
+double mappingRound(const DataMapping* m, double value);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef NAMEINDEX_H_
+#define NAMEINDEX_H_
+
+#include <stdint.h>
+
+// Open addressing hash index from Data Ref name to mapping number.
+// Names live in a string pool and slots hold only offsets into it, so
+// an index can be saved to a file and mapped back in.
+struct NameIndexSlot {
+    uint32_t hash;
+    int32_t len;
+    int32_t name;       // offset of the name in the pool
+    int32_t value;      // -1 if slot is empty
+};
+
+struct NameIndex {
+    NameIndexSlot* slots;
+    int mask;
+    int count;
+    const char* pool;
+};
+
+bool nameIndexInit(NameIndex* index, int capacity, const char* pool);
+void nameIndexAttach(NameIndex* index, NameIndexSlot* slots, int size, int count, const char* pool);
+void nameIndexFree(NameIndex* index);
+bool nameIndexAdd(NameIndex* index, int name, int value);
+int nameIndexFind(const NameIndex* index, const char* name, int len);
+
+#endif
@@ -1,15 +1,4 @@
-struct DataMapping {
-    char dataRef[256];
-    char readVar[256];
-    char readVarUnits[256];
-    char writeVar[256];
-    char writeVarUnits[256];
-    int readOffset;
-    double testValue;
-    double testAdjust;
-    double setValue;
-    int setDelay;
-};
+#include "buttons.h"
 
 struct ButtonData {
     int button;
@@ -17,12 +6,15 @@ struct ButtonData {
     int gpioVal;
     int prevGpioVal;
     int refNum;
+    char dataRef[256];
     double initValue;
     double adjust;
+    ButtonAction action;
 };
 
-int dataRefNum(const char* dataRef, int id);
+int dataRefNum(const char* dataRef, int len, int id);
 char* dataRefName(int refNum);
 double dataRefRead(int refNum);
 void dataRefWrite(int refNum, double value, bool isAdjust = false);
 bool dataRefWritten(int refNum);
+void dataRefLimits(int refNum, double* deadband, int* minInterval, int* priority);
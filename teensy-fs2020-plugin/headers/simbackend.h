@@ -0,0 +1,24 @@
+#ifndef SIMBACKEND_H_
+#define SIMBACKEND_H_
+
+#include "mapping.h"
+
+// Where the sim values behind dataRefRead and dataRefWrite come from.
+// Test values in the mapping file are handled before the backend is
+// asked, so a backend only sees Data Refs with a read var.
+struct SimBackend {
+    const char* name;
+    bool (*open)(const char* address);
+    void (*close)();
+    int (*eventFd)();           // readable when values arrive, -1 if never
+    void (*subscribe)(const MappingTable* table);  // after every load or reload
+    void (*receive)();          // takes the values that arrived
+    bool (*read)(int refNum, double* value);  // false if there is no value yet
+    void (*write)(int refNum, const DataMapping* m, double value);
+    bool (*written)(int refNum);    // true while a write may not be read back yet
+};
+
+// Stand-in simulator, teensy-sim, over a Unix socket
+extern SimBackend socketSimBackend;
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef SIMSOCKET_H_
+#define SIMSOCKET_H_
+
+#include <stdint.h>
+
+// Protocol between the plugin and teensy-sim, the stand-in simulator, over
+// a Unix stream socket. Every message is a SimMessage header followed by
+// length bytes of payload, little endian.
+//
+// SimSubscribe  plugin to sim: uint32 generation, then for each Data Ref
+//               uint32 refNum and its read var name, null terminated.
+//               Replaces any earlier subscription.
+// SimFrame      sim to plugin: uint32 generation, uint32 count, then count
+//               SimValues, the subscribed values that changed this frame.
+//               Every value is sent in the first frame after a subscribe.
+// SimWrite      plugin to sim: double value, then the write var name,
+//               null terminated.
+enum {
+    SimSubscribe = 1,
+    SimFrame = 2,
+    SimWrite = 3
+};
+
+struct SimMessage {
+    uint32_t type;
+    uint32_t length;        // payload bytes after this header
+};
+
+struct SimValue {
+    uint32_t refNum;
+    double value;
+} __attribute__((packed));
+
+#define SIM_SOCKET_PATH "/tmp/teensy-sim.sock"
+#define SIM_MAX_MESSAGE (16 * 1024 * 1024)
+
+#endif
@@ -0,0 +1,2469 @@
+#include "TeensyControls.h"
+#include "pi.h"
+#include "nameindex.h"
+#include "mapping.h"
+#include "debounce.h"
+#include "buttons.h"
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <algorithm>
+#include <map>
+#include <string>
+
+// Benchmarks for the Teensy hot path. These link against io.cpp,
+// memory.cpp, stats.cpp, usbio.cpp, nameindex.cpp, mapping.cpp,
+// debounce.cpp and buttons.cpp only, so no USB hardware or simulator is
+// needed.
+//
+//   teensy-bench lookup     item lookup by Teensy ID, 10 to 5000 items
+//   teensy-bench ring       input/output rings with both ends at full rate
+//   teensy-bench wakeup     input latency, fixed 30 ms sleep vs event loop
+//   teensy-bench dirty      per-frame cost with 2000 items, 1% changing
+//   teensy-bench coalesce   needle gauge through a throttled output thread
+//   teensy-bench decode     synthetic Teensy report stream through input decode
+//   teensy-bench fuzz       malformed and interleaved fragments through input decode
+//   teensy-bench names      Data Ref name lookup, std::map vs hash index
+//   teensy-bench mappings   data mapping file load, text parse vs cache
+//   teensy-bench debounce   bouncing button presses, polled vs edge events
+//   teensy-bench repeat     held button repeats with steady and jittery frames
+//   teensy-bench deadband   jittering sim values, with and without output limits
+//   teensy-bench priority   annunciators among busy gauges, with priority classes and a report budget
+//   teensy-bench multiwrite values per report for a cockpit panel, 0x02 vs 0x08 messages
+//   teensy-bench replay     [capture] decode and update path fed from a capture file
+//   teensy-bench shared     mirrored panels, sim reads per frame as Teensys are added
+//   teensy-bench usbio      16 stand-in Teensys, thread per device vs one epoll reactor
+
+static int savedStdout = -1;
+static double benchValues[65536];
+static double benchDeadband = 0;
+static int benchMinInterval = 0;
+static int (*benchPriority)(int refNum) = NULL;
+static int benchReads = 0;
+
+int dataRefNum(const char* dataRef, int len, int id)
+{
+    return id;
+}
+
+char* dataRefName(int refNum)
+{
+    static char name[] = "bench";
+    return name;
+}
+
+double dataRefRead(int refNum)
+{
+    benchReads++;
+    return benchValues[refNum];
+}
+
+void dataRefWrite(int refNum, double value, bool isAdjust)
+{
+    benchValues[refNum] = isAdjust ? benchValues[refNum] + value : value;
+}
+
+bool dataRefWritten(int refNum)
+{
+    return false;
+}
+
+void dataRefLimits(int refNum, double* deadband, int* minInterval, int* priority)
+{
+    *deadband = benchDeadband;
+    *minInterval = benchMinInterval;
+    *priority = benchPriority ? benchPriority(refNum) : OUTPUT_NORMAL;
+}
+
+static double benchSeconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Registration prints a line per item so silence stdout while setting up
+static void quiet(bool enable)
+{
+    fflush(stdout);
+    if (enable) {
+        savedStdout = dup(1);
+        int fd = open("/dev/null", O_WRONLY);
+        dup2(fd, 1);
+        close(fd);
+    }
+    else if (savedStdout >= 0) {
+        dup2(savedStdout, 1);
+        close(savedStdout);
+        savedStdout = -1;
+    }
+}
+
+static void registerItems(teensy_t* t, int count)
+{
+    char name[64];
+
+    quiet(true);
+    for (int id = 0; id < count; id++) {
+        int len = sprintf(name, "bench/item_%d", id);
+        TeensyControls_new_item(t, id, 1 + (id & 1), name, len);
+    }
+    quiet(false);
+}
+
+// Linear search, like the linked list walk TeensyControls_find_item used to do
+static item_t* listFind(teensy_t* t, int id)
+{
+    for (int i = 0; i < t->item_count; i++) {
+        if (t->items[i].id == id) return &t->items[i];
+    }
+    return NULL;
+}
+
+static void benchLookup()
+{
+    const int sizes[] = { 10, 100, 500, 1000, 5000 };
+    const int lookups = 2000000;
+
+    printf("%8s %14s %14s\n", "items", "table ns/op", "search ns/op");
+    for (int size : sizes) {
+        teensy_t* t = TeensyControls_new_teensy();
+        registerItems(t, size);
+
+        unsigned int seed = 1;
+        int found = 0;
+        double start = benchSeconds();
+        for (int i = 0; i < lookups; i++) {
+            seed = seed * 1103515245 + 12345;
+            if (TeensyControls_find_item(t, (seed >> 8) % size)) found++;
+        }
+        double tableNs = (benchSeconds() - start) * 1e9 / lookups;
+
+        // The list walk is much slower so use fewer lookups
+        int listLookups = lookups / 20;
+        seed = 1;
+        start = benchSeconds();
+        for (int i = 0; i < listLookups; i++) {
+            seed = seed * 1103515245 + 12345;
+            if (listFind(t, (seed >> 8) % size)) found++;
+        }
+        double listNs = (benchSeconds() - start) * 1e9 / listLookups;
+
+        if (found != lookups + listLookups) {
+            printf("Lookup failed: found %d of %d\n", found, lookups + listLookups);
+        }
+        printf("%8d %14.1f %14.1f\n", size, tableNs, listNs);
+
+        t->online = 0;
+        t->input_thread_quit = 1;
+        t->output_thread_quit = 1;
+        quiet(true);
+        TeensyControls_delete_offline_teensy();
+        quiet(false);
+    }
+}
+
+// Mutex protected ring, same as TeensyControls_input_store/fetch used to be
+struct LockedRing {
+    pthread_mutex_t mutex;
+    volatile int head;
+    volatile int tail;
+    uint8_t buffer[64 * INPUT_BUFSIZE];
+};
+
+static int lockedStore(LockedRing* r, const uint8_t* packet)
+{
+    int stored = 0;
+    pthread_mutex_lock(&r->mutex);
+    int head = r->head;
+    if (++head >= INPUT_BUFSIZE) head = 0;
+    if (head != r->tail) {
+        memcpy(r->buffer + head * 64, packet, 64);
+        r->head = head;
+        stored = 1;
+    }
+    pthread_mutex_unlock(&r->mutex);
+    return stored;
+}
+
+static int lockedFetch(LockedRing* r, uint8_t* packet)
+{
+    pthread_mutex_lock(&r->mutex);
+    int tail = r->tail;
+    if (tail == r->head) {
+        pthread_mutex_unlock(&r->mutex);
+        return 0;
+    }
+    if (++tail >= INPUT_BUFSIZE) tail = 0;
+    memcpy(packet, r->buffer + tail * 64, 64);
+    r->tail = tail;
+    pthread_mutex_unlock(&r->mutex);
+    return 1;
+}
+
+struct RingBench {
+    teensy_t* t;
+    LockedRing* locked;
+    int count;
+    std::atomic<int> done;
+    int received;
+    int errors;
+};
+
+static void storeSeq(uint8_t* packet, int seq)
+{
+    memset(packet, 0, 64);
+    memcpy(packet, &seq, 4);
+    packet[63] = (uint8_t)seq;
+}
+
+// Producers retry when the ring is full so every packet must arrive in order
+static void checkSeq(RingBench* rb, const uint8_t* packet, int* last)
+{
+    int seq;
+    memcpy(&seq, packet, 4);
+    if (seq != *last + 1 || packet[63] != (uint8_t)seq) rb->errors++;
+    *last = seq;
+    rb->received++;
+}
+
+static void* inputProducer(void* arg)
+{
+    RingBench* rb = (RingBench*)arg;
+    uint8_t packet[64];
+
+    for (int i = 0; i < rb->count; i++) {
+        storeSeq(packet, i);
+        if (rb->locked) {
+            while (!lockedStore(rb->locked, packet)) sched_yield();
+        }
+        else {
+            while (!TeensyControls_input_store(rb->t, packet)) sched_yield();
+        }
+    }
+    rb->done = 1;
+    return NULL;
+}
+
+static void* outputConsumer(void* arg)
+{
+    RingBench* rb = (RingBench*)arg;
+    uint8_t packet[64];
+    int last = -1;
+
+    while (1) {
+        if (TeensyControls_output_fetch(rb->t, packet)) {
+            checkSeq(rb, packet, &last);
+        }
+        else if (rb->done) {
+            break;
+        }
+        else {
+            TeensyControls_output_wait(rb->t, 1000);
+        }
+    }
+    return NULL;
+}
+
+static void ringReport(const char* name, RingBench* rb, double secs)
+{
+    printf("%-20s %8.2f M packets/s  %d received  %d errors\n", name,
+        rb->received / secs / 1e6, rb->received, rb->errors);
+}
+
+static void benchRing()
+{
+    const int count = 5000000;
+    pthread_t th;
+    uint8_t packet[64];
+    int last;
+
+    teensy_t* t = TeensyControls_new_teensy();
+    LockedRing* locked = (LockedRing*)calloc(1, sizeof(LockedRing));
+    pthread_mutex_init(&locked->mutex, NULL);
+
+    // Input ring: USB thread stores, main thread fetches
+    for (int pass = 0; pass < 2; pass++) {
+        RingBench rb;
+        rb.t = t;
+        rb.locked = (pass == 0) ? locked : NULL;
+        rb.count = count;
+        rb.done = 0;
+        rb.received = 0;
+        rb.errors = 0;
+        last = -1;
+
+        double start = benchSeconds();
+        pthread_create(&th, NULL, inputProducer, &rb);
+        while (1) {
+            int got = rb.locked ? lockedFetch(rb.locked, packet) : TeensyControls_input_fetch(t, packet);
+            if (got) {
+                checkSeq(&rb, packet, &last);
+            }
+            else if (!rb.done) {
+                sched_yield();
+            }
+            else {
+                // Producer finished, drain anything stored after the check
+                got = rb.locked ? lockedFetch(rb.locked, packet) : TeensyControls_input_fetch(t, packet);
+                if (!got) break;
+                checkSeq(&rb, packet, &last);
+            }
+        }
+        pthread_join(th, NULL);
+        ringReport(rb.locked ? "input (mutex)" : "input (lock-free)", &rb, benchSeconds() - start);
+    }
+
+    // Output ring: main thread stores, output thread fetches and sleeps when idle
+    RingBench rb;
+    rb.t = t;
+    rb.locked = NULL;
+    rb.count = count;
+    rb.done = 0;
+    rb.received = 0;
+    rb.errors = 0;
+
+    double start = benchSeconds();
+    pthread_create(&th, NULL, outputConsumer, &rb);
+    for (int i = 0; i < count; i++) {
+        storeSeq(packet, i);
+        while (!TeensyControls_output_store(t, packet, 0)) sched_yield();
+    }
+    rb.done = 1;
+    pthread_mutex_lock(&t->output_mutex);
+    pthread_cond_signal(&t->output_event);
+    pthread_mutex_unlock(&t->output_mutex);
+    pthread_join(th, NULL);
+    ringReport("output (lock-free)", &rb, benchSeconds() - start);
+
+    pthread_mutex_destroy(&locked->mutex);
+    free(locked);
+    t->online = 0;
+    t->input_thread_quit = 1;
+    t->output_thread_quit = 1;
+    quiet(true);
+    TeensyControls_delete_offline_teensy();
+    quiet(false);
+}
+
+struct WakeupBench {
+    teensy_t* t;
+    int wakeFd;
+    int samples;
+    std::atomic<int> done;
+};
+
+// Stores a timestamped packet at random intervals, like a Teensy would
+static void* wakeupProducer(void* arg)
+{
+    WakeupBench* wb = (WakeupBench*)arg;
+    uint8_t packet[64];
+    uint64_t one = 1;
+    unsigned int seed = 1;
+
+    for (int i = 0; i < wb->samples; i++) {
+        seed = seed * 1103515245 + 12345;
+        usleep(1000 + (seed >> 8) % 40000);
+        double now = benchSeconds();
+        memset(packet, 0, 64);
+        memcpy(packet, &now, sizeof(now));
+        TeensyControls_input_store(wb->t, packet);
+        write(wb->wakeFd, &one, sizeof(one));
+    }
+    wb->done = 1;
+    write(wb->wakeFd, &one, sizeof(one));
+    return NULL;
+}
+
+static int wakeupFetch(WakeupBench* wb, double* latency, int count)
+{
+    uint8_t packet[64];
+    double sent;
+
+    while (TeensyControls_input_fetch(wb->t, packet)) {
+        memcpy(&sent, packet, sizeof(sent));
+        latency[count++] = (benchSeconds() - sent) * 1000;
+    }
+    return count;
+}
+
+static void wakeupReport(const char* name, double* latency, int count)
+{
+    std::sort(latency, latency + count);
+    double total = 0;
+    for (int i = 0; i < count; i++) {
+        total += latency[i];
+    }
+    printf("%-12s %8.3f ms mean %8.3f ms p50 %8.3f ms p99 %8.3f ms max\n", name,
+        total / count, latency[count / 2], latency[count * 99 / 100], latency[count - 1]);
+}
+
+static void benchWakeup()
+{
+    const int samples = 100;
+    double latency[samples];
+    pthread_t th;
+
+    teensy_t* t = TeensyControls_new_teensy();
+    WakeupBench wb;
+    wb.t = t;
+    wb.samples = samples;
+    wb.wakeFd = eventfd(0, EFD_NONBLOCK);
+
+    // Old main loop: process input then sleep for the rest of the frame
+    int count = 0;
+    wb.done = 0;
+    pthread_create(&th, NULL, wakeupProducer, &wb);
+    while (!wb.done) {
+        count = wakeupFetch(&wb, latency, count);
+        usleep(30000);
+    }
+    pthread_join(th, NULL);
+    count = wakeupFetch(&wb, latency, count);
+    wakeupReport("sleep 30 ms", latency, count);
+
+    // Event loop: wait on the eventfd signalled by the input thread
+    int epollFd = epoll_create1(0);
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = wb.wakeFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, wb.wakeFd, &event);
+
+    uint64_t value;
+    read(wb.wakeFd, &value, sizeof(value));
+    count = 0;
+    wb.done = 0;
+    pthread_create(&th, NULL, wakeupProducer, &wb);
+    while (!wb.done) {
+        if (epoll_wait(epollFd, &event, 1, -1) > 0) {
+            read(wb.wakeFd, &value, sizeof(value));
+            count = wakeupFetch(&wb, latency, count);
+        }
+    }
+    pthread_join(th, NULL);
+    count = wakeupFetch(&wb, latency, count);
+    wakeupReport("epoll", latency, count);
+
+    close(epollFd);
+    close(wb.wakeFd);
+    t->online = 0;
+    t->input_thread_quit = 1;
+    t->output_thread_quit = 1;
+    quiet(true);
+    TeensyControls_delete_offline_teensy();
+    quiet(false);
+}
+
+static int drainOutput(teensy_t* t)
+{
+    uint8_t packet[64];
+    int count = 0;
+
+    while (TeensyControls_output_fetch(t, packet)) {
+        count++;
+    }
+    return count;
+}
+
+// Same item scan that TeensyControls_output used to do every frame
+static int fullScan(teensy_t* t)
+{
+    int changed = 0;
+
+    for (int i = 0; i < t->item_count; i++) {
+        item_t* item = &t->items[i];
+        if (item->type == 1 && item->intval != item->intval_remote) changed++;
+        else if (item->type == 2 && item->floatval != item->floatval_remote) changed++;
+    }
+    return changed;
+}
+
+static void benchDirty()
+{
+    const int items = 2000;
+    const int frames = 5000;
+    const int changes = items / 100;
+
+    teensy_t* t = TeensyControls_new_teensy();
+    registerItems(t, items);
+
+    // Let the registration timeout pass and the initial values go out
+    quiet(true);
+    for (int i = 0; i <= ID_FRAME_TIMEOUT + 2 || t->dirty_count > 0; i++) {
+        TeensyControls_update_xplane(0);
+        TeensyControls_output(0, 0);
+        drainOutput(t);
+    }
+    quiet(false);
+
+    unsigned int seed = 1;
+    int reports = 0;
+    int scanned = 0;
+    double updateSecs = 0;
+    double outputSecs = 0;
+    double scanSecs = 0;
+
+    for (int frame = 0; frame < frames; frame++) {
+        for (int i = 0; i < changes; i++) {
+            seed = seed * 1103515245 + 12345;
+            benchValues[(seed >> 8) % items] += 1;
+        }
+
+        double start = benchSeconds();
+        TeensyControls_update_xplane(0);
+        double mid = benchSeconds();
+        scanned += fullScan(t);
+        double end = benchSeconds();
+        TeensyControls_output(0, 0);
+        outputSecs += benchSeconds() - end;
+        scanSecs += end - mid;
+        updateSecs += mid - start;
+        reports += drainOutput(t);
+    }
+
+    printf("%d items, %d changes per frame, %d frames\n", items, changes, frames);
+    printf("update_xplane       %8.2f us/frame\n", updateSecs * 1e6 / frames);
+    printf("output (dirty list) %8.2f us/frame  %.2f reports/frame\n", outputSecs * 1e6 / frames, (double)reports / frames);
+    printf("full item scan      %8.2f us/frame  %.2f changed/frame\n", scanSecs * 1e6 / frames, (double)scanned / frames);
+
+    t->online = 0;
+    t->input_thread_quit = 1;
+    t->output_thread_quit = 1;
+    quiet(true);
+    TeensyControls_delete_offline_teensy();
+    quiet(false);
+}
+
+struct CoalesceBench {
+    teensy_t* t;
+    int throttleMicros;
+    std::atomic<int> done;
+    std::atomic<int> lastValue;
+    int reports;
+    int values;
+};
+
+// Output thread for a slow endpoint: one report per throttleMicros
+static void* slowOutput(void* arg)
+{
+    CoalesceBench* cb = (CoalesceBench*)arg;
+    uint8_t packet[64];
+
+    while (!cb->done) {
+        if (!TeensyControls_output_fetch(cb->t, packet)) {
+            TeensyControls_output_wait(cb->t, 10);
+            continue;
+        }
+        usleep(cb->throttleMicros);
+        cb->reports++;
+        for (int i = 0; i < 64 && packet[i] >= 2 && i + packet[i] <= 64; i += packet[i]) {
+            if (packet[i + 1] == 2 && packet[i] == 10 && (packet[i + 2] | (packet[i + 3] << 8)) == 0) {
+                int32_t value;
+                memcpy(&value, &packet[i + 6], 4);
+                cb->lastValue = value;
+                cb->values++;
+            }
+        }
+    }
+    return NULL;
+}
+
+static bool benchCoalesce()
+{
+    const int frames = 500;
+    const int frameMicros = 2000;
+    pthread_t th;
+
+    teensy_t* t = TeensyControls_new_teensy();
+    registerItems(t, 1);
+
+    CoalesceBench cb;
+    cb.t = t;
+    cb.throttleMicros = 20000;
+    cb.done = 0;
+    cb.lastValue = -1;
+    cb.reports = 0;
+    cb.values = 0;
+    pthread_create(&th, NULL, slowOutput, &cb);
+
+    // Needle moves every frame, ten times faster than the endpoint takes reports
+    quiet(true);
+    for (int frame = 0; frame < frames; frame++) {
+        benchValues[0] = frame + 1;
+        TeensyControls_update_xplane(0);
+        TeensyControls_output(0, 0);
+        usleep(frameMicros);
+    }
+
+    // Keep running frames without changes until the latest value arrives
+    for (int wait = 0; wait < 500 && cb.lastValue != frames; wait++) {
+        TeensyControls_update_xplane(0);
+        TeensyControls_output(0, 0);
+        usleep(frameMicros);
+    }
+    quiet(false);
+
+    cb.done = 1;
+    pthread_join(th, NULL);
+
+    printf("%d frames, endpoint takes one report per %d ms\n", frames, cb.throttleMicros / 1000);
+    printf("%d reports sent, %d values sent, %u frames deferred\n", cb.reports, cb.values, t->output_deferred);
+    printf("latest value %d, received %d\n", frames, (int)cb.lastValue);
+
+    bool pass = (cb.lastValue == frames && cb.reports < frames / 2);
+    printf("%s\n", pass ? "PASS" : "FAIL");
+
+    t->online = 0;
+    t->input_thread_quit = 1;
+    t->output_thread_quit = 1;
+    quiet(true);
+    TeensyControls_delete_offline_teensy();
+    quiet(false);
+    return pass;
+}
+
+// Packs messages into 64 byte reports the way the Teensy library does:
+// back to back, a new report when the next message doesn't fit, and a
+// message longer than a report started in the current one and continued
+// in 0xFF fragments.
+struct StreamWriter {
+    uint8_t* reports;
+    int maxReports;
+    int count;
+    int pos;
+    int messages;
+    int fragments;
+};
+
+static void streamFlush(StreamWriter* sw)
+{
+    if (sw->pos > 0) {
+        sw->count++;
+        sw->pos = 0;
+    }
+}
+
+static bool streamAdd(StreamWriter* sw, const uint8_t* msg, int len)
+{
+    if (sw->count + (len + 63) / 61 + 2 > sw->maxReports) return false;
+    if (64 - sw->pos < 3 || (len <= 64 && sw->pos + len > 64)) {
+        streamFlush(sw);
+    }
+
+    uint8_t* report = sw->reports + sw->count * 64;
+    int part = std::min(len, 64 - sw->pos);
+    memcpy(report + sw->pos, msg, part);
+    sw->pos += part;
+
+    uint8_t fragmentId = 1;
+    while (part < len) {
+        streamFlush(sw);
+        report = sw->reports + sw->count * 64;
+        int chunk = std::min(len - part, 61);
+        report[0] = chunk + 3;
+        report[1] = 0xFF;
+        report[2] = fragmentId++;
+        memcpy(report + 3, msg + part, chunk);
+        sw->pos = chunk + 3;
+        part += chunk;
+        sw->fragments++;
+    }
+    if (sw->pos == 64) streamFlush(sw);
+    sw->messages++;
+    return true;
+}
+
+static bool streamRegister(StreamWriter* sw, int id, int type, const char* name)
+{
+    uint8_t msg[256];
+    int len = strlen(name);
+
+    msg[0] = len + 6;
+    msg[1] = 1;
+    msg[2] = id & 255;
+    msg[3] = id >> 8;
+    msg[4] = type;
+    msg[5] = 0;
+    memcpy(msg + 6, name, len);
+    return streamAdd(sw, msg, len + 6);
+}
+
+static bool streamWrite(StreamWriter* sw, int id, int type, int32_t value)
+{
+    uint8_t msg[10];
+
+    msg[0] = 10;
+    msg[1] = 2;
+    msg[2] = id & 255;
+    msg[3] = id >> 8;
+    msg[4] = type;
+    msg[5] = 0;
+    memcpy(msg + 6, &value, 4);
+    return streamAdd(sw, msg, 10);
+}
+
+static bool streamCommand(StreamWriter* sw, int id, int cmd)
+{
+    uint8_t msg[4];
+
+    msg[0] = 4;
+    msg[1] = cmd;
+    msg[2] = id & 255;
+    msg[3] = id >> 8;
+    return streamAdd(sw, msg, 4);
+}
+
+// Every 16th item has a name long enough to need fragments
+static void streamItemName(char* name, int id)
+{
+    int len = sprintf(name, "bench/item_%d", id);
+    if (id % 16 == 0) {
+        int target = 70 + (id * 37) % 180;
+        for (; len < target; len++) {
+            name[len] = 'a' + len % 26;
+        }
+        name[len] = 0;
+    }
+}
+
+// Registration of every item, then a traffic mix of int/float writes,
+// command begin/end/once, re-registration of long names and long string
+// writes. expected gets the last value written to each item. Returns
+// the number of reports used for registration.
+static int buildStream(StreamWriter* sw, int items, double* expected)
+{
+    char name[256];
+    unsigned int seed = 1;
+
+    for (int id = 0; id < items; id++) {
+        streamItemName(name, id);
+        streamRegister(sw, id, 1 + (id & 1), name);
+    }
+    streamFlush(sw);
+    int registerReports = sw->count;
+
+    bool room = true;
+    while (room) {
+        seed = seed * 1103515245 + 12345;
+        int pick = (seed >> 8) % 100;
+        int id = (seed >> 16) % items;
+
+        if (pick < 75) {
+            int32_t value = (seed >> 4) & 0xFFFF;
+            if ((id & 1) == 0) {
+                room = streamWrite(sw, id, 1, value);
+                if (room) expected[id] = value;
+            }
+            else {
+                float f = value * 0.5f;
+                int32_t bits;
+                memcpy(&bits, &f, 4);
+                room = streamWrite(sw, id, 2, bits);
+                if (room) expected[id] = f;
+            }
+        }
+        else if (pick < 95) {
+            room = streamCommand(sw, id, 4 + pick % 3);
+        }
+        else if (pick < 97) {
+            streamItemName(name, id & ~15);
+            room = streamRegister(sw, id & ~15, 1, name);
+        }
+        else {
+            uint8_t msg[256];
+            int len = 70 + (seed >> 20) % 180;
+            msg[0] = len;
+            msg[1] = 2;
+            msg[2] = id & 255;
+            msg[3] = id >> 8;
+            msg[4] = 4;
+            msg[5] = 0;
+            memset(msg + 6, 'S', len - 6);
+            room = streamAdd(sw, msg, len);
+        }
+    }
+    streamFlush(sw);
+    return registerReports;
+}
+
+// Feeds reports through the input ring and decodes them, as the input
+// thread and main loop would, a ring full at a time
+static double decodeReports(teensy_t* t, const uint8_t* reports, int count)
+{
+    double start = benchSeconds();
+    int done = 0;
+    while (done < count) {
+        int n = std::min(count - done, INPUT_BUFSIZE - 1);
+        n = TeensyControls_input_store_batch(t, reports + done * 64, n, 0);
+        TeensyControls_input(0, 0);
+        done += n;
+    }
+    return benchSeconds() - start;
+}
+
+static bool benchDecode()
+{
+    const int items = 500;
+    const int maxReports = 200000;
+    const int passes = 10;
+    static double expected[items];
+
+    StreamWriter sw;
+    memset(&sw, 0, sizeof(sw));
+    sw.maxReports = maxReports;
+    sw.reports = (uint8_t*)calloc(maxReports, 64);
+    for (int i = 0; i < items; i++) {
+        expected[i] = 0;
+    }
+    int registerReports = buildStream(&sw, items, expected);
+
+    teensy_t* t = TeensyControls_new_teensy();
+    quiet(true);
+    double regSecs = decodeReports(t, sw.reports, registerReports);
+    double trafficSecs = 0;
+    for (int pass = 0; pass < passes; pass++) {
+        trafficSecs += decodeReports(t, sw.reports + registerReports * 64, sw.count - registerReports);
+    }
+    quiet(false);
+
+    int trafficReports = (sw.count - registerReports) * passes;
+    printf("%d items, %d registration reports, %d traffic reports x %d passes\n",
+        items, registerReports, sw.count - registerReports, passes);
+    printf("%d messages, %d fragments\n", sw.messages, sw.fragments);
+    printf("registration %8.2f M reports/s\n", registerReports / regSecs / 1e6);
+    printf("traffic      %8.2f M reports/s\n", trafficReports / trafficSecs / 1e6);
+
+    // Every item must be registered and hold the last value written to it
+    int errors = 0;
+    if (t->item_count != items) errors++;
+    for (int id = 0; id < items; id++) {
+        item_t* item = TeensyControls_find_item(t, id);
+        if (!item) {
+            errors++;
+        }
+        else if (item->type == 1 && item->intval != (int32_t)expected[id]) {
+            errors++;
+        }
+        else if (item->type == 2 && item->floatval != expected[id]) {
+            errors++;
+        }
+    }
+    printf("%d items registered, %d errors\n", t->item_count, errors);
+    printf("%s\n", errors == 0 ? "PASS" : "FAIL");
+
+    free(sw.reports);
+    t->online = 0;
+    t->input_thread_quit = 1;
+    t->output_thread_quit = 1;
+    quiet(true);
+    TeensyControls_delete_offline_teensy();
+    quiet(false);
+    return errors == 0;
+}
+
+static int fuzzRand(unsigned int* seed, int range)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return (*seed >> 8) % range;
+}
+
+// Copies a valid stream, mangling some of its reports the ways a bad
+// cable or a buggy sketch might: bit flips, bad lengths, garbage, and
+// dropped, repeated or reordered reports, which interleave fragments
+static int fuzzStream(const uint8_t* in, int count, uint8_t* out, unsigned int* seed, int percent)
+{
+    int n = 0;
+
+    for (int i = 0; i < count; i++) {
+        const uint8_t* report = in + i * 64;
+        uint8_t* dest = out + n * 64;
+
+        if (fuzzRand(seed, 100) >= percent) {
+            memcpy(dest, report, 64);
+            n++;
+            continue;
+        }
+        switch (fuzzRand(seed, 7)) {
+        case 0: // flip a bit
+            memcpy(dest, report, 64);
+            dest[fuzzRand(seed, 64)] ^= 1 << fuzzRand(seed, 8);
+            n++;
+            break;
+        case 1: // bad length byte
+            memcpy(dest, report, 64);
+            dest[fuzzRand(seed, 64)] = fuzzRand(seed, 256);
+            n++;
+            break;
+        case 2: // garbage, often posing as a fragment
+            for (int j = 0; j < 64; j++) {
+                dest[j] = fuzzRand(seed, 256);
+            }
+            if (fuzzRand(seed, 2)) dest[1] = 0xFF;
+            n++;
+            break;
+        case 3: // dropped
+            break;
+        case 4: // repeated
+            memcpy(dest, report, 64);
+            memcpy(dest + 64, report, 64);
+            n += 2;
+            break;
+        case 5: // swapped with the next report
+            if (i + 1 < count) {
+                memcpy(dest, report + 64, 64);
+                memcpy(dest + 64, report, 64);
+                n += 2;
+                i++;
+            }
+            break;
+        case 6: // cut short
+            memcpy(dest, report, 64);
+            memset(dest + fuzzRand(seed, 64), 0, 1);
+            n++;
+            break;
+        }
+    }
+    return n;
+}
+
+// Two long messages whose fragments take turns, which the protocol
+// doesn't allow, so both must be dropped without harm
+static int interleavedStream(uint8_t* out, int pairs, unsigned int* seed)
+{
+    uint8_t* msg[2];
+    int total = 0;
+
+    for (int pair = 0; pair < pairs; pair++) {
+        StreamWriter sw[2];
+        for (int k = 0; k < 2; k++) {
+            uint8_t long_msg[256];
+            int len = 70 + fuzzRand(seed, 180);
+            long_msg[0] = len;
+            long_msg[1] = 2;
+            long_msg[2] = fuzzRand(seed, 256);
+            long_msg[3] = 0;
+            long_msg[4] = 4;
+            long_msg[5] = 0;
+            memset(long_msg + 6, 'I', len - 6);
+            memset(&sw[k], 0, sizeof(sw[k]));
+            msg[k] = (uint8_t*)calloc(6, 64);
+            sw[k].reports = msg[k];
+            sw[k].maxReports = 6;
+            streamAdd(&sw[k], long_msg, len);
+            streamFlush(&sw[k]);
+        }
+        for (int r = 0; r < sw[0].count || r < sw[1].count; r++) {
+            for (int k = 0; k < 2; k++) {
+                if (r < sw[k].count) {
+                    memcpy(out + total * 64, msg[k] + r * 64, 64);
+                    total++;
+                }
+            }
+        }
+        free(msg[0]);
+        free(msg[1]);
+    }
+    return total;
+}
+
+// Decodes one report at a time and checks the reassembly state after
+// each, returning the number of broken invariants
+static int fuzzDecode(teensy_t* t, const uint8_t* reports, int count)
+{
+    int errors = 0;
+
+    for (int i = 0; i < count; i++) {
+        TeensyControls_input_store(t, reports + i * 64);
+        TeensyControls_input(0, 0);
+        if (t->expect_fragment_id == 0) continue;
+        int used = t->input_packet_ptr - t->input_packet;
+        if (used < 0 || used > (int)sizeof(t->input_packet) || t->input_packet_bytes_missing <= 0 ||
+            used + t->input_packet_bytes_missing != t->input_packet[0]) {
+            errors++;
+        }
+    }
+    return errors;
+}
+
+// Writes a fresh value to every item, which must all arrive however
+// confused the decoder was before
+static int fuzzRecover(teensy_t* t, int items, int round)
+{
+    StreamWriter sw;
+    int errors = 0;
+
+    memset(&sw, 0, sizeof(sw));
+    sw.maxReports = items;
+    sw.reports = (uint8_t*)calloc(items, 64);
+    for (int id = 0; id < items; id++) {
+        int32_t value = round * 1000 + id;
+        if ((id & 1) == 0) {
+            streamWrite(&sw, id, 1, value);
+        }
+        else {
+            float f = value * 0.5f;
+            int32_t bits;
+            memcpy(&bits, &f, 4);
+            streamWrite(&sw, id, 2, bits);
+        }
+    }
+    streamFlush(&sw);
+    decodeReports(t, sw.reports, sw.count);
+    free(sw.reports);
+
+    for (int id = 0; id < items; id++) {
+        item_t* item = TeensyControls_find_item(t, id);
+        int32_t value = round * 1000 + id;
+        if (!item) {
+            errors++;
+        }
+        else if (item->type == 1 && item->intval != value) {
+            errors++;
+        }
+        else if (item->type == 2 && item->floatval != value * 0.5f) {
+            errors++;
+        }
+    }
+    return errors;
+}
+
+static bool benchFuzz()
+{
+    const int items = 500;
+    const int maxReports = 50000;
+    const int rounds = 20;
+    static double expected[items];
+
+    StreamWriter sw;
+    memset(&sw, 0, sizeof(sw));
+    sw.maxReports = maxReports;
+    sw.reports = (uint8_t*)calloc(maxReports, 64);
+    int registerReports = buildStream(&sw, items, expected);
+    const uint8_t* traffic = sw.reports + registerReports * 64;
+    int trafficCount = sw.count - registerReports;
+    uint8_t* fuzzed = (uint8_t*)calloc(maxReports * 2, 64);
+
+    teensy_t* t = TeensyControls_new_teensy();
+    quiet(true);
+    decodeReports(t, sw.reports, registerReports);
+
+    unsigned int seed = 1;
+    int invariantErrors = 0;
+    int recoverErrors = 0;
+    int fuzzedReports = 0;
+    double fuzzSecs = 0;
+    double cleanSecs = 0;
+    for (int round = 0; round < rounds; round++) {
+        int percent = 1 + round * 2;
+        int count = fuzzStream(traffic, trafficCount, fuzzed, &seed, percent);
+        invariantErrors += fuzzDecode(t, fuzzed, count);
+        recoverErrors += fuzzRecover(t, items, round * 2);
+
+        count = interleavedStream(fuzzed, 200, &seed);
+        invariantErrors += fuzzDecode(t, fuzzed, count);
+        recoverErrors += fuzzRecover(t, items, round * 2 + 1);
+
+        // Throughput, fed a ring full at a time like the real input thread
+        count = fuzzStream(traffic, trafficCount, fuzzed, &seed, percent);
+        fuzzSecs += decodeReports(t, fuzzed, count);
+        fuzzedReports += count;
+        cleanSecs += decodeReports(t, traffic, trafficCount);
+    }
+    quiet(false);
+
+    printf("%d rounds of %d reports, 1%% to %d%% of reports mangled\n", rounds, trafficCount, 1 + (rounds - 1) * 2);
+    printf("clean stream   %8.2f M reports/s\n", (double)trafficCount * rounds / cleanSecs / 1e6);
+    printf("fuzzed stream  %8.2f M reports/s\n", fuzzedReports / fuzzSecs / 1e6);
+    printf("%d reassembly errors, %d values lost after recovery\n", invariantErrors, recoverErrors);
+
+    bool pass = (invariantErrors == 0 && recoverErrors == 0);
+    printf("%s\n", pass ? "PASS" : "FAIL");
+
+    free(fuzzed);
+    free(sw.reports);
+    t->online = 0;
+    t->input_thread_quit = 1;
+    t->output_thread_quit = 1;
+    quiet(true);
+    TeensyControls_delete_offline_teensy();
+    quiet(false);
+    return pass;
+}
+
+// Data Ref name lookup as done for each 0x01 registration. The names
+// arrive as raw bytes and a length, like TeensyControls_new_item gets.
+static bool benchNames()
+{
+    const int mappings = 256;
+    const int lookups = 2000000;
+    static char pool[mappings * 64];
+    std::map<std::string, int> dataMap;
+    NameIndex index;
+    char raw[64];
+
+    nameIndexInit(&index, mappings, pool);
+    int poolSize = 0;
+    for (int i = 0; i < mappings; i++) {
+        int len = sprintf(pool + poolSize, "sim/cockpit/%s/item_%d", (i & 1) ? "radios" : "autopilot", i);
+        dataMap.insert(std::make_pair(std::string(pool + poolSize), i));
+        nameIndexAdd(&index, poolSize, i);
+        poolSize += len + 1;
+    }
+
+    unsigned int seed = 1;
+    int errors = 0;
+    double start = benchSeconds();
+    for (int i = 0; i < lookups; i++) {
+        seed = seed * 1103515245 + 12345;
+        int want = (seed >> 8) % (mappings + 16);
+        int len = sprintf(raw, "sim/cockpit/%s/item_%d", (want & 1) ? "radios" : "autopilot", want);
+        raw[len] = 0;
+        int found = dataMap.count(raw) ? dataMap[raw] : -1;
+        if (found != (want < mappings ? want : -1)) errors++;
+    }
+    double mapNs = (benchSeconds() - start) * 1e9 / lookups;
+
+    seed = 1;
+    start = benchSeconds();
+    for (int i = 0; i < lookups; i++) {
+        seed = seed * 1103515245 + 12345;
+        int want = (seed >> 8) % (mappings + 16);
+        int len = sprintf(raw, "sim/cockpit/%s/item_%d", (want & 1) ? "radios" : "autopilot", want);
+        int found = nameIndexFind(&index, raw, len);
+        if (found != (want < mappings ? want : -1)) errors++;
+    }
+    double indexNs = (benchSeconds() - start) * 1e9 / lookups;
+
+    // Building the name costs the same in both so measure it on its own
+    seed = 1;
+    start = benchSeconds();
+    for (int i = 0; i < lookups; i++) {
+        seed = seed * 1103515245 + 12345;
+        int want = (seed >> 8) % (mappings + 16);
+        sprintf(raw, "sim/cockpit/%s/item_%d", (want & 1) ? "radios" : "autopilot", want);
+    }
+    double nameNs = (benchSeconds() - start) * 1e9 / lookups;
+
+    printf("%d mappings, 6%% of lookups unmapped\n", mappings);
+    printf("std::map      %8.1f ns/lookup\n", mapNs - nameNs);
+    printf("hash index    %8.1f ns/lookup\n", indexNs - nameNs);
+    printf("%d errors\n", errors);
+    nameIndexFree(&index);
+    return errors == 0;
+}
+
+static double timeMappingLoad(const char* path, MappingTable** table)
+{
+    quiet(true);
+    double start = benchSeconds();
+    *table = mappingLoad(path);
+    double secs = benchSeconds() - start;
+    quiet(false);
+    return secs;
+}
+
+static bool sameMappings(const MappingTable* a, const MappingTable* b)
+{
+    if (!a || !b || a->count != b->count) return false;
+    for (int i = 0; i < a->count; i++) {
+        const DataMapping* m = &a->mapping[i];
+        const DataMapping* n = &b->mapping[i];
+        if (strcmp(m->dataRef, n->dataRef) != 0 || strcmp(m->readVar, n->readVar) != 0 ||
+            strcmp(m->readVarUnits, n->readVarUnits) != 0 || strcmp(m->writeVar, n->writeVar) != 0 ||
+            strcmp(m->writeVarUnits, n->writeVarUnits) != 0 || m->readScale != n->readScale ||
+            m->writeScale != n->writeScale || m->testValue != n->testValue || m->testAdjust != n->testAdjust) {
+            return false;
+        }
+        const char* name = m->dataRef;
+        if (nameIndexFind(&b->index, name, strlen(name)) != i) return false;
+    }
+    return true;
+}
+
+// Loads a large mapping file by parsing the text, then from the cache
+// the parse left behind, then checks a damaged or stale cache is not used
+// Points the first used index slot past the end of the string pool and
+// fixes up the checksum, so only the slot checks can catch it. The header
+// is 16 words: count, indexSize, poolSize and checksum are words 6, 7, 9
+// and 10, and recordSize is word 2.
+static bool forgeCacheSlot(const char* cachePath)
+{
+    const size_t headerSize = 16 * sizeof(uint32_t);
+    FILE* f = fopen(cachePath, "rb");
+    if (!f) {
+        return false;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t* data = (uint8_t*)malloc(size);
+    bool ok = fread(data, 1, size, f) == (size_t)size;
+    fclose(f);
+
+    uint32_t* header = (uint32_t*)data;
+    NameIndexSlot* slots = (NameIndexSlot*)(data + headerSize + (size_t)header[6] * header[2]);
+    ok = ok && (long)headerSize <= size;
+    for (uint32_t i = 0; ok && i < header[7]; i++) {
+        if (slots[i].value != -1) {
+            slots[i].name = header[9];
+            break;
+        }
+    }
+    uint32_t hash = 2166136261u;
+    for (long i = headerSize; i < size; i++) {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    header[10] = hash;
+
+    f = ok ? fopen(cachePath, "wb") : NULL;
+    ok = f && fwrite(data, 1, size, f) == (size_t)size;
+    if (f) {
+        fclose(f);
+    }
+    free(data);
+    return ok;
+}
+
+static bool benchMappings()
+{
+    const int lines = 2000;
+    const char* path = "/tmp/teensy-bench-mapping.txt";
+    const char* cachePath = "/tmp/teensy-bench-mapping.txt.cache";
+
+    FILE* outf = fopen(path, "w");
+    if (!outf) {
+        printf("Unable to write %s\n", path);
+        return false;
+    }
+    fprintf(outf, "# Generated by teensy-bench\n");
+    for (int i = 0; i < lines; i++) {
+        switch (i % 4) {
+        case 0: fprintf(outf, "sim/bench/test_%d; %d+1\n", i, i); break;
+        case 1: fprintf(outf, "sim/bench/radio_%d; COM ACTIVE FREQUENCY:%d, 10khz\n", i, i % 3 + 1); break;
+        case 2: fprintf(outf, "sim/bench/gauge_%d ; INDICATED ALTITUDE, feet ; L:BENCH_%d, feet   # comment\n", i, i); break;
+        case 3: fprintf(outf, "\tsim/bench/switch_%d;  LIGHT LANDING, bool\n\n", i); break;
+        }
+    }
+    fclose(outf);
+    remove(cachePath);
+
+    MappingTable* parsed;
+    MappingTable* cached;
+    double parseSecs = timeMappingLoad(path, &parsed);
+    double cacheSecs = timeMappingLoad(path, &cached);
+    bool pass = parsed && cached && !parsed->cache && cached->cache && sameMappings(parsed, cached);
+
+    printf("%d mappings\n", parsed ? parsed->count : 0);
+    printf("parse text     %8.3f ms\n", parseSecs * 1000);
+    printf("mapped cache   %8.3f ms\n", cacheSecs * 1000);
+    mappingFree(cached);
+
+    // Damage the cache, it must be parsed again
+    int fd = open(cachePath, O_RDWR);
+    if (fd >= 0) {
+        uint8_t b;
+        pread(fd, &b, 1, 5000);
+        b ^= 0xFF;
+        pwrite(fd, &b, 1, 5000);
+        close(fd);
+    }
+    timeMappingLoad(path, &cached);
+    bool damaged = cached && !cached->cache && sameMappings(parsed, cached);
+    mappingFree(cached);
+
+    // A cache with a good checksum but a slot outside the pool
+    timeMappingLoad(path, &cached);
+    mappingFree(cached);
+    bool forged = forgeCacheSlot(cachePath);
+    timeMappingLoad(path, &cached);
+    bool badSlot = forged && cached && !cached->cache && sameMappings(parsed, cached);
+    mappingFree(cached);
+
+    // Change the text, the old cache must not be used
+    outf = fopen(path, "a");
+    fprintf(outf, "sim/bench/extra; 1\n");
+    fclose(outf);
+    timeMappingLoad(path, &cached);
+    bool stale = cached && !cached->cache && cached->count == parsed->count + 1;
+    mappingFree(cached);
+
+    printf("damaged cache %s, bad index slot %s, changed text %s\n", damaged ? "reparsed" : "USED",
+        badSlot ? "reparsed" : "USED", stale ? "reparsed" : "IGNORED");
+    pass = pass && damaged && badSlot && stale;
+    printf("%s\n", pass ? "PASS" : "FAIL");
+
+    mappingFree(parsed);
+    remove(path);
+    remove(cachePath);
+    return pass;
+}
+
+struct BounceEdge {
+    uint64_t time;      // usec
+    int level;          // 0 = pressed
+};
+
+// Presses of 20 to 150 ms with gaps of 20 to 300 ms, a third of them
+// shorter than a frame. Each change of level bounces up to 4 times in
+// the next 3 ms, as a cheap push button does.
+static int bounceStream(BounceEdge* edges, int presses, uint64_t* pressTimes)
+{
+    unsigned int seed = 7;
+    uint64_t time = 1000000;
+    int count = 0;
+
+    for (int i = 0; i < presses; i++) {
+        for (int level = 0; level < 2; level++) {
+            uint64_t start = time;
+            int bounces = rand_r(&seed) % 5;
+            edges[count].time = time;
+            edges[count].level = level;
+            count++;
+            for (int j = 0; j < bounces; j++) {
+                time += 100 + rand_r(&seed) % 500;
+                edges[count].time = time;
+                edges[count].level = 1 - level;
+                count++;
+                time += 100 + rand_r(&seed) % 500;
+                edges[count].time = time;
+                edges[count].level = level;
+                count++;
+            }
+
+            if (level == 0) {
+                pressTimes[i] = start;
+                int held = (i % 3 == 0) ? 20 + rand_r(&seed) % 10 : 30 + rand_r(&seed) % 120;
+                time = start + held * 1000;
+            }
+            else {
+                time = start + (20 + rand_r(&seed) % 280) * 1000;
+            }
+        }
+    }
+    return count;
+}
+
+// Compares reading the pins once per 30 ms frame with feeding kernel
+// timestamped edges to the debounce engine, as the gpiod backend does.
+// Polling misses presses shorter than a frame and is late by up to a
+// frame. Sampled levels through the engine, as the WiringPi backend
+// does, are shown too.
+static bool benchDebounce()
+{
+    const int presses = 5000;
+    const uint64_t frame = 30000;
+    const int debounceMs = 10;
+    static BounceEdge edges[presses * 18];
+    static uint64_t pressTimes[presses];
+
+    int count = bounceStream(edges, presses, pressTimes);
+    uint64_t end = edges[count - 1].time + frame * 2;
+
+    // Polled every frame, a press is a low sample after a high one
+    int polled = 0;
+    double polledDelay = 0;
+    int e = 0;
+    int level = 1;
+    int prev = 1;
+    int nextPress = 0;
+    for (uint64_t now = frame; now < end; now += frame) {
+        while (e < count && edges[e].time <= now) {
+            level = edges[e].level;
+            e++;
+        }
+        while (nextPress < presses - 1 && pressTimes[nextPress + 1] <= now) {
+            nextPress++;
+        }
+        if (level == 0 && prev == 1) {
+            polled++;
+            polledDelay += now - pressTimes[nextPress];
+        }
+        prev = level;
+    }
+
+    // Sampled every frame through the debounce engine
+    Debounce sampled;
+    debounceInit(&sampled, 1, debounceMs, 0);
+    int sampledPresses = 0;
+    e = 0;
+    level = 1;
+    for (uint64_t now = frame; now < end; now += frame) {
+        while (e < count && edges[e].time <= now) {
+            level = edges[e].level;
+            e++;
+        }
+        debounceEdge(&sampled, level, now);
+        debounceUpdate(&sampled, now);
+        sampledPresses += debounceTakePresses(&sampled);
+    }
+
+    // Edge events, read as they arrive and on every frame
+    Debounce edged;
+    debounceInit(&edged, 1, debounceMs, 0);
+    int edgePresses = 0;
+    int edgeLate = 0;
+    nextPress = 0;
+    uint64_t nextFrame = frame;
+    double start = benchSeconds();
+    for (e = 0; e < count; e++) {
+        while (nextFrame < edges[e].time) {
+            debounceUpdate(&edged, nextFrame);
+            edgePresses += debounceTakePresses(&edged);
+            nextFrame += frame;
+        }
+        debounceEdge(&edged, edges[e].level, edges[e].time);
+        debounceUpdate(&edged, edges[e].time);
+        int taken = debounceTakePresses(&edged);
+        if (taken) {
+            while (nextPress < presses - 1 && pressTimes[nextPress + 1] <= edges[e].time) {
+                nextPress++;
+            }
+            if (edged.changed != pressTimes[nextPress]) {
+                edgeLate++;
+            }
+        }
+        edgePresses += taken;
+    }
+    debounceUpdate(&edged, end);
+    edgePresses += debounceTakePresses(&edged);
+    double engineNs = (benchSeconds() - start) * 1e9 / count;
+
+    printf("%d presses, %d edges with bounces, %d ms debounce\n", presses, count, debounceMs);
+    printf("polled per frame     %5d presses, %5.1f ms late on average\n", polled, polledDelay / polled / 1000);
+    printf("sampled via engine   %5d presses\n", sampledPresses);
+    printf("edge events          %5d presses, %d not at the first edge\n", edgePresses, edgeLate);
+    printf("engine               %5.1f ns/edge\n", engineNs);
+
+    bool pass = (edgePresses == presses && edgeLate == 0);
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    return pass;
+}
+
+// Adjusts made while a button is held for 3 s, reading it on frames
+// that are a steady 30 ms, a steady 45 ms, or 5 to 60 ms at random.
+// One adjust per frame depends on the frames. The action engine, woken
+// when a repeat is due as the repeat timerfd does, must not.
+static int holdAdjusts(const ButtonRepeat* repeat, int profile, bool perFrame, uint64_t* lastAdjust)
+{
+    const uint64_t press = 1000000;
+    const uint64_t release = press + 3000000;
+    unsigned int seed = 3;
+    ButtonAction action;
+    int adjusts = 1;
+
+    buttonActionInit(&action, repeat);
+    buttonActionPress(&action, press);
+    *lastAdjust = press;
+
+    uint64_t frame = press;
+    while (true) {
+        if (profile == 0) {
+            frame += 30000;
+        }
+        else if (profile == 1) {
+            frame += 45000;
+        }
+        else {
+            frame += 5000 + rand_r(&seed) % 55000;
+        }
+
+        uint64_t now = frame;
+        uint64_t due = buttonActionNext(&action);
+        if (!perFrame && due != 0 && due < now) {
+            now = due;
+            frame = due;
+        }
+        if (now >= release) {
+            break;
+        }
+
+        int count = perFrame ? 1 : buttonActionRun(&action, now);
+        if (count > 0) {
+            adjusts += count;
+            *lastAdjust = now;
+        }
+    }
+    return adjusts;
+}
+
+static bool benchRepeat()
+{
+    const char* profiles[] = { "30 ms frames", "45 ms frames", "jittery frames" };
+    ButtonRepeat steady;
+    ButtonRepeat accel;
+
+    buttonRepeatDefaults(&steady);
+    steady.delayMs = 400;
+    steady.repeatMs = 100;
+    accel = steady;
+    accel.accel = 0.85;
+    accel.fastestMs = 20;
+
+    printf("3 s hold, delay=400 repeat=100, and with accel=0.85 fastest=20\n");
+    printf("                 per frame   engine  accelerated\n");
+
+    bool pass = true;
+    int steadyFirst = 0;
+    int accelFirst = 0;
+    for (int profile = 0; profile < 3; profile++) {
+        uint64_t last;
+        int perFrame = holdAdjusts(&steady, profile, true, &last);
+        int engine = holdAdjusts(&steady, profile, false, &last);
+        int accelerated = holdAdjusts(&accel, profile, false, &last);
+        printf("%-16s %9d %8d %12d\n", profiles[profile], perFrame, engine, accelerated);
+
+        if (profile == 0) {
+            steadyFirst = engine;
+            accelFirst = accelerated;
+        }
+        else if (engine != steadyFirst || accelerated != accelFirst) {
+            pass = false;
+        }
+    }
+
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    return pass;
+}
+
+// Counts the values written in the queued output reports
+static int drainValues(teensy_t* t)
+{
+    uint8_t packet[64];
+    int values = 0;
+
+    while (TeensyControls_output_fetch(t, packet)) {
+        for (int i = 0; i < 64 && packet[i] >= 2 && i + packet[i] <= 64; i += packet[i]) {
+            if (packet[i + 1] == 2) {
+                values++;
+            }
+            else if (packet[i + 1] == 8) {
+                values += packet[i + 3];
+            }
+        }
+    }
+    return values;
+}
+
+// Values like airspeed that drift slowly but jitter in the third decimal
+// every frame, with ints that flicker by one now and then. Returns the
+// values sent over one second of 10 ms frames.
+static int jitterValues(int items, double deadband, int minInterval, uint32_t* suppressed)
+{
+    benchDeadband = deadband;
+    benchMinInterval = minInterval;
+    teensy_t* t = TeensyControls_new_teensy();
+    registerItems(t, items);
+    for (int i = 0; i < items; i++) {
+        benchValues[i] = 100 + i;
+    }
+
+    quiet(true);
+    for (int i = 0; i <= ID_FRAME_TIMEOUT + 2; i++) {
+        TeensyControls_update_xplane(0);
+        TeensyControls_output(0, 0);
+        drainOutput(t);
+    }
+    quiet(false);
+
+    unsigned int seed = 1;
+    int values = 0;
+    t->output_suppressed = 0;
+    for (int frame = 0; frame < 100; frame++) {
+        for (int i = 0; i < items; i++) {
+            int jitter = rand_r(&seed) % 9 - 4;
+            if (i & 1) {
+                benchValues[i] = 100 + i + frame * 0.002 + jitter * 0.001;
+            }
+            else if (jitter == 4) {
+                benchValues[i] = 100 + i + (benchValues[i] == 100 + i);
+            }
+        }
+        TeensyControls_update_xplane(0);
+        TeensyControls_output(0, 0);
+        values += drainValues(t);
+        usleep(10000);
+    }
+
+    *suppressed = t->output_suppressed;
+    t->online = 0;
+    t->input_thread_quit = 1;
+    t->output_thread_quit = 1;
+    quiet(true);
+    TeensyControls_delete_offline_teensy();
+    quiet(false);
+    return values;
+}
+
+static bool benchDeadbandLimits()
+{
+    const int items = 100;
+    uint32_t suppressed;
+
+    printf("%d items for 1 s of 10 ms frames, half floats jittering by 0.004\n", items);
+    int plain = jitterValues(items, 0, 0, &suppressed);
+    printf("no limits                    %6d values sent\n", plain);
+    int banded = jitterValues(items, 0.05, 0, &suppressed);
+    printf("deadband=0.05                %6d values sent, %u held back\n", banded, suppressed);
+    int limited = jitterValues(items, 0.05, 100000, &suppressed);
+    printf("deadband=0.05 rate=10        %6d values sent, %u held back\n", limited, suppressed);
+
+    // A second of frames can't send more than 10 a second for each item
+    bool pass = (banded < plain && limited <= banded && limited <= items * 11);
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    return pass;
+}
+
+static const int benchUrgentItems = 10;
+
+static int urgentFirst(int refNum)
+{
+    return refNum < benchUrgentItems ? OUTPUT_URGENT : OUTPUT_LOW;
+}
+
+struct PriorityResult {
+    int urgentMax;      // frames from an annunciator change to it being sent
+    double urgentMean;
+    int lowMax;         // frames a gauge waited while dirty
+    int lowUnsent;      // gauges never sent
+    double reportsPerSec;
+};
+
+// 10 annunciators that change every 20th frame among 300 gauges that all
+// move every frame, far more than the 4 reports a frame the queue takes.
+// Runs 200 frames 5 ms apart so that waiting items age.
+static void runPriority(PriorityResult* result, bool classes, uint32_t rate)
+{
+    const int items = 310;
+    const int frames = 200;
+    static int dirtySince[items];
+    static bool sent[items];
+
+    benchPriority = classes ? urgentFirst : NULL;
+    teensy_t* t = TeensyControls_new_teensy();
+    TeensyControls_output_rate(t, rate);
+    registerItems(t, items);
+
+    quiet(true);
+    for (int i = 0; i <= ID_FRAME_TIMEOUT + 2 || t->dirty_count > 0; i++) {
+        TeensyControls_update_xplane(0);
+        TeensyControls_output(0, 0);
+        drainOutput(t);
+    }
+    quiet(false);
+
+    memset(result, 0, sizeof(PriorityResult));
+    for (int i = 0; i < items; i++) {
+        dirtySince[i] = -1;
+        sent[i] = false;
+    }
+
+    int urgentChanges = 0;
+    int urgentFrames = 0;
+    int reports = 0;
+    double start = benchSeconds();
+    for (int frame = 0; frame < frames; frame++) {
+        for (int i = benchUrgentItems; i < items; i++) {
+            benchValues[i] += 1;
+        }
+        if (frame % 20 == 0) {
+            for (int i = 0; i < benchUrgentItems; i++) {
+                benchValues[i] += 1;
+            }
+        }
+
+        TeensyControls_update_xplane(0);
+        for (int i = 0; i < items; i++) {
+            if (t->items[i].dirty && dirtySince[i] == -1) {
+                dirtySince[i] = frame;
+            }
+        }
+        TeensyControls_output(0, 0);
+        reports += drainOutput(t);
+
+        for (int i = 0; i < items; i++) {
+            if (t->items[i].dirty || dirtySince[i] == -1) {
+                continue;
+            }
+            int wait = frame - dirtySince[i];
+            if (i < benchUrgentItems) {
+                urgentChanges++;
+                urgentFrames += wait;
+                result->urgentMax = std::max(result->urgentMax, wait);
+            }
+            else {
+                result->lowMax = std::max(result->lowMax, wait);
+                sent[i] = true;
+            }
+            dirtySince[i] = -1;
+        }
+        usleep(5000);
+    }
+    result->reportsPerSec = reports / (benchSeconds() - start);
+    result->urgentMean = urgentChanges ? (double)urgentFrames / urgentChanges : 0;
+    for (int i = benchUrgentItems; i < items; i++) {
+        if (!sent[i]) {
+            result->lowUnsent++;
+        }
+    }
+
+    benchPriority = NULL;
+    t->online = 0;
+    t->input_thread_quit = 1;
+    t->output_thread_quit = 1;
+    quiet(true);
+    TeensyControls_delete_offline_teensy();
+    quiet(false);
+}
+
+static bool benchOutputPriority()
+{
+    PriorityResult fifo;
+    PriorityResult classes;
+    PriorityResult budget;
+
+    runPriority(&fifo, false, 0);
+    runPriority(&classes, true, 0);
+    runPriority(&budget, true, 100);
+
+    printf("10 annunciators among 300 busy gauges, 200 frames 5 ms apart\n");
+    printf("                       annunciator frames   gauge frames  gauges    reports\n");
+    printf("                         mean     max        max wait     unsent    a second\n");
+    printf("dirty order            %6.2f  %6d        %6d       %5d    %8.0f\n",
+        fifo.urgentMean, fifo.urgentMax, fifo.lowMax, fifo.lowUnsent, fifo.reportsPerSec);
+    printf("priority classes       %6.2f  %6d        %6d       %5d    %8.0f\n",
+        classes.urgentMean, classes.urgentMax, classes.lowMax, classes.lowUnsent, classes.reportsPerSec);
+    printf("classes, 100 reports/s %6.2f  %6d        %6d       %5d    %8.0f\n",
+        budget.urgentMean, budget.urgentMax, budget.lowMax, budget.lowUnsent, budget.reportsPerSec);
+
+    bool pass = classes.urgentMax == 0 && classes.lowUnsent == 0 && budget.lowUnsent == 0 &&
+        budget.urgentMean < fifo.urgentMean &&
+        budget.reportsPerSec < 100 * 1.2;
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    return pass;
+}
+
+struct MultiWriteResult {
+    int values;
+    int reports;
+    int maxDirty;       // most values left waiting for a later frame, once in sync
+    int offered;        // enable messages offering multi write
+    int oldMessages;    // 0x02 write messages
+    int multiMessages;  // 0x08 multi write messages
+    bool match;         // what the Teensy decoded matches the sim
+};
+
+// Decodes queued reports the way the Teensy library would, keeping the
+// last value written to each id
+static void panelDecode(teensy_t* t, double* remote, MultiWriteResult* result)
+{
+    uint8_t packet[64];
+
+    while (TeensyControls_output_fetch(t, packet)) {
+        result->reports++;
+        for (int i = 0; i < 64 && packet[i] >= 2 && i + packet[i] <= 64; i += packet[i]) {
+            const uint8_t* msg = packet + i;
+            if (msg[1] == 3 && msg[0] == 4) {
+                if (msg[3] & OUTPUT_CAP_MULTI_WRITE) {
+                    result->offered++;
+                }
+            }
+            else if (msg[1] == 2 && msg[0] == 10) {
+                int32_t value = msg[6] | (msg[7] << 8) | (msg[8] << 16) | (msg[9] << 24);
+                float f;
+                memcpy(&f, &value, 4);
+                remote[msg[2] | (msg[3] << 8)] = msg[4] == 1 ? value : f;
+                result->oldMessages++;
+                result->values++;
+            }
+            else if (msg[1] == 8 && msg[0] == 4 + 6 * msg[3]) {
+                for (int n = 0; n < msg[3]; n++) {
+                    const uint8_t* v = msg + 4 + 6 * n;
+                    int32_t value = v[2] | (v[3] << 8) | (v[4] << 16) | (v[5] << 24);
+                    float f;
+                    memcpy(&f, &value, 4);
+                    remote[v[0] | (v[1] << 8)] = msg[2] == 1 ? value : f;
+                }
+                result->multiMessages++;
+                result->values += msg[3];
+            }
+        }
+    }
+}
+
+// A busy airliner panel: 32 float gauges and needles that move every
+// frame, 16 radio and autopilot ints that change every 10th frame and 64
+// annunciator and switch ints that change now and then, declared in the
+// mixed order a sketch would have them. Runs 200 frames, then lets the
+// dirty list drain and checks the Teensy ended up with every sim value.
+static void runPanel(MultiWriteResult* result, bool firmwareMulti)
+{
+    const int items = 112;
+    const int frames = 200;
+    static int kind[items];
+    static double remote[items];
+    char name[64];
+
+    teensy_t* t = TeensyControls_new_teensy();
+    quiet(true);
+    for (int id = 0; id < items; id++) {
+        kind[id] = id % 7 == 0 || id % 7 == 4 ? 2 : id % 7 == 2 ? 1 : 0;
+        int len = sprintf(name, "bench/panel_%d", id);
+        TeensyControls_new_item(t, id, kind[id] == 2 ? 2 : 1, name, len);
+        benchValues[id] = id;
+        remote[id] = -1;
+    }
+    quiet(false);
+    memset(result, 0, sizeof(MultiWriteResult));
+
+    if (firmwareMulti) {
+        // the reply the Teensy sends to an enable message offering it
+        uint8_t reply[64] = { 4, 7, OUTPUT_CAP_MULTI_WRITE, 0 };
+        TeensyControls_input_store(t, reply);
+        TeensyControls_input(0, 0);
+    }
+
+    unsigned int seed = 1;
+    quiet(true);
+    for (int frame = 0; frame < frames + 20; frame++) {
+        if (frame >= ID_FRAME_TIMEOUT + 2 && frame < frames) {
+            for (int id = 0; id < items; id++) {
+                if (kind[id] == 2) {
+                    benchValues[id] += 0.25 + rand_r(&seed) % 100 / 8.0;
+                }
+                else if (kind[id] == 1 && frame % 10 == id % 10) {
+                    benchValues[id] += 25;
+                }
+                else if (kind[id] == 0 && rand_r(&seed) % 50 == 0) {
+                    benchValues[id] = !benchValues[id];
+                }
+            }
+        }
+        TeensyControls_update_xplane(0);
+        TeensyControls_output(0, 0);
+        if (frame >= ID_FRAME_TIMEOUT + 10 && frame < frames) {
+            result->maxDirty = std::max(result->maxDirty, t->dirty_count);
+        }
+        panelDecode(t, remote, result);
+    }
+    quiet(false);
+
+    result->match = true;
+    for (int id = 0; id < items; id++) {
+        double expected = kind[id] == 2 ? (double)(float)benchValues[id] : benchValues[id];
+        if (remote[id] != expected) {
+            result->match = false;
+        }
+    }
+
+    t->online = 0;
+    t->input_thread_quit = 1;
+    t->output_thread_quit = 1;
+    quiet(true);
+    TeensyControls_delete_offline_teensy();
+    quiet(false);
+}
+
+static bool benchMultiWrite()
+{
+    MultiWriteResult plain;
+    MultiWriteResult multi;
+
+    runPanel(&plain, false);
+    runPanel(&multi, true);
+
+    printf("112 item panel, 32 gauges moving every frame, 200 frames of at most %d reports\n",
+        OUTPUT_QUEUE_LIMIT);
+    printf("                          values  reports  per report  max waiting  0x02 msgs  0x08 msgs\n");
+    printf("older firmware, 0x02     %7d  %7d      %6.2f      %7d   %8d   %8d\n",
+        plain.values, plain.reports, (double)plain.values / plain.reports, plain.maxDirty,
+        plain.oldMessages, plain.multiMessages);
+    printf("multi write, 0x08        %7d  %7d      %6.2f      %7d   %8d   %8d\n",
+        multi.values, multi.reports, (double)multi.values / multi.reports, multi.maxDirty,
+        multi.oldMessages, multi.multiMessages);
+    printf("enable offered multi write in %d of %d reports, Teensy copy %s\n",
+        plain.offered, plain.reports, plain.match && multi.match ? "matches the sim" : "DIFFERS");
+
+    bool pass = plain.match && multi.match && plain.offered > 0 &&
+        plain.multiMessages == 0 && multi.oldMessages == 0 &&
+        (double)multi.values / multi.reports > 1.3 * plain.values / plain.reports;
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    return pass;
+}
+
+struct ReplayResult {
+    int inputs;
+    int frames;
+    int outputs;
+    double seconds;
+};
+
+// Plays capture records through the input ring, decode, sim update and
+// output, 30 ms of recorded time per frame as the main loop would, but as
+// fast as they can be taken. Each device in the capture gets a teensy_t.
+static void replayCapture(const capture_record_t* records, int count, teensy_t** device,
+    ReplayResult* result)
+{
+    const uint64_t frameMicros = 30000;
+
+    memset(result, 0, sizeof(ReplayResult));
+    memset(device, 0, 256 * sizeof(teensy_t*));
+    for (int i = 0; i < count; i++) {
+        if (!device[records[i].device]) {
+            device[records[i].device] = TeensyControls_new_teensy();
+        }
+    }
+
+    quiet(true);
+    double start = benchSeconds();
+    uint64_t frameEnd = frameMicros;
+    for (int i = 0; i <= count; i++) {
+        if (i == count || records[i].usec >= frameEnd) {
+            TeensyControls_input(0, 0);
+            TeensyControls_update_xplane(0);
+            TeensyControls_output(0, 0);
+            for (int d = 0; d < 256; d++) {
+                if (device[d]) {
+                    result->outputs += drainOutput(device[d]);
+                }
+            }
+            result->frames++;
+            if (i == count) {
+                break;
+            }
+            frameEnd = (records[i].usec / frameMicros + 1) * frameMicros;
+        }
+        if (records[i].direction != CAPTURE_INPUT) {
+            continue;
+        }
+        teensy_t* t = device[records[i].device];
+        while (!TeensyControls_input_store_batch(t, records[i].report, 1, 0)) {
+            TeensyControls_input(0, 0);
+        }
+        result->inputs++;
+    }
+    result->seconds = benchSeconds() - start;
+    quiet(false);
+}
+
+static void replayRelease(teensy_t** device)
+{
+    for (int d = 0; d < 256; d++) {
+        if (device[d]) {
+            device[d]->online = 0;
+            device[d]->input_thread_quit = 1;
+            device[d]->output_thread_quit = 1;
+        }
+    }
+    quiet(true);
+    TeensyControls_delete_offline_teensy();
+    quiet(false);
+}
+
+// The sim must hold the last value the Teensy wrote to each item
+static int replayErrors(teensy_t* t, int items, const double* expected)
+{
+    int errors = t->item_count != items;
+    for (int id = 0; id < items; id++) {
+        if (!TeensyControls_find_item(t, id) || benchValues[id] != expected[id]) {
+            errors++;
+        }
+    }
+    return errors;
+}
+
+// With a capture file, replays it and reports how fast the decode and
+// update path takes it. Without one, captures the synthetic stream from
+// benchDecode as if read 1 ms apart, then checks the file reads back the
+// same and replays to the same item values every time.
+static bool benchReplay(const char* path)
+{
+    static teensy_t* device[256];
+    ReplayResult result;
+    int count;
+
+    if (path) {
+        capture_record_t* records = TeensyControls_capture_load(path, &count);
+        if (!records) {
+            return false;
+        }
+        replayCapture(records, count, device, &result);
+        int devices = 0;
+        int items = 0;
+        for (int d = 0; d < 256; d++) {
+            if (device[d]) {
+                devices++;
+                items += device[d]->item_count;
+            }
+        }
+        printf("%d records, %d Teensys, %d items registered\n", count, devices, items);
+        printf("%d input reports in %d frames, %d output reports\n", result.inputs, result.frames, result.outputs);
+        printf("replayed in %.3f s, %.2f M input reports/s, %.2f us/frame\n", result.seconds,
+            result.inputs / result.seconds / 1e6, result.seconds * 1e6 / result.frames);
+        replayRelease(device);
+        free(records);
+        printf("PASS\n");
+        return true;
+    }
+
+    const int items = 500;
+    const int maxReports = 20000;
+    const char* capturePath = "/tmp/teensy-bench.cap";
+    static double expected[items];
+
+    StreamWriter sw;
+    memset(&sw, 0, sizeof(sw));
+    sw.maxReports = maxReports;
+    sw.reports = (uint8_t*)calloc(maxReports, 64);
+    for (int i = 0; i < items; i++) {
+        expected[i] = 0;
+    }
+    buildStream(&sw, items, expected);
+
+    teensy_t* t = TeensyControls_alloc_teensy();
+    quiet(true);
+    bool opened = TeensyControls_capture_open(capturePath);
+    uint64_t base = TeensyControls_usec();
+    for (int i = 0; i < sw.count; i++) {
+        TeensyControls_capture(t, CAPTURE_INPUT, sw.reports + i * 64, base + i * 1000);
+    }
+    TeensyControls_capture_close();
+    quiet(false);
+    free(t);
+    if (!opened) {
+        printf("Unable to write %s\n", capturePath);
+        return false;
+    }
+
+    struct stat st;
+    stat(capturePath, &st);
+    capture_record_t* records = TeensyControls_capture_load(capturePath, &count);
+    int errors = count != sw.count;
+    for (int i = 0; records && i < count && i < sw.count; i++) {
+        if (memcmp(records[i].report, sw.reports + i * 64, 64) != 0 || records[i].usec - records[0].usec != (uint64_t)i * 1000) {
+            errors++;
+        }
+    }
+    printf("%d reports captured, %ld bytes, %.1f bytes a report\n", count, (long)st.st_size,
+        (double)st.st_size / count);
+
+    for (int pass = 0; pass < 2 && records; pass++) {
+        for (int i = 0; i < items; i++) {
+            benchValues[i] = 0;
+        }
+        replayCapture(records, count, device, &result);
+        int replayed = replayErrors(device[0], items, expected);
+        printf("replay %d: %d input reports in %d frames, %.2f M reports/s, %d errors\n", pass + 1,
+            result.inputs, result.frames, result.inputs / result.seconds / 1e6, replayed);
+        errors += replayed;
+        replayRelease(device);
+    }
+
+    free(records);
+    free(sw.reports);
+    remove(capturePath);
+    printf("%s\n", errors == 0 ? "PASS" : "FAIL");
+    return errors == 0;
+}
+
+// Mirrored panels: every Teensy registers the same Data Refs, all of them
+// changing every frame. update_xplane should read each from the sim once
+// a frame however many Teensys share it, and every Teensy must still get
+// every value.
+static bool benchShared()
+{
+    const int items = 500;
+    const int frames = 1000;
+    const int maxBoards = 8;
+    teensy_t* t[maxBoards];
+    bool pass = true;
+
+    printf("%d Data Refs registered by every Teensy, all changing every frame, %d frames\n", items, frames);
+    printf("teensys  registrations  reads/frame  update_xplane us/frame  wrong values\n");
+    for (int boards = 1; boards <= maxBoards; boards *= 2) {
+        for (int i = 0; i < items; i++) {
+            benchValues[i] = 0;
+        }
+        for (int b = 0; b < boards; b++) {
+            t[b] = TeensyControls_new_teensy();
+            registerItems(t[b], items);
+        }
+        quiet(true);
+        for (int i = 0; i <= ID_FRAME_TIMEOUT + 2; i++) {
+            TeensyControls_update_xplane(0);
+            TeensyControls_output(0, 0);
+            for (int b = 0; b < boards; b++) {
+                drainOutput(t[b]);
+            }
+        }
+        quiet(false);
+
+        benchReads = 0;
+        double updateSecs = 0;
+        for (int frame = 0; frame < frames; frame++) {
+            for (int i = 0; i < items; i++) {
+                benchValues[i] += 1;
+            }
+            double start = benchSeconds();
+            TeensyControls_update_xplane(0);
+            updateSecs += benchSeconds() - start;
+            TeensyControls_output(0, 0);
+            for (int b = 0; b < boards; b++) {
+                drainOutput(t[b]);
+            }
+        }
+
+        int wrong = 0;
+        for (int b = 0; b < boards; b++) {
+            for (int id = 0; id < items; id++) {
+                item_t* item = TeensyControls_find_item(t[b], id);
+                double value = item->type == 1 ? item->intval : item->floatval;
+                if (value != benchValues[id]) {
+                    wrong++;
+                }
+            }
+        }
+        printf("%7d  %13d  %11.1f  %22.2f  %12d\n", boards, boards * items, (double)benchReads / frames,
+            updateSecs * 1e6 / frames, wrong);
+        if (benchReads != items * frames || wrong > 0) {
+            pass = false;
+        }
+
+        for (int b = 0; b < boards; b++) {
+            t[b]->online = 0;
+            t[b]->input_thread_quit = 1;
+            t[b]->output_thread_quit = 1;
+        }
+        quiet(true);
+        TeensyControls_delete_offline_teensy();
+        quiet(false);
+    }
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    return pass;
+}
+
+const int usbIoDevices = 16;
+const int usbIoInputRate = 100;     // input reports a second from each Teensy
+const int usbIoSeconds = 3;
+
+struct UsbIoBench {
+    int peerFd[usbIoDevices];
+    double* inputLatency;
+    double* outputLatency;
+    int inputsSent;
+    int outputs;
+    struct rusage peerUsage;
+    std::atomic<int> quit;
+};
+
+struct UsbIoResult {
+    double cpu;
+    double switches;
+    int inputs;
+    int outputs;
+};
+
+static double usageSeconds(const struct rusage* ru)
+{
+    return ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6 + ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+}
+
+static long usageSwitches(const struct rusage* ru)
+{
+    return ru->ru_nvcsw + ru->ru_nivcsw;
+}
+
+// Plays every Teensy: sends each one a timestamped input report every
+// 10 ms, staggered across the devices, and times the output reports.
+static void* usbIoPeer(void* arg)
+{
+    UsbIoBench* ub = (UsbIoBench*)arg;
+    struct epoll_event events[usbIoDevices + 1];
+    uint8_t report[65];
+    uint64_t ticks;
+
+    int epollFd = epoll_create1(0);
+    int timerFd = timerfd_create(CLOCK_MONOTONIC, 0);
+    struct itimerspec tick;
+    memset(&tick, 0, sizeof(tick));
+    tick.it_value.tv_nsec = 1000000;
+    tick.it_interval.tv_nsec = 1000000;
+    timerfd_settime(timerFd, 0, &tick, NULL);
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u32 = usbIoDevices;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, timerFd, &event);
+    for (int d = 0; d < usbIoDevices; d++) {
+        event.data.u32 = d;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, ub->peerFd[d], &event);
+    }
+
+    int tickCount = 0;
+    while (!ub->quit) {
+        int n = epoll_wait(epollFd, events, usbIoDevices + 1, 100);
+        for (int i = 0; i < n; i++) {
+            int d = events[i].data.u32;
+            if (d == usbIoDevices) {
+                read(timerFd, &ticks, sizeof(ticks));
+                tickCount++;
+                for (int dev = tickCount % 10; dev < usbIoDevices; dev += 10) {
+                    double now = benchSeconds();
+                    memset(report, 0, 64);
+                    memcpy(report, &now, sizeof(now));
+                    if (send(ub->peerFd[dev], report, 64, MSG_DONTWAIT) == 64) {
+                        ub->inputsSent++;
+                    }
+                }
+                continue;
+            }
+            while (recv(ub->peerFd[d], report, 65, MSG_DONTWAIT) == 65) {
+                double sent;
+                memcpy(&sent, report + 1, sizeof(sent));
+                ub->outputLatency[ub->outputs++] = (benchSeconds() - sent) * 1000;
+            }
+        }
+    }
+    getrusage(RUSAGE_THREAD, &ub->peerUsage);
+    close(timerFd);
+    close(epollFd);
+    return NULL;
+}
+
+static void usbIoFetch(teensy_t** t, UsbIoResult* result, UsbIoBench* ub)
+{
+    uint8_t packet[64];
+    double sent;
+
+    for (int d = 0; d < usbIoDevices; d++) {
+        while (TeensyControls_input_fetch(t[d], packet)) {
+            memcpy(&sent, packet, sizeof(sent));
+            ub->inputLatency[result->inputs++] = (benchSeconds() - sent) * 1000;
+        }
+    }
+}
+
+// Runs the stand-in Teensys through TeensyControls_usb_start_io with
+// TEENSY_USB_IO set to mode. The main thread waits on the wake fd like the
+// plugin's main loop, taking input as it arrives and queuing one output
+// report per Teensy every 30 ms frame. CPU and context switches are for
+// the I/O threads alone, the peer and main thread are left out.
+static void runUsbIo(const char* mode, UsbIoResult* result, UsbIoBench* ub)
+{
+    teensy_t* t[usbIoDevices];
+    struct rusage before, after, mainUsage, mainBefore;
+    uint8_t packet[64];
+    pthread_t th;
+
+    setenv("TEENSY_USB_IO", mode, 1);
+    memset(result, 0, sizeof(UsbIoResult));
+    ub->inputsSent = 0;
+    ub->outputs = 0;
+    ub->quit = 0;
+    int wakeFd = TeensyControls_usb_wake_fd();
+    for (int d = 0; d < usbIoDevices; d++) {
+        int sv[2];
+        socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv);
+        t[d] = TeensyControls_new_teensy();
+        t[d]->usb.fd = sv[0];
+        ub->peerFd[d] = sv[1];
+        TeensyControls_usb_start_io(t[d]);
+    }
+
+    int epollFd = epoll_create1(0);
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event);
+
+    getrusage(RUSAGE_SELF, &before);
+    getrusage(RUSAGE_THREAD, &mainBefore);
+    pthread_create(&th, NULL, usbIoPeer, ub);
+    double start = benchSeconds();
+    double nextFrame = start;
+    double end = start + usbIoSeconds;
+    while (true) {
+        double now = benchSeconds();
+        if (now >= nextFrame) {
+            if (now >= end) {
+                break;
+            }
+            for (int d = 0; d < usbIoDevices; d++) {
+                memset(packet, 0, 64);
+                memcpy(packet, &now, sizeof(now));
+                TeensyControls_output_store(t[d], packet, 0);
+            }
+            nextFrame += 0.030;
+        }
+        int msec = (int)((nextFrame - now) * 1000) + 1;
+        if (epoll_wait(epollFd, &event, 1, msec) > 0) {
+            uint64_t value;
+            read(wakeFd, &value, sizeof(value));
+        }
+        usbIoFetch(t, result, ub);
+    }
+    ub->quit = 1;
+    pthread_join(th, NULL);
+    // take the input still on its way
+    for (double drain = benchSeconds() + 0.020; benchSeconds() < drain; ) {
+        epoll_wait(epollFd, &event, 1, 1);
+        usbIoFetch(t, result, ub);
+    }
+    getrusage(RUSAGE_THREAD, &mainUsage);
+    getrusage(RUSAGE_SELF, &after);
+
+    double seconds = benchSeconds() - start;
+    result->cpu = (usageSeconds(&after) - usageSeconds(&before) - usageSeconds(&ub->peerUsage) -
+        (usageSeconds(&mainUsage) - usageSeconds(&mainBefore))) / seconds * 100;
+    result->switches = (usageSwitches(&after) - usageSwitches(&before) - usageSwitches(&ub->peerUsage) -
+        (usageSwitches(&mainUsage) - usageSwitches(&mainBefore))) / seconds;
+    result->outputs = ub->outputs;
+
+    // stop the reactor first, then the threads, as usb_close does
+    quiet(true);
+    TeensyControls_usb_stop_io();
+    for (int d = 0; d < usbIoDevices; d++) {
+        t[d]->online = 0;
+        shutdown(ub->peerFd[d], SHUT_RDWR);
+        pthread_mutex_lock(&t[d]->output_mutex);
+        pthread_cond_signal(&t[d]->output_event);
+        pthread_mutex_unlock(&t[d]->output_mutex);
+    }
+    for (int wait = 0; wait < 100; wait++) {
+        int alive = 0;
+        for (int d = 0; d < usbIoDevices; d++) {
+            alive += !t[d]->input_thread_quit + !t[d]->output_thread_quit;
+        }
+        if (alive == 0) {
+            break;
+        }
+        usleep(10000);
+    }
+    for (int d = 0; d < usbIoDevices; d++) {
+        close(t[d]->usb.fd);
+        close(ub->peerFd[d]);
+    }
+    TeensyControls_delete_offline_teensy();
+    quiet(false);
+    close(epollFd);
+}
+
+static bool benchUsbIo()
+{
+    const int maxSamples = usbIoDevices * usbIoInputRate * (usbIoSeconds + 1);
+    UsbIoBench ub;
+    UsbIoResult result[2];
+    const char* modes[2] = { "threads", "reactor" };
+    bool pass = true;
+
+    ub.inputLatency = (double*)malloc(maxSamples * sizeof(double));
+    ub.outputLatency = (double*)malloc(maxSamples * sizeof(double));
+    printf("%d stand-in Teensys for %d s, %d input reports a second each, 1 output report a frame\n",
+        usbIoDevices, usbIoSeconds, usbIoInputRate);
+    for (int m = 0; m < 2; m++) {
+        runUsbIo(modes[m], &result[m], &ub);
+        printf("%s: %d I/O thread%s, %.2f%% CPU, %.0f context switches/s, %d of %d inputs, %d outputs\n",
+            modes[m], m == 0 ? usbIoDevices * 2 : 1, m == 0 ? "s" : "", result[m].cpu, result[m].switches,
+            result[m].inputs, ub.inputsSent, result[m].outputs);
+        wakeupReport("  input", ub.inputLatency, result[m].inputs);
+        wakeupReport("  output", ub.outputLatency, result[m].outputs);
+        int frames = usbIoSeconds * 1000 / 30;
+        if (result[m].inputs != ub.inputsSent || result[m].outputs < usbIoDevices * frames) {
+            pass = false;
+        }
+    }
+    free(ub.inputLatency);
+    free(ub.outputLatency);
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    return pass;
+}
+
+static void usage()
+{
+    printf("Usage: teensy-bench <mode>\n");
+    printf("  lookup     item lookup by Teensy ID, 10 to 5000 items\n");
+    printf("  ring       input/output rings with both ends at full rate\n");
+    printf("  wakeup     input latency, fixed 30 ms sleep vs event loop\n");
+    printf("  dirty      per-frame cost with 2000 items, 1%% changing\n");
+    printf("  coalesce   needle gauge through a throttled output thread\n");
+    printf("  decode     synthetic Teensy report stream through input decode\n");
+    printf("  fuzz       malformed and interleaved fragments through input decode\n");
+    printf("  names      Data Ref name lookup, std::map vs hash index\n");
+    printf("  mappings   data mapping file load, text parse vs cache\n");
+    printf("  debounce   bouncing button presses, polled vs edge events\n");
+    printf("  repeat     held button repeats with steady and jittery frames\n");
+    printf("  deadband   jittering sim values, with and without output limits\n");
+    printf("  priority   annunciators among busy gauges, with priority classes and a report budget\n");
+    printf("  multiwrite values per report for a cockpit panel, 0x02 vs 0x08 messages\n");
+    printf("  replay     [capture] decode and update path fed from a capture file\n");
+    printf("  shared     mirrored panels, sim reads per frame as Teensys are added\n");
+    printf("  usbio      16 stand-in Teensys, thread per device vs one epoll reactor\n");
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        usage();
+        return 1;
+    }
+
+    if (strcmp(argv[1], "lookup") == 0) {
+        benchLookup();
+    }
+    else if (strcmp(argv[1], "ring") == 0) {
+        benchRing();
+    }
+    else if (strcmp(argv[1], "wakeup") == 0) {
+        benchWakeup();
+    }
+    else if (strcmp(argv[1], "dirty") == 0) {
+        benchDirty();
+    }
+    else if (strcmp(argv[1], "coalesce") == 0) {
+        return benchCoalesce() ? 0 : 1;
+    }
+    else if (strcmp(argv[1], "decode") == 0) {
+        return benchDecode() ? 0 : 1;
+    }
+    else if (strcmp(argv[1], "fuzz") == 0) {
+        return benchFuzz() ? 0 : 1;
+    }
+    else if (strcmp(argv[1], "names") == 0) {
+        return benchNames() ? 0 : 1;
+    }
+    else if (strcmp(argv[1], "mappings") == 0) {
+        return benchMappings() ? 0 : 1;
+    }
+    else if (strcmp(argv[1], "debounce") == 0) {
+        return benchDebounce() ? 0 : 1;
+    }
+    else if (strcmp(argv[1], "repeat") == 0) {
+        return benchRepeat() ? 0 : 1;
+    }
+    else if (strcmp(argv[1], "deadband") == 0) {
+        return benchDeadbandLimits() ? 0 : 1;
+    }
+    else if (strcmp(argv[1], "priority") == 0) {
+        return benchOutputPriority() ? 0 : 1;
+    }
+    else if (strcmp(argv[1], "multiwrite") == 0) {
+        return benchMultiWrite() ? 0 : 1;
+    }
+    else if (strcmp(argv[1], "replay") == 0) {
+        return benchReplay(argc > 2 ? argv[2] : NULL) ? 0 : 1;
+    }
+    else if (strcmp(argv[1], "shared") == 0) {
+        return benchShared() ? 0 : 1;
+    }
+    else if (strcmp(argv[1], "usbio") == 0) {
+        return benchUsbIo() ? 0 : 1;
+    }
+    else {
+        usage();
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "buttons.h"
+
+// A held button used to adjust once per 30 ms frame, so keep that feel
+const int DefaultDelayMs = 30;
+const int DefaultRepeatMs = 30;
+
+// Most repeats made up at once after a stall, the rest are dropped
+const int MaxCatchUp = 50;
+
+void buttonRepeatDefaults(ButtonRepeat* repeat)
+{
+    repeat->delayMs = DefaultDelayMs;
+    repeat->repeatMs = DefaultRepeatMs;
+    repeat->accel = 1;
+    repeat->fastestMs = 1;
+}
+
+// Option is one of delay=<ms>, repeat=<ms>, accel=<factor> or
+// fastest=<ms>. Returns false if it isn't.
+bool buttonRepeatOption(ButtonRepeat* repeat, const char* option)
+{
+    const char* value = strchr(option, '=');
+    if (!value) {
+        return false;
+    }
+
+    int len = value - option;
+    value++;
+
+    if (len == 5 && strncmp(option, "delay", len) == 0) {
+        repeat->delayMs = atoi(value);
+    }
+    else if (len == 6 && strncmp(option, "repeat", len) == 0) {
+        repeat->repeatMs = atoi(value);
+    }
+    else if (len == 5 && strncmp(option, "accel", len) == 0) {
+        repeat->accel = atof(value);
+    }
+    else if (len == 7 && strncmp(option, "fastest", len) == 0) {
+        repeat->fastestMs = atoi(value);
+    }
+    else {
+        return false;
+    }
+
+    if (repeat->repeatMs < 1) {
+        repeat->repeatMs = 1;
+    }
+    if (repeat->fastestMs < 1) {
+        repeat->fastestMs = 1;
+    }
+    if (repeat->accel <= 0) {
+        repeat->accel = 1;
+    }
+    return true;
+}
+
+void buttonActionInit(ButtonAction* action, const ButtonRepeat* repeat)
+{
+    action->repeat = *repeat;
+    action->held = false;
+    action->nextTime = 0;
+    action->interval = 0;
+}
+
+// Time is when the press happened, which can be before now
+void buttonActionPress(ButtonAction* action, uint64_t time)
+{
+    action->held = true;
+    action->nextTime = time + (uint64_t)action->repeat.delayMs * 1000;
+    action->interval = action->repeat.repeatMs * 1000.0;
+}
+
+void buttonActionRelease(ButtonAction* action)
+{
+    action->held = false;
+}
+
+// Returns the number of repeats due by now
+int buttonActionRun(ButtonAction* action, uint64_t now)
+{
+    int count = 0;
+
+    while (action->held && now >= action->nextTime) {
+        if (count == MaxCatchUp) {
+            action->nextTime = now + (uint64_t)action->interval;
+            break;
+        }
+
+        count++;
+        action->nextTime += (uint64_t)action->interval;
+        action->interval *= action->repeat.accel;
+        if (action->interval < action->repeat.fastestMs * 1000.0) {
+            action->interval = action->repeat.fastestMs * 1000.0;
+        }
+    }
+
+    return count;
+}
+
+// When the next repeat is due, or 0 if the button isn't held
+uint64_t buttonActionNext(const ButtonAction* action)
+{
+    return action->held ? action->nextTime : 0;
+}
@@ -0,0 +1,287 @@
+#include "TeensyControls.h"
+
+// Capture files log every report read from or written to a Teensy, so a
+// panel session can be replayed later with no hardware attached.
+//
+// The file is "TCAP" and a version byte, then one record per report:
+//   8 bytes  usec since the capture began, little endian
+//   1 byte   device index
+//   1 byte   direction, CAPTURE_INPUT or CAPTURE_OUTPUT
+//   1 byte   length of the report without its trailing zero bytes
+//   length   report bytes
+// Reports are zero padded so dropping the padding loses nothing.
+
+#define CAPTURE_VERSION 1
+#define CAPTURE_FLUSH_USEC 1000000	// so a killed plugin loses at most a second
+
+static FILE *capture_file = NULL;
+static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t capture_start;
+static uint64_t capture_flushed;
+static uint32_t capture_records;
+
+// start logging reports to path. Returns 0 if it can't be written.
+int TeensyControls_capture_open(const char *path)
+{
+	FILE *f;
+	uint8_t header[5] = { 'T', 'C', 'A', 'P', CAPTURE_VERSION };
+
+	f = fopen(path, "wb");
+	if (!f) {
+		printf("Unable to write capture file %s, errno=%d\n", path, errno);
+		return 0;
+	}
+	if (fwrite(header, 1, sizeof(header), f) != sizeof(header)) {
+		fclose(f);
+		return 0;
+	}
+	pthread_mutex_lock(&capture_mutex);
+	capture_start = TeensyControls_usec();
+	capture_flushed = capture_start;
+	capture_records = 0;
+	capture_file = f;
+	pthread_mutex_unlock(&capture_mutex);
+	printf("Capturing Teensy reports to %s\n", path);
+	return 1;
+}
+
+// called from the input and output threads for each report. usec is
+// when it was read or written.
+void TeensyControls_capture(teensy_t *t, int direction, const uint8_t *report, uint64_t usec)
+{
+	uint8_t rec[75];
+	uint64_t when;
+	int i, len;
+
+	if (!capture_file) return;
+	for (len = 64; len > 0 && report[len-1] == 0; len--) ;
+	pthread_mutex_lock(&capture_mutex);
+	if (capture_file) {
+		when = usec > capture_start ? usec - capture_start : 0;
+		for (i = 0; i < 8; i++) {
+			rec[i] = (when >> (i * 8)) & 255;
+		}
+		rec[8] = t->index;
+		rec[9] = direction;
+		rec[10] = len;
+		memcpy(rec + 11, report, len);
+		fwrite(rec, 1, len + 11, capture_file);
+		capture_records++;
+		if (usec - capture_flushed >= CAPTURE_FLUSH_USEC) {
+			fflush(capture_file);
+			capture_flushed = usec;
+		}
+	}
+	pthread_mutex_unlock(&capture_mutex);
+}
+
+void TeensyControls_capture_close(void)
+{
+	pthread_mutex_lock(&capture_mutex);
+	if (capture_file) {
+		fclose(capture_file);
+		capture_file = NULL;
+		printf("Captured %u Teensy reports\n", capture_records);
+	}
+	pthread_mutex_unlock(&capture_mutex);
+}
+
+// reads a whole capture into memory. A record cut short at the end, as
+// when the plugin was killed mid write, is left out. Returns NULL if the
+// file can't be read, otherwise the records, which the caller frees.
+capture_record_t * TeensyControls_capture_load(const char *path, int *count)
+{
+	FILE *f;
+	uint8_t header[5], rec[11];
+	capture_record_t *records = NULL, *r;
+	int i, n = 0, size = 0;
+
+	*count = 0;
+	f = fopen(path, "rb");
+	if (!f) {
+		printf("Unable to read capture file %s, errno=%d\n", path, errno);
+		return NULL;
+	}
+	if (fread(header, 1, sizeof(header), f) != sizeof(header) ||
+	  memcmp(header, "TCAP", 4) != 0 || header[4] != CAPTURE_VERSION) {
+		printf("%s is not a Teensy capture file\n", path);
+		fclose(f);
+		return NULL;
+	}
+	while (fread(rec, 1, sizeof(rec), f) == sizeof(rec)) {
+		if (rec[10] > 64) {
+			printf("Capture file %s is corrupt after %d records\n", path, n);
+			break;
+		}
+		if (n == size) {
+			size = size ? size * 2 : 4096;
+			r = (capture_record_t *)realloc(records, size * sizeof(capture_record_t));
+			if (!r) break;
+			records = r;
+		}
+		r = &records[n];
+		memset(r->report, 0, 64);
+		if (fread(r->report, 1, rec[10], f) != rec[10]) break;
+		r->usec = 0;
+		for (i = 0; i < 8; i++) {
+			r->usec |= (uint64_t)rec[i] << (i * 8);
+		}
+		r->device = rec[8];
+		r->direction = rec[9];
+		n++;
+	}
+	fclose(f);
+	if (!records) records = (capture_record_t *)malloc(sizeof(capture_record_t));
+	*count = n;
+	return records;
+}
+
+#ifndef _WIN32
+
+// Replay stands in for the USB threads. Each device in the capture gets
+// a teensy_t whose input reports are stored at the recorded times, divided
+// by speed, and whose output reports are fetched and dropped.
+static capture_record_t *replay_records = NULL;
+static int replay_count;
+static double replay_speed;
+static int replay_wakefd = -1;
+static teensy_t *replay_device[256];
+static volatile int replay_quit = 0;
+static volatile int replay_alive = 0;
+
+static void replay_wake(void)
+{
+	uint64_t one = 1;
+
+	if (replay_wakefd >= 0) {
+		write(replay_wakefd, &one, sizeof(one));
+	}
+}
+
+// what the output threads would write is thrown away
+static void replay_drain(void)
+{
+	uint8_t buf[64];
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		if (!replay_device[i]) continue;
+		while (TeensyControls_output_fetch(replay_device[i], buf)) {
+			replay_device[i]->output_reports++;
+		}
+	}
+}
+
+// waits until usec, dropping output meanwhile. Returns 0 to stop.
+static int replay_wait(uint64_t usec)
+{
+	uint64_t now;
+
+	while (!replay_quit) {
+		replay_drain();
+		now = TeensyControls_usec();
+		if (now >= usec) return 1;
+		usleep(usec - now < 5000 ? usec - now : 5000);
+	}
+	return 0;
+}
+
+static void replay_thread(void *arg)
+{
+	capture_record_t *r;
+	teensy_t *t;
+	uint64_t start, now, due;
+	int i, stored = 0, unwoken = 0;
+
+	start = TeensyControls_usec();
+	for (i = 0; i < replay_count && !replay_quit; i++) {
+		r = &replay_records[i];
+		if (r->direction != CAPTURE_INPUT) continue;
+		t = replay_device[r->device];
+		if (replay_speed > 0) {
+			due = start + (uint64_t)(r->usec / replay_speed);
+			if (TeensyControls_usec() < due) {
+				if (unwoken) replay_wake();
+				unwoken = 0;
+				if (!replay_wait(due)) break;
+			}
+		}
+		// a full ring waits for the main loop, so nothing is dropped
+		while (!TeensyControls_input_store_batch(t, r->report, 1, TeensyControls_usec())) {
+			replay_wake();
+			unwoken = 0;
+			if (!replay_wait(TeensyControls_usec() + 1000)) break;
+		}
+		if (replay_quit) break;
+		stored++;
+		if (++unwoken >= INPUT_BATCH) {
+			replay_wake();
+			unwoken = 0;
+		}
+	}
+	replay_wake();
+	now = TeensyControls_usec();
+	printf("Replay finished, %d input reports in %.3f s\n", stored, (now - start) / 1000000.0);
+
+	// keep taking output until the plugin stops
+	while (!replay_quit) {
+		replay_wait(TeensyControls_usec() + 30000);
+	}
+	for (i = 0; i < 256; i++) {
+		if (replay_device[i]) replay_device[i]->output_thread_quit = 1;
+	}
+	replay_alive = 0;
+}
+
+// replays a capture instead of using USB devices. speed 2 plays twice as
+// fast as recorded, 0 as fast as the plugin takes the reports. wakefd is
+// signalled when input is stored, like TeensyControls_usb_wake_fd.
+int TeensyControls_replay_start(const char *path, double speed, int wakefd)
+{
+	teensy_t *t;
+	int i, devices = 0;
+
+	replay_records = TeensyControls_capture_load(path, &replay_count);
+	if (!replay_records) return 0;
+	for (i = 0; i < replay_count; i++) {
+		if (replay_device[replay_records[i].device]) continue;
+		t = TeensyControls_new_teensy();
+		if (!t) return 0;
+		t->index = replay_records[i].device;
+		t->usb.fd = -1;
+		t->input_thread_quit = 1;	// replay_thread stores the input
+		replay_device[t->index] = t;
+		devices++;
+	}
+	replay_speed = speed;
+	replay_wakefd = wakefd;
+	printf("Replaying %d reports for %d Teensys from %s", replay_count, devices, path);
+	if (speed > 0) {
+		printf(" at %.1fx speed\n", speed);
+	} else {
+		printf(" as fast as possible\n");
+	}
+	replay_quit = 0;
+	replay_alive = 1;
+	if (!thread_start(replay_thread, NULL)) {
+		replay_alive = 0;
+		return 0;
+	}
+	return 1;
+}
+
+void TeensyControls_replay_stop(void)
+{
+	int wait = 0;
+
+	replay_quit = 1;
+	while (++wait < 50 && replay_alive) {
+		usleep(10000);
+	}
+	if (replay_alive) return;	// still using the records
+	free(replay_records);
+	replay_records = NULL;
+	replay_count = 0;
+}
+
+#endif
@@ -0,0 +1,50 @@
+#include "debounce.h"
+
+static void setState(Debounce* d, int level, uint64_t time)
+{
+    d->state = level;
+    d->changed = time;
+    if (level == 0) {
+        d->presses++;
+    }
+}
+
+void debounceInit(Debounce* d, int level, int debounceMs, uint64_t now)
+{
+    d->state = level;
+    d->level = level;
+    d->debounce = (uint64_t)debounceMs * 1000;
+    d->changed = now;
+    d->edge = now;
+    d->presses = 0;
+}
+
+// Time is when the level changed, which can be before now if it comes
+// from a kernel timestamp or a sample
+void debounceEdge(Debounce* d, int level, uint64_t time)
+{
+    if (level == d->level) {
+        return;
+    }
+
+    d->level = level;
+    d->edge = time;
+    if (level != d->state && time >= d->changed + d->debounce) {
+        setState(d, level, time);
+    }
+}
+
+// Takes a level that settled while changes were being ignored
+void debounceUpdate(Debounce* d, uint64_t now)
+{
+    if (d->level != d->state && now >= d->edge + d->debounce) {
+        setState(d, d->level, d->edge + d->debounce);
+    }
+}
+
+int debounceTakePresses(Debounce* d)
+{
+    int presses = d->presses;
+    d->presses = 0;
+    return presses;
+}
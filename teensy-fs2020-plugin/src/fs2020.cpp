@@ -1,22 +1,22 @@
 #include "TeensyControls.h"
+#include <conio.h>
 #include <map>
 #include <string>
 #include "SimConnect.h"
 #include "jetbridge.h"
 #include "fs2020.h"
+#include "mapping.h"
 
 const char* VersionString = "v1.2.1";
 
-const int MaxDataMappings = 256;
-
 HANDLE hSimConnect;
 bool connected = false;
 bool quit = false;
 double* dataPtr = NULL;
 int dataMappings = 0;
 int readMappings = 0;
-DataMapping dataMapping[MaxDataMappings];
-std::map<std::string, int> dataMap;
+MappingTable* mappings = NULL;
+DataMapping* dataMapping = NULL;
 std::map<DWORD, std::string> packetMap;
 
 
@@ -148,14 +148,15 @@ bool addDataDef(SIMCONNECT_DATA_DEFINITION_ID defId, const char* var, const char
     }
 }
 
-int dataRefNum(const char* dataRef, int id)
+// Name need not be null terminated
+int dataRefNum(const char* dataRef, int len, int id)
 {
-    if (dataMap.count(dataRef) == 0) {
-        printf("Teensy requested an unmapped Data Ref #%d: %s\n", id, dataRef);
-        return -1;
+    int refNum = nameIndexFind(&mappings->index, dataRef, len);
+    if (refNum == -1) {
+        printf("Teensy requested an unmapped Data Ref #%d: %.*s\n", id, len, dataRef);
     }
 
-    return dataMap[dataRef];
+    return refNum;
 }
 
 char* dataRefName(int refNum)
@@ -187,12 +188,11 @@ double dataRefRead(int refNum)
         return MAXINT;
     }
 
-    double value = *(dataPtr + dataMapping[refNum].readOffset);
+    double value = *(dataPtr + dataMapping[refNum].readOffset) * dataMapping[refNum].readScale;
 
-    if (stricmp(dataMapping[refNum].readVarUnits, "10khz") == 0) {
-        value /= 10;
+    if (dataMapping[refNum].precision >= 0) {
+        return mappingRound(&dataMapping[refNum], value);
     }
-
     return round(value * 1000.0) / 1000.0;
 }
 
@@ -207,16 +207,7 @@ void dataRefWrite(int refNum, double value, bool isAdjust)
         origVal = round(*(dataPtr + dataMapping[refNum].readOffset) * 1000.0) / 1000.0;
     }
 
-    char writeVarUnits[16];
-    if (stricmp(dataMapping[refNum].writeVarUnits, "10khz") == 0) {
-        value *= 10;
-        strcpy(writeVarUnits, "khz");
-    }
-    else {
-        strcpy(writeVarUnits, dataMapping[refNum].writeVarUnits);
-    }
-
-    value = round(value * 1000.0) / 1000.0;
+    value = round(value * dataMapping[refNum].writeScale * 1000.0) / 1000.0;
 
     if (origVal == value) {
         return;
@@ -226,7 +217,7 @@ void dataRefWrite(int refNum, double value, bool isAdjust)
     printf("Value changed by Teensy - Change %s from %.3f to %.3f\n", dataMapping[refNum].writeVar, origVal, value);
 #endif
 
-    writeJetbridgeVar(dataMapping[refNum].writeVar, writeVarUnits, value);
+    writeJetbridgeVar(dataMapping[refNum].writeVar, dataMapping[refNum].writeVarUnits, value);
 
     // Delayed read after write
     dataMapping[refNum].setValue = value;
@@ -238,16 +229,13 @@ bool dataRefWritten(int refNum)
     return (dataMapping[refNum].setDelay > 0);
 }
 
-void strTrunc(char* dest, char* src)
+// How much a value must change, and how long after it was last sent in
+// usec, before it is sent to a Teensy again, and how soon it is sent
+void dataRefLimits(int refNum, double* deadband, int* minInterval, int* priority)
 {
-    while (*src == ' ' || *src == '\t') {
-        src++;
-    }
-    strcpy(dest, src);
-
-    while (strlen(dest) > 0 && (dest[strlen(dest) - 1] == ' ' || dest[strlen(dest) - 1] == '\t')) {
-        dest[strlen(dest) - 1] = '\0';
-    }
+    *deadband = dataMapping[refNum].deadband;
+    *minInterval = dataMapping[refNum].maxRate > 0 ? 1000000 / dataMapping[refNum].maxRate : 0;
+    *priority = dataMapping[refNum].priority;
 }
 
 bool loadDataMappings(const char* filename)
@@ -265,137 +253,13 @@ bool loadDataMappings(const char* filename)
         strcpy(pos + 1, filename);
     }
 
-    FILE* inf = fopen(path, "r");
-    if (!inf) {
-        printf("File not found: %s\n", path);
+    mappings = mappingLoad(path);
+    if (!mappings) {
         return false;
     }
 
-    printf("Loading data mappings from %s\n", path);
-
-    char line[1024];
-    int lineNum = 0;
-    while (fgets(line, 1024, inf) != 0) {
-        lineNum++;
-
-        char* pos = strchr(line, '#');
-        if (pos) {
-            *pos = '\0';
-        }
-
-        char* end = &line[strlen(line) - 1];
-        while (end >= &line[0] && *end == '\r' || *end == '\n' || *end == ' ' || *end == '\t') {
-            end--;
-        }
-        if (end < &line[0]) {
-            continue;
-        }
-        *(end+1) = '\0';
-
-        if (strlen(line) == 0) {
-            continue;
-        }
-
-        char* readVarPos = strchr(line, ';');
-        if (!readVarPos) {
-            printf("Error in data mapping file: Line %d does not contain a semi-colon\n", lineNum);
-            return false;
-        }
-        *readVarPos = '\0';
-        strTrunc(dataMapping[dataMappings].dataRef, line);
-        if (*dataMapping[dataMappings].dataRef == '\0') {
-            printf("Error in data mapping file: Line %d has a missing Data Ref\n", lineNum);
-            return false;
-        }
-        readVarPos++;
-
-        *dataMapping[dataMappings].writeVar = '\0';
-        *dataMapping[dataMappings].writeVarUnits = '\0';
-        dataMapping[dataMappings].testValue = MAXINT;
-
-        char* writeVarPos = strchr(readVarPos, ';');
-        if (writeVarPos) {
-            *writeVarPos = '\0';
-            strTrunc(dataMapping[dataMappings].writeVar, writeVarPos + 1);
-            if (*dataMapping[dataMappings].writeVar != '\0') {
-                if (strchr(dataMapping[dataMappings].writeVar, ';')) {
-                    printf("Error in data mapping file: Line %d contains more than two semi-colons\n", lineNum);
-                    return false;
-                }
-
-                char* unitsPos = strchr(dataMapping[dataMappings].writeVar, ',');
-                if (!unitsPos) {
-                    printf("Error in data mapping file: Line %d Write Var does not contain a comma\n", lineNum);
-                    return false;
-                }
-                *unitsPos = '\0';
-                strTrunc(dataMapping[dataMappings].writeVarUnits, unitsPos + 1);
-            }
-        }
-
-        strTrunc(dataMapping[dataMappings].readVar, readVarPos);
-        if (*dataMapping[dataMappings].readVar != '\0') {
-            if (isdigit(*dataMapping[dataMappings].readVar)) {
-                char* adjustPos = strchr(dataMapping[dataMappings].readVar, '+');
-                if (!adjustPos) {
-                    adjustPos = strchr(dataMapping[dataMappings].readVar, '-');
-                }
-                if (adjustPos) {
-                    sscanf(adjustPos, "%lf", &dataMapping[dataMappings].testAdjust);
-                    *adjustPos = '\0';
-                }
-                else {
-                    dataMapping[dataMappings].testAdjust = 0;
-                }
-
-                sscanf(dataMapping[dataMappings].readVar, "%lf", &dataMapping[dataMappings].testValue);
-                *dataMapping[dataMappings].readVar = '\0';
-
-#ifdef MORE_DEBUG
-                printf("Data Ref Test %d = %s  Value: %.3f  Adjust: %.3f\n", dataMappings, dataMapping[dataMappings].dataRef,
-                    dataMapping[dataMappings].testValue, dataMapping[dataMappings].testAdjust);
-#endif
-            }
-            else {
-                char* unitsPos = strchr(dataMapping[dataMappings].readVar, ',');
-                if (!unitsPos) {
-                    printf("Error in data mapping file: Line %d Read Var does not contain a comma\n", lineNum);
-                    return false;
-                }
-                *unitsPos = '\0';
-                strTrunc(dataMapping[dataMappings].readVarUnits, unitsPos + 1);
-                if (*dataMapping[dataMappings].readVarUnits == '\0') {
-                    printf("Error in data mapping file: Line %d Read Var has missing Units\n", lineNum);
-                    return false;
-                }
-            }
-        }
-
-        if (*dataMapping[dataMappings].writeVar == '\0') {
-            strcpy(dataMapping[dataMappings].writeVar, dataMapping[dataMappings].readVar);
-        }
-
-        if (*dataMapping[dataMappings].writeVarUnits == '\0') {
-            strcpy(dataMapping[dataMappings].writeVarUnits, dataMapping[dataMappings].readVarUnits);
-        }
-
-#ifdef MORE_DEBUG
-        printf("Data Mapping %d = %s, %s (%s), %s (%s)\n", dataMappings, dataMapping[dataMappings].dataRef, dataMapping[dataMappings].readVar,
-            dataMapping[dataMappings].readVarUnits, dataMapping[dataMappings].writeVar, dataMapping[dataMappings].writeVarUnits);
-#endif
-
-        if (!dataMap.insert(std::make_pair(std::string(dataMapping[dataMappings].dataRef), dataMappings)).second) {
-            printf("Error in data mapping file: Line %d has duplicate Data Ref\n", lineNum);
-            return false;
-        }
-
-        dataMapping[dataMappings].setDelay = 0;
-        dataMappings++;
-    }
-
-    fclose(inf);
-
-    printf("Loaded %d data mappings\n", dataMappings);
+    dataMapping = mappings->mapping;
+    dataMappings = mappings->count;
     return true;
 }
 
@@ -516,6 +380,7 @@ int __cdecl _tmain(int argc, _TCHAR* argv[])
         }
     }
 
+    printf("Press S in this window to print the USB statistics\n");
     printf("Searching for local MS FS2020...\n");
     connected = false;
 
@@ -526,6 +391,14 @@ int __cdecl _tmain(int argc, _TCHAR* argv[])
 
     while (!quit)
     {
+        // S prints the USB statistics, like kill -USR1 on the Pi
+        while (_kbhit()) {
+            int key = _getch();
+            if (key == 's' || key == 'S') {
+                TeensyControls_print_stats();
+            }
+        }
+
         if (connected) {
             bool disconnect = false;
             result = SimConnect_CallDispatch(hSimConnect, MyDispatchProc, NULL);
@@ -565,6 +438,7 @@ int __cdecl _tmain(int argc, _TCHAR* argv[])
         SimConnect_Close(hSimConnect);
     }
 
+    TeensyControls_print_stats();
     TeensyControls_usb_close();
     TeensyControls_delete_offline_teensy();
 
@@ -1,114 +1,286 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "gpio.h"
+#include "debounce.h"
 
 // If you have a newer Raspberry Pi uncomment the next line to use gpiod instead of WiringPi
+// (make.sh defines it when UseGpiod=1 is set there)
 //#define UseGpiod
 
-#ifdef UseGpiod
-
-#include <gpiod.h>
-
 const int MaxGpio = 28;
-char chipName[16];
-struct gpiod_chip* gpioChip;
-struct gpiod_line_bulk gpioLines;
-int gpioValues[MaxGpio];
+char chipName[64];
+Debounce gpioButtons[MaxGpio];
+bool gpioAdded[MaxGpio];
 
-void gpioInit()
+static uint64_t gpioUsec()
 {
-    unsigned int offsets[MaxGpio];
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-    // Raspberry Pi 5 uses gpiochip4 rather than gpiochip0
-    FILE* inf = fopen("/dev/gpiochip4", "r");
-    if (inf) {
-        fclose(inf);
-        strcpy(chipName, "gpiochip4");
+// Set TEENSY_GPIO_CHIP to use another chip, e.g. a gpio-sim chip for
+// testing without a Pi
+static void gpioFindChip()
+{
+    const char* chip = getenv("TEENSY_GPIO_CHIP");
+    if (chip && *chip) {
+        snprintf(chipName, sizeof(chipName), "%s", chip);
     }
     else {
-        strcpy(chipName, "gpiochip0");
+        // Raspberry Pi 5 uses gpiochip4 rather than gpiochip0
+        FILE* inf = fopen("/dev/gpiochip4", "r");
+        if (inf) {
+            fclose(inf);
+            strcpy(chipName, "gpiochip4");
+        }
+        else {
+            strcpy(chipName, "gpiochip0");
+        }
+    }
+}
+
+// Debounced state, 0 = pressed
+int gpioGetState(int gpioNum)
+{
+    if (!gpioAdded[gpioNum]) {
+        return 1;
     }
+    return gpioButtons[gpioNum].state;
+}
+
+// Presses since the last call, so a press between two reads isn't missed
+int gpioPresses(int gpioNum)
+{
+    return debounceTakePresses(&gpioButtons[gpioNum]);
+}
+
+// When the debounced state last changed, on the monotonic clock in usec
+uint64_t gpioChangeTime(int gpioNum)
+{
+    return gpioButtons[gpioNum].changed;
+}
 
-    gpioChip = gpiod_chip_open_by_name(chipName);
+#ifdef UseGpiod
+
+#include <gpiod.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+// Each button line is requested for edge events, which the kernel
+// timestamps as they happen. The lines' event fds are gathered into an
+// epoll fd that the main loop waits on, so nothing is polled.
+// TEENSY_GPIO_CHIP can be a chip name, path or label.
+struct gpiod_chip* gpioChip;
+struct gpiod_line* gpioLines[MaxGpio];
+int gpioEpollFd = -1;
+
+void gpioInit()
+{
+    gpioFindChip();
+    gpioChip = gpiod_chip_open_lookup(chipName);
     if (!gpioChip) {
         printf("Failed to open chip %s\n", chipName);
         return;
     }
 
-    for (int i = 0; i < MaxGpio; i++) {
-        offsets[i] = i;
+    gpioEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (gpioEpollFd < 0) {
+        printf("Failed to create gpio event fd\n");
     }
+}
 
-    if (gpiod_chip_get_lines(gpioChip, offsets, MaxGpio, &gpioLines)) {
-        printf("Failed to get chip %s lines\n", chipName);
+void gpioAdd(int gpioNum, int debounceMs)
+{
+    if (!gpioChip || gpioNum < 0 || gpioNum >= MaxGpio || gpioAdded[gpioNum]) {
         return;
     }
 
-    struct gpiod_line_request_config config;
-    memset(&config, 0, sizeof(config));
-    config.consumer = "teensy-pi-plugin";
-    config.request_type = GPIOD_LINE_REQUEST_DIRECTION_INPUT;
-    config.flags = GPIOD_LINE_REQUEST_FLAG_BIAS_PULL_UP;
+    struct gpiod_line* line = gpiod_chip_get_line(gpioChip, gpioNum);
+    if (!line || gpiod_line_request_both_edges_events_flags(line, "teensy-pi-plugin", GPIOD_LINE_REQUEST_FLAG_BIAS_PULL_UP)) {
+        printf("Failed to request chip %s line %d events\n", chipName, gpioNum);
+        return;
+    }
 
-    if (gpiod_line_request_bulk(&gpioLines, &config, gpioValues)) {
-        printf("Failed to bulk request chip %s lines\n", chipName);
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u32 = gpioNum;
+    if (epoll_ctl(gpioEpollFd, EPOLL_CTL_ADD, gpiod_line_event_get_fd(line), &event) != 0) {
+        printf("Failed to watch chip %s line %d events\n", chipName, gpioNum);
+        gpiod_line_release(line);
         return;
     }
+
+    int value = gpiod_line_get_value(line);
+    debounceInit(&gpioButtons[gpioNum], value == 0 ? 0 : 1, debounceMs, gpioUsec());
+    gpioLines[gpioNum] = line;
+    gpioAdded[gpioNum] = true;
 }
 
-void gpioAdd(int gpioNum)
+void gpioStart()
 {
-    // Nothing to do as all lines have been set to inputs and pulled-up
+    // Nothing to do as each line was requested when it was added
 }
 
+// Drains the edge events of any lines that have them, then lets each
+// button take a level that settled while it was ignoring bounces.
+// Event timestamps use CLOCK_MONOTONIC, the default since Linux 5.7.
 void gpioReadAll()
 {
-    // Just read every gpio state in a single call
-    if (gpiod_line_get_value_bulk(&gpioLines, gpioValues)) {
-        printf("Failed to get gpio values\n");
-        return;
+    struct epoll_event ready[MaxGpio];
+    struct gpiod_line_event events[16];
+
+    int count = gpioEpollFd < 0 ? 0 : epoll_wait(gpioEpollFd, ready, MaxGpio, 0);
+    for (int i = 0; i < count; i++) {
+        int gpioNum = ready[i].data.u32;
+        int eventCount = gpiod_line_event_read_multiple(gpioLines[gpioNum], events, 16);
+        for (int j = 0; j < eventCount; j++) {
+            uint64_t time = (uint64_t)events[j].ts.tv_sec * 1000000 + events[j].ts.tv_nsec / 1000;
+            int level = events[j].event_type == GPIOD_LINE_EVENT_RISING_EDGE ? 1 : 0;
+            debounceEdge(&gpioButtons[gpioNum], level, time);
+        }
+    }
+
+    uint64_t now = gpioUsec();
+    for (int i = 0; i < MaxGpio; i++) {
+        if (gpioAdded[i]) {
+            debounceUpdate(&gpioButtons[i], now);
+        }
     }
 }
 
-int gpioGetState(int gpioNum)
+int gpioEventFd()
 {
-    // States have already been read so just return the requested one
-    return gpioValues[gpioNum];
+    return gpioEpollFd;
 }
 
 #else
 
 #include <wiringPi.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+
+// Pull-ups are set for all the button pins at once by requesting them
+// as inputs with bias from the GPIO character device. The request fd is
+// held open while we run so the pins stay configured. WiringPi is still
+// used to read them.
+int gpioDebounceMs[MaxGpio];
+int gpioRequestFd = -1;
 
 void gpioInit()
 {
     // Use BCM GPIO pin numbers
     wiringPiSetupGpio();
+    gpioFindChip();
 }
 
-void gpioAdd(int gpioNum)
+void gpioAdd(int gpioNum, int debounceMs)
 {
-    // NOTE: pullUpDnControl does not work on RasPi4 so have
-    // to use raspi-gpio command line to pull up resistors.
-    char command[256];
+    if (gpioNum < 0 || gpioNum >= MaxGpio || gpioAdded[gpioNum]) {
+        return;
+    }
 
     pinMode(gpioNum, INPUT);
-    sprintf(command, "raspi-gpio set %d pu", gpioNum);
+    gpioDebounceMs[gpioNum] = debounceMs;
+    gpioAdded[gpioNum] = true;
+}
+
+static bool gpioRequestPullUps(const char* path)
+{
+    int chipFd = open(path, O_RDWR | O_CLOEXEC);
+    if (chipFd < 0) {
+        return false;
+    }
+
+    struct gpio_v2_line_request request;
+    memset(&request, 0, sizeof(request));
+    for (int i = 0; i < MaxGpio; i++) {
+        if (gpioAdded[i]) {
+            request.offsets[request.num_lines++] = i;
+        }
+    }
+    strcpy(request.consumer, "teensy-pi-plugin");
+    request.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_BIAS_PULL_UP;
 
-    if (system(command) != 0) {
-        printf("Failed to run raspi-gpio command\n");
+    int result = ioctl(chipFd, GPIO_V2_GET_LINE_IOCTL, &request);
+    close(chipFd);
+    if (result < 0) {
+        return false;
     }
+
+    gpioRequestFd = request.fd;
+    return true;
 }
 
+// Call once all the buttons have been added
+void gpioStart()
+{
+    char path[80];
+    int count = 0;
+
+    for (int i = 0; i < MaxGpio; i++) {
+        if (gpioAdded[i]) {
+            count++;
+        }
+    }
+
+    if (count == 0) {
+        return;
+    }
+
+    uint64_t start = gpioUsec();
+    snprintf(path, sizeof(path), "%s%s", chipName[0] == '/' ? "" : "/dev/", chipName);
+    if (gpioRequestPullUps(path)) {
+        printf("Pulled up %d gpio pins through %s in %.1f ms\n", count, path, (gpioUsec() - start) / 1000.0);
+    }
+    else {
+        // Kernel older than 5.10 or lines already in use. Note that
+        // pullUpDnControl does not work on RasPi4 so have to use
+        // raspi-gpio command line to pull up resistors.
+        printf("Failed to request gpio lines from %s, errno = %d\n", path, errno);
+        for (int i = 0; i < MaxGpio; i++) {
+            if (gpioAdded[i]) {
+                char command[256];
+                sprintf(command, "raspi-gpio set %d pu", i);
+                if (system(command) != 0) {
+                    printf("Failed to run raspi-gpio command\n");
+                }
+            }
+        }
+        printf("Pulled up %d gpio pins with raspi-gpio in %.1f ms\n", count, (gpioUsec() - start) / 1000.0);
+    }
+
+    uint64_t now = gpioUsec();
+    for (int i = 0; i < MaxGpio; i++) {
+        if (gpioAdded[i]) {
+            debounceInit(&gpioButtons[i], digitalRead(i), gpioDebounceMs[i], now);
+        }
+    }
+}
+
+// WiringPi only supports polling so each read is a sample of the level
 void gpioReadAll()
 {
-    // Nothing to do as states are read individually
+    uint64_t now = gpioUsec();
+
+    for (int i = 0; i < MaxGpio; i++) {
+        if (gpioAdded[i]) {
+            debounceEdge(&gpioButtons[i], digitalRead(i), now);
+            debounceUpdate(&gpioButtons[i], now);
+        }
+    }
 }
 
-int gpioGetState(int gpioNum)
+int gpioEventFd()
 {
-    return digitalRead(gpioNum);
+    // WiringPi only supports polling
+    return -1;
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -1,4 +1,5 @@
 #include "TeensyControls.h"
+#include <math.h>
 #include "fs2020.h"
 
 const int xplmType_Int = 1;
@@ -10,10 +11,12 @@ const int xplmType_Data = 6;
 
 static void input_packet(teensy_t *t, const uint8_t *packet);
 static int  output_data(teensy_t *t, const uint8_t *data, int datalen);
+static int  output_value(teensy_t *t, int id, int type, int32_t i32);
 static void output_flush(teensy_t *t);
+static void output_sent(teensy_t *t, item_info_t *info, uint64_t now);
 
 
-// process all buffered input
+// process all buffered input, decoding each report in place in the ring
 // elapsed is time in seconds since previous input
 // flags = 1 upon enable event
 // flags = 2 upon disable event
@@ -21,11 +24,12 @@ static void output_flush(teensy_t *t);
 void TeensyControls_input(float elapsedNotUsed, int flags)
 {
 	teensy_t *t;
-	uint8_t packet[64];
+	const uint8_t *packet;
 
 	for (t = TeensyControls_first_teensy; t; t = t->next) {
-		while (TeensyControls_input_fetch(t, packet)) {
+		while ((packet = TeensyControls_input_peek(t)) != NULL) {
 			input_packet(t, packet);
+			TeensyControls_input_release(t);
 		}
 	}
 }
@@ -54,6 +58,7 @@ static void decode_packet(teensy_t *t, const uint8_t *packetPtr, uint8_t len)
 {
 	int cmd, id, type;
 	item_t *item;
+	item_info_t *info;
 	int32_t intval;
 	float floatval;
 	int floatTrunc;
@@ -80,14 +85,24 @@ static void decode_packet(teensy_t *t, const uint8_t *packetPtr, uint8_t len)
 			//t->unknown_id_heard = 1;
 			break;
 		}
-		//printf("WriteData id: %d  type: %d  item: %s\n", id, type, item->name);
+		//printf("WriteData id: %d  type: %d  item: %s\n", id, type, TeensyControls_item_info(t, item)->name);
 		//if (item->type != type || item->datawritable == 0) break;
 		intval = *(packetPtr + 6) | (*(packetPtr + 7) << 8)
 			| (*(packetPtr + 8) << 16) | (*(packetPtr + 9) << 24);
+		info = TeensyControls_item_info(t, item);
+		if (item->dataref < 0 && !info->unmapped_logged) {
+			// kept so it can be bound on a mapping reload, but said once
+			printf("Cannot write data due to unmapped Data Ref %s\n", info->name);
+			info->unmapped_logged = 1;
+		}
+		info->input_time = t->input_fetch_time;
+		info->decode_time = TeensyControls_usec();
+		TeensyControls_latency(t, LATENCY_INPUT_QUEUE, info->input_time, info->decode_time);
 		if (type == 1) { // integer
 			item->intval = intval;
 			item->intval_remote = intval;
 			item->changed_by_teensy = 1;
+			t->input_changed = 1;
 		} else if (type == 2) { // float
 			floatval = bytes2float(&intval);
 			floatTrunc = floatval * 1000.0;
@@ -95,6 +110,7 @@ static void decode_packet(teensy_t *t, const uint8_t *packetPtr, uint8_t len)
 			item->floatval = floatval;
 			item->floatval_remote = floatval;
 			item->changed_by_teensy = 1;
+			t->input_changed = 1;
 		}
 		break;
 
@@ -107,10 +123,12 @@ static void decode_packet(teensy_t *t, const uint8_t *packetPtr, uint8_t len)
 			printf("CommandBegin id: %d  Unknown item\n", id);
 			break;
 		}
-		printf("CommandBegin id: %d  type: %d  name: %s\n", id, item->type, item->name);
-		if (item->type != 0 || item->command_count >= 128) break;
-		item->command_queue[item->command_count++] = cmd;
-		printf("Command Begin: id=%d, name=%s\n", id, item->name);
+		info = TeensyControls_item_info(t, item);
+		printf("CommandBegin id: %d  type: %d  name: %s\n", id, item->type, info->name);
+		if (item->type != 0 || info->command_count >= 128) break;
+		info->command_queue[info->command_count++] = cmd;
+		t->input_changed = 1;
+		printf("Command Begin: id=%d, name=%s\n", id, info->name);
 		break;
 
 	  case 0x05: // command end
@@ -122,10 +140,12 @@ static void decode_packet(teensy_t *t, const uint8_t *packetPtr, uint8_t len)
 			printf("CommandEnd id: %d  Unknown item\n", id);
 			break;
 		}
-		printf("CommandEnd id: %d  type: %d  name: %s\n", id, item->type, item->name);
-		if (item->type != 0 || item->command_count >= 128) break;
-		item->command_queue[item->command_count++] = cmd;
-		printf("Command End: id=%d, name=%s\n", id, item->name);
+		info = TeensyControls_item_info(t, item);
+		printf("CommandEnd id: %d  type: %d  name: %s\n", id, item->type, info->name);
+		if (item->type != 0 || info->command_count >= 128) break;
+		info->command_queue[info->command_count++] = cmd;
+		t->input_changed = 1;
+		printf("Command End: id=%d, name=%s\n", id, info->name);
 		break;
 
 	  case 0x06: // command once
@@ -137,10 +157,20 @@ static void decode_packet(teensy_t *t, const uint8_t *packetPtr, uint8_t len)
 			printf("CommandOnce id: %d  Unknown item\n", id);
 			break;
 		}
-		printf("CommandOnce id: %d  type: %d  name: %s\n", id, item->type, item->name);
-		if (item->type != 0 || item->command_count >= 128) break;
-		item->command_queue[item->command_count++] = cmd;
-		printf("Command Once: id=%d, name=%s\n", id, item->name);
+		info = TeensyControls_item_info(t, item);
+		printf("CommandOnce id: %d  type: %d  name: %s\n", id, item->type, info->name);
+		if (item->type != 0 || info->command_count >= 128) break;
+		info->command_queue[info->command_count++] = cmd;
+		t->input_changed = 1;
+		printf("Command Once: id=%d, name=%s\n", id, info->name);
+		break;
+
+	  case 0x07: // capabilities, reply to the bits offered in enable
+		if (len < 4) break;
+		t->output_caps = *(packetPtr + 2) & OUTPUT_CAP_MULTI_WRITE;
+#ifdef DEBUG
+		printf("Teensy capabilities: %02x\n", t->output_caps);
+#endif
 		break;
 	}
 }
@@ -171,16 +201,23 @@ static void input_packet(teensy_t *t, const uint8_t *packet) {
 		printf("\n");
 	}
 #endif
+	// Messages that fit in the report are decoded straight from it. Only
+	// a long message, started here and continued in 0xFF fragments, is
+	// copied into t->input_packet to be put back together.
 	i = 0;
 	do {
 		len = packet[i];
 		//printf("len=%d\n",len);
 		if (len < 2 ) return;
 		if (len > 64-i) {
-			if (packet[i+1] == 0xff) {
+			if (i < 63 && packet[i+1] == 0xff) {
 				printf("Long Teensy command fragment with len>buffer space, not allowed (len=%d, bufspace=%d, cmd=%02x)\n", len, 64-i, packet[i+1]);
+				t->expect_fragment_id = 0;
 				return;
 			}
+			if (t->expect_fragment_id != 0) {
+				printf("Expected Teensy command fragment %d not received (new long command)\n", t->expect_fragment_id);
+			}
 			t->input_packet_bytes_missing = (len-(64-i));
 			t->input_packet_ptr = t->input_packet;
 			t->expect_fragment_id = 1;
@@ -200,12 +237,22 @@ static void input_packet(teensy_t *t, const uint8_t *packet) {
 
 			decode_packet(t,&packet[i],len);
 		} else {
+			if (len < 3) {
+				printf("Teensy command fragment too short (len=%d)\n", len);
+				t->expect_fragment_id = 0;
+				return;
+			}
 			fragment_id = packet[i+2];
-			if (fragment_id != t->expect_fragment_id) {
+			if (t->expect_fragment_id == 0 || fragment_id != t->expect_fragment_id) {
 				  printf("Unexpected Teensy command fragment %d received, expected: %d\n", fragment_id, t->expect_fragment_id);
 				  t->expect_fragment_id=0;
 				  return;
 			}
+			if (len-3 > t->input_packet_bytes_missing) {
+				printf("Mismatch in frame length, packet fragments invalid\n");
+				t->expect_fragment_id = 0;
+				return;
+			}
 			//printf("Teensy command fragment %d received, len=%d, ptr=%d\n", fragment_id, len, (int)(t->input_packet_ptr-t->input_packet));
 			memcpy(t->input_packet_ptr,&packet[i+3],len-3);
 			t->input_packet_ptr+=len-3;
@@ -215,11 +262,6 @@ static void input_packet(teensy_t *t, const uint8_t *packet) {
 				  t->expect_fragment_id=0;
 				  decode_packet(t,t->input_packet,t->input_packet[0]);
 			} else {
-				if (t->input_packet_bytes_missing <0) {
-					printf("Mismatch in frame length, packet fragments invalid\n");
-					t->expect_fragment_id = 0;
-					return;
-				}
 				t->expect_fragment_id++;
 				//printf("%d bytes still missing, expecting more command fragments (ptr=%d)\n",
 				//		  t->input_packet_bytes_missing, (int)(t->input_packet_ptr-t->input_packet));
@@ -229,101 +271,319 @@ static void input_packet(teensy_t *t, const uint8_t *packet) {
 	} while (i < 64);
 }
 
-void TeensyControls_update_xplane(float elapsedNotUsed)
+// a sim value that differs from the Teensy's is only sent once it is
+// outside the mapping's deadband and the item wasn't sent too recently.
+// Held back changes are counted, once for each new value.
+static int send_change(teensy_t *t, int n, double value, double remote, int is_new, uint64_t now)
+{
+	item_t *item = &t->items[n];
+
+	if (item->dirty || remote == MAXINT || value == MAXINT) return 1;
+	if ((item->deadband > 0 && fabs(value - remote) < item->deadband) ||
+	  (item->min_interval > 0 && now - t->item_info[n].sent_time < item->min_interval)) {
+		if (is_new) t->output_suppressed++;
+		return 0;
+	}
+	return 1;
+}
+
+// Several Teensys often register the same Data Ref, as mirrored captain
+// and first officer panels do. Step 3 of update_xplane reads each one
+// from the sim once a frame into its cell, indexed by dataref, and every
+// item bound to it takes the value from there.
+typedef struct {
+	uint32_t frame;		// sim_frame the cell was read in
+	int written;		// dataRefWritten, the value is not read
+	double value;		// dataRefRead
+} sim_cell_t;
+
+static sim_cell_t *sim_cells;
+static int sim_cells_size;
+static uint32_t sim_frame;
+
+// start a new frame, so every cell is read again when first used
+static void sim_cell_frame(void)
+{
+	if (++sim_frame == 0) {
+		memset(sim_cells, 0, sim_cells_size * sizeof(sim_cell_t));
+		sim_frame = 1;
+	}
+}
+
+static sim_cell_t * sim_cell(int dataref)
+{
+	static sim_cell_t uncached;
+	sim_cell_t *cell;
+	int size;
+
+	if (dataref >= sim_cells_size) {
+		size = sim_cells_size ? sim_cells_size : 256;
+		while (size <= dataref) size *= 2;
+		cell = (sim_cell_t *)realloc(sim_cells, size * sizeof(sim_cell_t));
+		if (cell) {
+			memset(cell + sim_cells_size, 0, (size - sim_cells_size) * sizeof(sim_cell_t));
+			sim_cells = cell;
+			sim_cells_size = size;
+		}
+	}
+	cell = dataref < sim_cells_size ? &sim_cells[dataref] : &uncached;
+	if (cell->frame != sim_frame || cell == &uncached) {
+		cell->frame = sim_frame;
+		cell->written = dataRefWritten(dataref);
+		if (!cell->written) cell->value = dataRefRead(dataref);
+	}
+	return cell;
+}
+
+// steps 1 and 2 of update_xplane, passing what the Teensys sent to the
+// sim. Teensys that sent nothing since the last call are skipped, so this
+// is cheap enough to call every time input arrives.
+void TeensyControls_write_xplane(void)
 {
 	teensy_t *t;
 	item_t *item;
-	int i, count;
-	float f;
-	int floatTrunc;
+	item_info_t *info;
+	int i, n, count;
+	uint64_t now;
 
 	// step 1: do all commands
 	for (t = TeensyControls_first_teensy; t; t = t->next) {
-		for (item = t->items; item; item = item->next) {
-			if (item->type != 0) continue;
-			count = item->command_count;
+		if (!t->input_changed) continue;
+		for (n = 0; n < t->item_count; n++) {
+			if (t->items[n].type != 0) continue;
+			info = &t->item_info[n];
+			count = info->command_count;
 			for (i = 0; i < count; i++) {
-				switch (item->command_queue[i]) {
+				switch (info->command_queue[i]) {
 				  case 0x04: // command begin
-					//XPLMCommandBegin(item->cmdref);
-					printf("Command %s Begin\n", item->name);
-					item->command_began = 1;
+					//XPLMCommandBegin(info->cmdref);
+					printf("Command %s Begin\n", info->name);
+					info->command_began = 1;
 					break;
 				  case 0x05: // command end
-					//XPLMCommandEnd(item->cmdref);
-					printf("Command %s End\n", item->name);
-					item->command_began = 0;
+					//XPLMCommandEnd(info->cmdref);
+					printf("Command %s End\n", info->name);
+					info->command_began = 0;
 					break;
 				  case 0x06: // command once
-					//XPLMCommandOnce(item->cmdref);
-					printf("Command %s Once\n", item->name);
+					//XPLMCommandOnce(info->cmdref);
+					printf("Command %s Once\n", info->name);
 				}
 			}
-			item->command_count = 0;
+			info->command_count = 0;
 		}
 	}
 	// step 2: write any data Teensy changed
+	now = TeensyControls_usec();
 	for (t = TeensyControls_first_teensy; t; t = t->next) {
-		for (item = t->items; item; item = item->next) {
-			//printf("Process item %s  val: %f\n", item->name, (float)item->intval);
+		if (!t->input_changed) continue;
+		t->input_changed = 0;
+		for (n = 0; n < t->item_count; n++) {
+			item = &t->items[n];
+			if (item->dataref == -1) {
+				item->changed_by_teensy = 0;	// nowhere to write it
+				continue;
+			}
+			//printf("Process item %d  val: %f\n", item->id, (float)item->intval);
 			if (item->type == 1 && item->changed_by_teensy) {
-				//printf("Int changed by Teensy so write %s = %d\n", item->name, item->intval);
+				//printf("Int changed by Teensy so write %s = %d\n", t->item_info[n].name, item->intval);
 				dataRefWrite(item->dataref, item->intval);
 				item->changed_by_teensy = 0;
+				info = &t->item_info[n];
+				TeensyControls_latency(t, LATENCY_INPUT_SIM, info->decode_time, now);
+				TeensyControls_latency(t, LATENCY_INPUT_TOTAL, info->input_time, now);
 			} else if (item->type == 2 && item->changed_by_teensy) {
-				//printf("Float changed by Teensy so write %s = %.3f\n", item->name, item->floatval);
+				//printf("Float changed by Teensy so write %s = %.3f\n", t->item_info[n].name, item->floatval);
 				dataRefWrite(item->dataref, item->floatval);
 				item->changed_by_teensy = 0;
+				info = &t->item_info[n];
+				TeensyControls_latency(t, LATENCY_INPUT_SIM, info->decode_time, now);
+				TeensyControls_latency(t, LATENCY_INPUT_TOTAL, info->input_time, now);
 			}
 		}
 	}
-	// step 3: read all data from simulator
+}
+
+// take one item's value from its sim cell, marking it dirty if it
+// needs sending to the Teensy
+static void read_item(teensy_t *t, int n, const sim_cell_t *cell, uint64_t now)
+{
+	item_t *item = &t->items[n];
+
+	double value, previous;
+	switch (item->type) {
+		case 0x01: // integer
+			value = cell->value;
+			previous = item->intval;
+			if (value == MAXINT) {
+				item->intval = MAXINT;
+				item->intval_remote = MAXINT;
+			}
+			else {
+				item->intval = value;
+			}
+			if (item->intval != item->intval_remote &&
+			  send_change(t, n, item->intval, item->intval_remote, item->intval != previous, now)) {
+				//printf("Sim int %s changed from %d to %d\n", t->item_info[n].name, item->intval_remote, item->intval);
+				if (!item->dirty) t->item_info[n].dirty_time = now;
+				TeensyControls_dirty_item(t, item);
+			}
+			break;
+
+			case 0x02: // float
+				value = cell->value;
+				previous = item->floatval;
+				if (value == MAXINT) {
+					item->floatval_remote = MAXINT;
+				}
+				else {
+					item->floatval = value;
+				}
+
+				if (item->floatval != item->floatval_remote &&
+				  send_change(t, n, item->floatval, item->floatval_remote, item->floatval != previous, now)) {
+					//printf("Sim float %s changed from %.3f to %.3f\n", t->item_info[n].name, item->floatval_remote, item->floatval);
+					if (!item->dirty) t->item_info[n].dirty_time = now;
+					TeensyControls_dirty_item(t, item);
+				}
+				break;
+		 
+		case 0x04: // string
+			printf("Read String from sim %s - Scott not implemented\n", t->item_info[n].name);
+			break;
+	}
+}
+
+// step 3 of update_xplane, reading the sim and marking the items that
+// need sending. Each call starts a new frame for the sim cells, so call
+// it once a frame, never on every wakeup, or the cells are read again.
+void TeensyControls_read_xplane(void)
+{
+	teensy_t *t;
+	item_t *item;
+	sim_cell_t *cell;
+	uint64_t now;
+	int n;
+
+	// step 3: read all data from simulator, once for each Data Ref
+	now = TeensyControls_usec();
+	sim_cell_frame();
 	for (t = TeensyControls_first_teensy; t; t = t->next) {
-		for (item = t->items; item; item = item->next) {
-			if (dataRefWritten(item->dataref)) {
+		for (n = 0; n < t->item_count; n++) {
+			item = &t->items[n];
+			if (item->dataref == -1 || item->type == 0) {
 				continue;
 			}
+			cell = sim_cell(item->dataref);
+			if (!cell->written) {
+				read_item(t, n, cell, now);
+			}
+		}
+	}
+}
 
-			double value;
-			switch (item->type) {
-				case 0x01: // integer
-					value = dataRefRead(item->dataref);
-					if (value == MAXINT) {
-						item->intval = MAXINT;
-						item->intval_remote = MAXINT;
-					}
-					else {
-						item->intval = value;
-					}
-					//if (item->intval != item->intval_remote) {
-					//	printf("Sim int %s changed from %d to %d\n", item->name, item->intval_remote, item->intval);
-					//}
-					break;
-
-					case 0x02: // float
-						value = dataRefRead(item->dataref);
-						if (value == MAXINT) {
-							item->floatval_remote = MAXINT;
-						}
-						else {
-							item->floatval = value;
-						}
-
-						//if (item->floatval != item->floatval_remote) {
-						//	printf("Sim float %s changed from %.3f to %.3f\n", item->name, item->floatval_remote, item->floatval);
-						//}
-						break;
-				 
-				case 0x04: // string
-					printf("Read String from sim %s - Scott not implemented\n", item->name);
-					break;
+// step 3 for a single Data Ref the plugin itself just wrote, such as a
+// button adjust, so its items go out on this wakeup and not the next
+// frame. The cell is read again but stays in the current frame.
+void TeensyControls_read_xplane_ref(int dataref)
+{
+	teensy_t *t;
+	item_t *item;
+	sim_cell_t *cell;
+	uint64_t now;
+	int n;
+
+	if (dataref < 0) return;
+	now = TeensyControls_usec();
+	cell = sim_cell(dataref);
+	cell->written = dataRefWritten(dataref);
+	if (!cell->written) cell->value = dataRefRead(dataref);
+	if (cell->written) return;
+	for (t = TeensyControls_first_teensy; t; t = t->next) {
+		for (n = 0; n < t->item_count; n++) {
+			item = &t->items[n];
+			if (item->dataref == dataref && item->type != 0) {
+				read_item(t, n, cell, now);
 			}
 		}
 	}
 }
 
+void TeensyControls_update_xplane(float elapsedNotUsed)
+{
+	TeensyControls_write_xplane();
+	TeensyControls_read_xplane();
+}
+
+static int *output_sorted;	// scratch for output_order
+static int output_sorted_size;
+
+// priority class an item is sent in. A low item that has waited
+// OUTPUT_AGING is sent as normal so it can't be starved, but nothing
+// but urgent items is ever sent as urgent.
+static int output_priority(teensy_t *t, int n, uint64_t now)
+{
+	int priority = t->items[n].priority;
+	uint64_t since = t->item_info[n].dirty_time;
+
+	if (priority == OUTPUT_LOW && since && now - since >= OUTPUT_AGING) {
+		priority = OUTPUT_NORMAL;
+	}
+	return priority;
+}
+
+// stable sort of the dirty list by priority class. Within a class items
+// keep the order they became dirty in, as unsent items stay at the front.
+static void output_order(teensy_t *t, uint64_t now)
+{
+	int count[OUTPUT_PRIORITIES], start[OUTPUT_PRIORITIES];
+	int i, p, *list;
+
+	if (t->dirty_count < 2) return;
+	if (output_sorted_size < t->dirty_count) {
+		list = (int *)realloc(output_sorted, t->dirty_size * sizeof(int));
+		if (!list) return;
+		output_sorted = list;
+		output_sorted_size = t->dirty_size;
+	}
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < t->dirty_count; i++) {
+		count[output_priority(t, t->dirty[i], now)]++;
+	}
+	for (p = 0; p < OUTPUT_PRIORITIES; p++) {
+		if (count[p] == t->dirty_count) return;
+	}
+	for (p = 0, i = 0; p < OUTPUT_PRIORITIES; i += count[p], p++) {
+		start[p] = i;
+	}
+	for (i = 0; i < t->dirty_count; i++) {
+		p = output_priority(t, t->dirty[i], now);
+		output_sorted[start[p]++] = t->dirty[i];
+	}
+	memcpy(t->dirty, output_sorted, t->dirty_count * sizeof(int));
+}
+
+// adds the tokens earned since last time and limits the reports that
+// may be queued this frame to them. Returns the reports left.
+static int output_budget(teensy_t *t)
+{
+	uint64_t now = TeensyControls_usec();
 
-// output any items where our copy is different than Teensy's remote copy
+	t->output_tokens += (now - t->output_token_time) * (double)t->output_rate / 1000000.0;
+	if (t->output_tokens > OUTPUT_QUEUE_LIMIT) t->output_tokens = OUTPUT_QUEUE_LIMIT;
+	t->output_token_time = now;
+	if (t->output_reports_left > (int)t->output_tokens) {
+		t->output_reports_left = (int)t->output_tokens;
+	}
+	return t->output_reports_left;
+}
+
+// output any items where our copy is different than Teensy's remote copy.
+// Only items in the dirty list, which update_xplane fills, are checked,
+// most urgent first. At most OUTPUT_QUEUE_LIMIT reports are queued ahead
+// of the output thread, fewer if the Teensy has a report rate budget.
+// If it falls behind, changed items stay dirty and only their latest value
+// is sent once there is room, so the Teensy never sees stale values.
 // elapsed is time in seconds since previous output
 // flags = 1 upon enable event
 // flags = 2 upon disable event
@@ -332,8 +592,10 @@ void TeensyControls_output(float elapsedNotUsed, int flags)
 {
 	teensy_t* t;
 	item_t* item;
+	item_info_t* info;
 	uint8_t buf[64], enable_state = 2, en;
-	int32_t i32;
+	int i, n;
+	uint64_t now;
 
 	if (flags == 1) {
 		enable_state = 1;
@@ -342,6 +604,15 @@ void TeensyControls_output(float elapsedNotUsed, int flags)
 		enable_state = 3;
 	}
 	for (t = TeensyControls_first_teensy; t; t = t->next) {
+		t->output_reports_left = OUTPUT_QUEUE_LIMIT - TeensyControls_output_pending(t);
+		if (t->output_reports_left <= 0 && flags == 0) {
+			t->output_deferred++;
+			continue;
+		}
+		if (t->output_rate && output_budget(t) <= 0 && flags == 0) {
+			t->output_throttled++;
+			continue;
+		}
 		en = enable_state;
 		if (en == 2 && t->unknown_id_heard) {
 			en = 1;
@@ -350,7 +621,7 @@ void TeensyControls_output(float elapsedNotUsed, int flags)
 		buf[0] = 4;
 		buf[1] = 3;
 		buf[2] = en;
-		buf[3] = 0;
+		buf[3] = OUTPUT_CAP_MULTI_WRITE;	// capabilities offered
 
 #ifdef DEBUG
 		if (en == 1) {
@@ -365,85 +636,73 @@ void TeensyControls_output(float elapsedNotUsed, int flags)
 		if (t->frames_without_id++ <= ID_FRAME_TIMEOUT) break;  // don't send data until 5 frames after the last received id
 
 		//printf("Send data to Teensy\n");
-		for (item = t->items; item; item = item->next) {
+		now = TeensyControls_usec();
+		output_order(t, now);
+		for (i = 0; i < t->dirty_count; i++) {
+			item = &t->items[t->dirty[i]];
+			info = &t->item_info[t->dirty[i]];
 			//if (item->type == 1) {
-			//	printf("Int to Teensy: %s = %d -> %d\n", item->name, item->intval_remote, item->intval);
+			//	printf("Int to Teensy: %s = %d -> %d\n", info->name, item->intval_remote, item->intval);
 			//}
 			//else if (item->type == 2) {
-			//	printf("Float to Teensy: %s = %.3f -> %.3f\n", item->name, item->floatval_remote, item->floatval);
+			//	printf("Float to Teensy: %s = %.3f -> %.3f\n", info->name, item->floatval_remote, item->floatval);
 			//}
 			if (item->type == 1 && item->intval != item->intval_remote) {
 #ifdef DEBUG
-				printf("Int to Teensy: %s = %d\n", item->name, item->intval);
+				printf("Int to Teensy: %s = %d\n", info->name, item->intval);
 #endif
-				i32 = item->intval;
-				buf[0] = 10;			// length
-				buf[1] = 2;			// 2 = write data
-				buf[2] = item->id & 255;	// ID
-				buf[3] = item->id >> 8;		// ID
-				buf[4] = 1;			// type, 1 = integer
-				buf[5] = 0;			// reserved
-				buf[6] = i32 & 255;
-				buf[7] = (i32 >> 8) & 255;
-				buf[8] = (i32 >> 16) & 255;
-				buf[9] = (i32 >> 24) & 255;
-				if (!output_data(t, buf, 10)) {
-					printf("Failed to output data\n");
-					break;
+				if (!output_value(t, item->id, 1, item->intval)) {
+					break;  // output queue full, send the rest next frame
 				}
 				item->intval_remote = item->intval;
+				output_sent(t, info, now);
+				info->sent_time = now;
 			} else if (item->type == 2 && item->floatval != item->floatval_remote) {
 #ifdef DEBUG
-				printf("Float to Teensy: %s = %.3f\n", item->name, item->floatval);
+				printf("Float to Teensy: %s = %.3f\n", info->name, item->floatval);
 #endif
 				//i32 = *(int32_t *)((char *)(&(item->floatval)));
 				float floatval = item->floatval;	// Convert double to float
-				i32 = bytes2in32(&floatval);
-				buf[0] = 10;			// length
-				buf[1] = 2;			// 2 = write data
-				buf[2] = item->id & 255;	// ID
-				buf[3] = item->id >> 8;		// ID
-				buf[4] = 2;			// type, 2 = float
-				buf[5] = 0;			// reserved
-				buf[6] = i32 & 255;
-				buf[7] = (i32 >> 8) & 255;
-				buf[8] = (i32 >> 16) & 255;
-				buf[9] = (i32 >> 24) & 255;
-				if (!output_data(t, buf, 10)) {
-					printf("Failed to output data\n");
-					break;
+				if (!output_value(t, item->id, 2, bytes2in32(&floatval))) {
+					break;  // output queue full, send the rest next frame
 				}
 				item->floatval_remote = item->floatval;
+				output_sent(t, info, now);
+				info->sent_time = now;
 			} else if (item->type == 4) {
-				int update = item->stringval_len != item->stringval_remote_len;
+				int update = info->stringval_len != info->stringval_remote_len;
 				if (update) {
 //					printf("String update on item %s due to length change. Old value: %d, New value: %d\n",
-//						item->name, item->stringval_remote_len, item->stringval_len);
+//						info->name, info->stringval_remote_len, info->stringval_len);
 				} else {
-					update = memcmp(item->stringval, item->stringval_remote,STRING_MAX_LEN);
+					update = memcmp(info->stringval, info->stringval_remote,STRING_MAX_LEN);
 					if (update) {
 //						printf("String update on item %s due to data change. Old data: %s, New data: %s\n",
-//							item->name, item->stringval_remote, item->stringval);
+//							info->name, info->stringval_remote, info->stringval);
 					}
 				}
 				if (update) {
-					printf("String to Teensy: %s = %s\n", item->name, item->stringval);
-					buf[0] = item->stringval_len+6;
+					printf("String to Teensy: %s = %s\n", info->name, info->stringval);
+					buf[0] = info->stringval_len+6;
 					buf[1] = 2;
 					buf[2] = item->id & 255;
 					buf[3] = item->id >> 8;
 					buf[4] = 4;
 					buf[5] = 0;
-					memcpy(buf+6,item->stringval,item->stringval_len);
+					memcpy(buf+6,info->stringval,info->stringval_len);
 					if (!output_data(t, buf, 64)) {
-						printf("Failed to output data\n");
-						break;
+						break;  // output queue full, send the rest next frame
 					}
-					memcpy(item->stringval_remote, item->stringval, item->stringval_len);
-					item->stringval_remote_len = item->stringval_len;
+					memcpy(info->stringval_remote, info->stringval, info->stringval_len);
+					info->stringval_remote_len = info->stringval_len;
 				}
 			}
+			item->dirty = 0;
 		}
+		// anything not sent stays dirty for next time
+		n = t->dirty_count - i;
+		memmove(t->dirty, t->dirty + i, n * sizeof(int));
+		t->dirty_count = n;
 		output_flush(t);
 	}
 }
@@ -452,19 +711,90 @@ static void output_packet(teensy_t *t)
 {
 	int len = t->output_packet_len;
 	if (len < 64) memset(t->output_packet + len, 0, 64 - len);
-	TeensyControls_output_store(t, t->output_packet);
+	TeensyControls_output_store(t, t->output_packet, t->output_packet_changed);
 	t->output_packet_len = 0;
+	t->output_packet_changed = 0;
+	t->output_multi = -1;
+	t->output_reports_left--;
+	if (t->output_rate) t->output_tokens -= 1;
 }
 
+// returns 0 if data would need another report than the queue limit allows
 static int output_data(teensy_t *t, const uint8_t *data, int datalen)
 {
 	if (!data || datalen <= 0 || datalen > 64) return 0;
-	if (t->output_packet_len + datalen > 64) output_packet(t);
+	if (t->output_packet_len + datalen > 64) {
+		// the current packet needs one report, the new one another
+		if (t->output_reports_left < 2) return 0;
+		output_packet(t);
+	}
 	memcpy(t->output_packet + t->output_packet_len, data, datalen);
 	t->output_packet_len += datalen;
+	t->output_multi = -1;
 	return 1;
 }
 
+// adds an int or float value for the Teensy. If it accepted multi write,
+// a value of the same type as the 0x08 message at the end of the packet
+// is appended to it as 6 more bytes (id, value) sharing its 4 byte header
+// (len, 8, type, count). Otherwise it is a 10 byte 0x02 write message.
+static int output_value(teensy_t *t, int id, int type, int32_t i32)
+{
+	uint8_t buf[10], *msg;
+	int len;
+
+	if (t->output_multi >= 0 && t->output_packet_len + 6 <= 64) {
+		msg = t->output_packet + t->output_multi;
+		if (msg[2] == type) {
+			len = t->output_packet_len;
+			t->output_packet[len] = id & 255;
+			t->output_packet[len+1] = id >> 8;
+			t->output_packet[len+2] = i32 & 255;
+			t->output_packet[len+3] = (i32 >> 8) & 255;
+			t->output_packet[len+4] = (i32 >> 16) & 255;
+			t->output_packet[len+5] = (i32 >> 24) & 255;
+			t->output_packet_len += 6;
+			msg[0] += 6;	// length
+			msg[3]++;		// count
+			t->output_values++;
+			return 1;
+		}
+	}
+	buf[0] = 10;				// length
+	if (t->output_caps & OUTPUT_CAP_MULTI_WRITE) {
+		buf[1] = 8;				// 8 = multi write
+		buf[2] = type;			// type of every value, 1 = integer, 2 = float
+		buf[3] = 1;				// count
+		buf[4] = id & 255;		// ID
+		buf[5] = id >> 8;		// ID
+	} else {
+		buf[1] = 2;				// 2 = write data
+		buf[2] = id & 255;		// ID
+		buf[3] = id >> 8;		// ID
+		buf[4] = type;			// type, 1 = integer, 2 = float
+		buf[5] = 0;				// reserved
+	}
+	buf[6] = i32 & 255;
+	buf[7] = (i32 >> 8) & 255;
+	buf[8] = (i32 >> 16) & 255;
+	buf[9] = (i32 >> 24) & 255;
+	if (!output_data(t, buf, 10)) return 0;
+	if (buf[1] == 8) t->output_multi = t->output_packet_len - 10;
+	t->output_values++;
+	return 1;
+}
+
+// record that an item's sim change is now in the output packet
+static void output_sent(teensy_t *t, item_info_t *info, uint64_t now)
+{
+	if (info->dirty_time == 0) return;
+	TeensyControls_latency(t, LATENCY_OUTPUT_PACK, info->dirty_time, now);
+	if (t->output_packet_changed == 0 || info->dirty_time < t->output_packet_changed) {
+		t->output_packet_changed = info->dirty_time;
+	}
+	info->dirty_time = 0;
+}
+
 static void output_flush(teensy_t *t)
 {
 	if (t->output_packet_len > 0) output_packet(t);
@@ -0,0 +1,765 @@
+#include "TeensyControls.h"
+#include <ctype.h>
+#include <math.h>
+#include "mapping.h"
+
+#ifdef _WIN32
+#define strcasecmp _stricmp
+#else
+#include <sys/mman.h>
+#endif
+
+// Parsing data_mapping.txt is slow on a Pi SD card with a big file, so
+// the parsed table is saved to <file>.cache as fixed size records with
+// their strings in a pool, followed by the name index. Next time, if the
+// cache was made from the same text, it is mapped in instead and only
+// the string pointers need setting up. Bump MappingCacheVersion whenever
+// the layout changes.
+
+const uint32_t MappingCacheMagic = 0x50414D54;    // "TMAP"
+const uint32_t MappingCacheVersion = 3;
+
+struct MappingCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t recordSize;    // sizeof(MappingRecord)
+    uint32_t slotSize;      // sizeof(NameIndexSlot)
+    uint32_t sourceSize;    // length of the text it was compiled from
+    uint32_t sourceHash;    // FNV-1a of that text
+    uint32_t count;         // records, which follow the header
+    uint32_t indexSize;     // index slots, which follow the records
+    uint32_t indexCount;
+    uint32_t poolSize;      // string pool, which follows the index
+    uint32_t checksum;      // FNV-1a of everything after the header
+    uint32_t reserved[5];
+};
+
+// A mapping with its strings as offsets into the pool
+struct MappingRecord {
+    uint32_t dataRef;
+    uint32_t readVar;
+    uint32_t readVarUnits;
+    uint32_t writeVar;
+    uint32_t writeVarUnits;
+    int32_t precision;
+    double readScale;
+    double writeScale;
+    double testValue;
+    double testAdjust;
+    double deadband;
+    int32_t maxRate;
+    int32_t priority;
+};
+
+// One line of the text as the parser splits it up
+struct MappingLine {
+    char dataRef[256];
+    char readVar[256];
+    char readVarUnits[256];
+    char writeVar[256];
+    char writeVarUnits[256];
+    double readScale;
+    double writeScale;
+    double testValue;
+    double testAdjust;
+    double deadband;
+    int precision;
+    int maxRate;
+    int priority;
+};
+
+// Records, pool and index as they grow while parsing
+struct MappingBuilder {
+    MappingRecord* records;
+    int count;
+    int capacity;
+    char* pool;
+    size_t poolSize;
+    size_t poolCapacity;
+    NameIndex index;
+};
+
+static uint32_t hashBytes(uint32_t hash, const void* data, size_t len)
+{
+    const uint8_t* p = (const uint8_t*)data;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Copy src to dest without leading or trailing spaces and tabs,
+// truncated to fit the 256 char fields of DataMapping
+static void trimCopy(char* dest, const char* src)
+{
+    while (*src == ' ' || *src == '\t') {
+        src++;
+    }
+
+    int len = strlen(src);
+    while (len > 0 && (src[len - 1] == ' ' || src[len - 1] == '\t')) {
+        len--;
+    }
+    if (len > 255) {
+        len = 255;
+    }
+    memcpy(dest, src, len);
+    dest[len] = '\0';
+}
+
+static char* readText(const char* path, size_t* size)
+{
+    FILE* inf = fopen(path, "rb");
+    if (!inf) {
+        return NULL;
+    }
+
+    fseek(inf, 0, SEEK_END);
+    long len = ftell(inf);
+    fseek(inf, 0, SEEK_SET);
+
+    char* text = (char*)malloc(len + 1);
+    if (text && (len < 0 || fread(text, 1, len, inf) != (size_t)len)) {
+        free(text);
+        text = NULL;
+    }
+    fclose(inf);
+
+    if (text) {
+        text[len] = '\0';
+        *size = len;
+    }
+    return text;
+}
+
+// Options after a | limit what is sent to the Teensys and how soon, e.g.
+//   sim/airspeed; AIRSPEED INDICATED, knots | deadband=0.5 precision=1 rate=10
+//   sim/annunciator/master_warning; MASTER WARNING, bool | priority=urgent
+static bool parseOptions(MappingLine* m, char* options, int lineNum)
+{
+    for (char* option = strtok(options, " \t"); option; option = strtok(NULL, " \t")) {
+        char* value = strchr(option, '=');
+        if (value) {
+            *value = '\0';
+            value++;
+        }
+
+        if (!value || *value == '\0') {
+            printf("Error in data mapping file: Line %d option %s has no value\n", lineNum, option);
+            return false;
+        }
+        else if (strcmp(option, "deadband") == 0) {
+            m->deadband = fabs(atof(value));
+        }
+        else if (strcmp(option, "precision") == 0) {
+            m->precision = atoi(value);
+        }
+        else if (strcmp(option, "rate") == 0) {
+            m->maxRate = atoi(value);
+        }
+        else if (strcmp(option, "priority") == 0) {
+            if (strcmp(value, "urgent") == 0) {
+                m->priority = OUTPUT_URGENT;
+            }
+            else if (strcmp(value, "normal") == 0) {
+                m->priority = OUTPUT_NORMAL;
+            }
+            else if (strcmp(value, "low") == 0) {
+                m->priority = OUTPUT_LOW;
+            }
+            else {
+                printf("Error in data mapping file: Line %d priority must be urgent, normal or low\n", lineNum);
+                return false;
+            }
+        }
+        else {
+            printf("Error in data mapping file: Line %d has unknown option %s\n", lineNum, option);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Parse one non-empty line, comment and line ending already removed
+static bool parseLine(MappingLine* m, char* line, int lineNum)
+{
+    m->precision = -1;
+    m->priority = OUTPUT_NORMAL;
+    char* optionPos = strchr(line, '|');
+    if (optionPos) {
+        *optionPos = '\0';
+        if (!parseOptions(m, optionPos + 1, lineNum)) {
+            return false;
+        }
+    }
+
+    char* readVarPos = strchr(line, ';');
+    if (!readVarPos) {
+        printf("Error in data mapping file: Line %d does not contain a semi-colon\n", lineNum);
+        return false;
+    }
+    *readVarPos = '\0';
+    trimCopy(m->dataRef, line);
+    if (*m->dataRef == '\0') {
+        printf("Error in data mapping file: Line %d has a missing Data Ref\n", lineNum);
+        return false;
+    }
+    readVarPos++;
+
+    *m->writeVar = '\0';
+    *m->writeVarUnits = '\0';
+    m->testValue = MAXINT;
+
+    char* writeVarPos = strchr(readVarPos, ';');
+    if (writeVarPos) {
+        *writeVarPos = '\0';
+        trimCopy(m->writeVar, writeVarPos + 1);
+        if (*m->writeVar != '\0') {
+            if (strchr(m->writeVar, ';')) {
+                printf("Error in data mapping file: Line %d contains more than two semi-colons\n", lineNum);
+                return false;
+            }
+
+            char* unitsPos = strchr(m->writeVar, ',');
+            if (!unitsPos) {
+                printf("Error in data mapping file: Line %d Write Var does not contain a comma\n", lineNum);
+                return false;
+            }
+            *unitsPos = '\0';
+            trimCopy(m->writeVarUnits, unitsPos + 1);
+        }
+    }
+
+    trimCopy(m->readVar, readVarPos);
+    if (*m->readVar != '\0') {
+        if (isdigit(*m->readVar)) {
+            char* adjustPos = strchr(m->readVar, '+');
+            if (!adjustPos) {
+                adjustPos = strchr(m->readVar, '-');
+            }
+            if (adjustPos) {
+                sscanf(adjustPos, "%lf", &m->testAdjust);
+                *adjustPos = '\0';
+            }
+            else {
+                m->testAdjust = 0;
+            }
+
+            sscanf(m->readVar, "%lf", &m->testValue);
+            *m->readVar = '\0';
+
+#ifdef MORE_DEBUG
+            printf("Data Ref Test = %s  Value: %.3f  Adjust: %.3f\n", m->dataRef, m->testValue, m->testAdjust);
+#endif
+        }
+        else {
+            char* unitsPos = strchr(m->readVar, ',');
+            if (!unitsPos) {
+                printf("Error in data mapping file: Line %d Read Var does not contain a comma\n", lineNum);
+                return false;
+            }
+            *unitsPos = '\0';
+            trimCopy(m->readVarUnits, unitsPos + 1);
+            if (*m->readVarUnits == '\0') {
+                printf("Error in data mapping file: Line %d Read Var has missing Units\n", lineNum);
+                return false;
+            }
+        }
+    }
+
+    if (*m->writeVar == '\0') {
+        strcpy(m->writeVar, m->readVar);
+    }
+
+    if (*m->writeVarUnits == '\0') {
+        strcpy(m->writeVarUnits, m->readVarUnits);
+    }
+
+    // Resolve unit conversions now rather than on every read and write.
+    // The sim has no 10khz units so use khz and scale.
+    m->readScale = 1;
+    m->writeScale = 1;
+    if (strcasecmp(m->readVarUnits, "10khz") == 0) {
+        m->readScale = 0.1;
+    }
+    if (strcasecmp(m->writeVarUnits, "10khz") == 0) {
+        m->writeScale = 10;
+        strcpy(m->writeVarUnits, "khz");
+    }
+
+#ifdef MORE_DEBUG
+    printf("Data Mapping = %s, %s (%s), %s (%s)\n", m->dataRef, m->readVar,
+        m->readVarUnits, m->writeVar, m->writeVarUnits);
+#endif
+
+    return true;
+}
+
+// Add a string to the pool, returning its offset or -1 if out of memory
+static int addString(MappingBuilder* b, const char* str)
+{
+    if (*str == '\0') {
+        return 0;
+    }
+
+    size_t len = strlen(str) + 1;
+    if (b->poolSize + len > b->poolCapacity) {
+        size_t capacity = b->poolCapacity * 2;
+        while (capacity < b->poolSize + len) {
+            capacity *= 2;
+        }
+        char* pool = (char*)realloc(b->pool, capacity);
+        if (!pool) {
+            return -1;
+        }
+        b->pool = pool;
+        b->poolCapacity = capacity;
+        b->index.pool = pool;
+    }
+
+    memcpy(b->pool + b->poolSize, str, len);
+    b->poolSize += len;
+    return b->poolSize - len;
+}
+
+// Make room for another record, growing the index to match
+static bool addRecord(MappingBuilder* b)
+{
+    if (b->count < b->capacity) {
+        return true;
+    }
+
+    int capacity = b->capacity ? b->capacity * 2 : 64;
+    MappingRecord* records = (MappingRecord*)realloc(b->records, capacity * sizeof(MappingRecord));
+    if (!records) {
+        return false;
+    }
+    b->records = records;
+    b->capacity = capacity;
+
+    nameIndexFree(&b->index);
+    if (!nameIndexInit(&b->index, capacity, b->pool)) {
+        return false;
+    }
+    for (int i = 0; i < b->count; i++) {
+        nameIndexAdd(&b->index, b->records[i].dataRef, i);
+    }
+    return true;
+}
+
+static void freeBuilder(MappingBuilder* b)
+{
+    free(b->records);
+    free(b->pool);
+    nameIndexFree(&b->index);
+}
+
+// Returns false after printing the first error in the text
+static bool parseMappings(MappingBuilder* b, const char* text)
+{
+    MappingLine m;
+    char line[1024];
+    int lineNum = 0;
+
+    // Offset 0 is the empty string
+    b->poolCapacity = 4096;
+    b->pool = (char*)malloc(b->poolCapacity);
+    if (!b->pool) {
+        printf("Out of memory for data mappings\n");
+        return false;
+    }
+    b->pool[0] = '\0';
+    b->poolSize = 1;
+
+    const char* next = text;
+    while (*next) {
+        lineNum++;
+
+        // Same as fgets into line, a long line is split
+        int len = 0;
+        while (next[len] && next[len] != '\n' && len < 1022) {
+            len++;
+        }
+        if (next[len] == '\n') {
+            len++;
+        }
+        memcpy(line, next, len);
+        line[len] = '\0';
+        next += len;
+
+        char* pos = strchr(line, '#');
+        if (pos) {
+            *pos = '\0';
+        }
+
+        len = strlen(line);
+        while (len > 0 && (line[len - 1] == '\r' || line[len - 1] == '\n' || line[len - 1] == ' ' || line[len - 1] == '\t')) {
+            len--;
+        }
+        line[len] = '\0';
+
+        if (len == 0) {
+            continue;
+        }
+
+        memset(&m, 0, sizeof(m));
+        if (!parseLine(&m, line, lineNum)) {
+            return false;
+        }
+
+        if (!addRecord(b)) {
+            printf("Out of memory for data mappings\n");
+            return false;
+        }
+
+        MappingRecord* r = &b->records[b->count];
+        memset(r, 0, sizeof(MappingRecord));
+        int dataRef = addString(b, m.dataRef);
+        int readVar = addString(b, m.readVar);
+        int readVarUnits = addString(b, m.readVarUnits);
+        int writeVar = strcmp(m.writeVar, m.readVar) == 0 ? readVar : addString(b, m.writeVar);
+        int writeVarUnits = strcmp(m.writeVarUnits, m.readVarUnits) == 0 ? readVarUnits : addString(b, m.writeVarUnits);
+        if (dataRef < 0 || readVar < 0 || readVarUnits < 0 || writeVar < 0 || writeVarUnits < 0) {
+            printf("Out of memory for data mappings\n");
+            return false;
+        }
+        r->dataRef = dataRef;
+        r->readVar = readVar;
+        r->readVarUnits = readVarUnits;
+        r->writeVar = writeVar;
+        r->writeVarUnits = writeVarUnits;
+        r->readScale = m.readScale;
+        r->writeScale = m.writeScale;
+        r->testValue = m.testValue;
+        r->testAdjust = m.testAdjust;
+        r->deadband = m.deadband;
+        r->precision = m.precision;
+        r->maxRate = m.maxRate;
+        r->priority = m.priority;
+
+        if (!nameIndexAdd(&b->index, r->dataRef, b->count)) {
+            printf("Error in data mapping file: Line %d has duplicate Data Ref\n", lineNum);
+            return false;
+        }
+
+        b->count++;
+    }
+
+    return true;
+}
+
+// Set up the mappings from their records, once the pool won't move
+static bool bindMappings(MappingTable* table, const MappingRecord* records, int count)
+{
+    table->mapping = (DataMapping*)calloc(count ? count : 1, sizeof(DataMapping));
+    if (!table->mapping) {
+        return false;
+    }
+
+    for (int i = 0; i < count; i++) {
+        const MappingRecord* r = &records[i];
+        DataMapping* m = &table->mapping[i];
+        if (r->dataRef >= table->poolSize || r->readVar >= table->poolSize || r->readVarUnits >= table->poolSize ||
+            r->writeVar >= table->poolSize || r->writeVarUnits >= table->poolSize) {
+            return false;
+        }
+        m->dataRef = table->pool + r->dataRef;
+        m->readVar = table->pool + r->readVar;
+        m->readVarUnits = table->pool + r->readVarUnits;
+        m->writeVar = table->pool + r->writeVar;
+        m->writeVarUnits = table->pool + r->writeVarUnits;
+        m->readScale = r->readScale;
+        m->writeScale = r->writeScale;
+        m->testValue = r->testValue;
+        m->testInit = r->testValue;
+        m->testAdjust = r->testAdjust;
+        m->deadband = r->deadband;
+        m->precision = r->precision;
+        m->maxRate = r->maxRate;
+        m->priority = r->priority;
+    }
+    table->count = count;
+    return true;
+}
+
+static void* mapFile(const char* path, size_t* size)
+{
+#ifdef _WIN32
+    return readText(path, size);
+#else
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    void* data = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            data = NULL;
+        }
+        *size = st.st_size;
+    }
+    close(fd);
+    return data;
+#endif
+}
+
+static void unmapFile(void* data, size_t size)
+{
+#ifdef _WIN32
+    free(data);
+#else
+    munmap(data, size);
+#endif
+}
+
+// The checksum only catches accidental damage. Every used slot must also
+// name a mapping that exists and a string inside the pool, and one slot
+// must be free so a lookup that misses stops, or nameIndexFind could read
+// outside the mapped file.
+static bool validSlots(const NameIndexSlot* slots, const MappingCacheHeader* header)
+{
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < header->indexSize; i++) {
+        const NameIndexSlot* slot = &slots[i];
+        if (slot->value == -1) {
+            continue;
+        }
+        if (slot->value < 0 || (uint32_t)slot->value >= header->count || slot->name < 0 || slot->len < 0 ||
+            (uint64_t)slot->name + slot->len > header->poolSize) {
+            return false;
+        }
+        used++;
+    }
+    return used == header->indexCount && used < header->indexSize;
+}
+
+static MappingTable* loadCache(const char* cachePath, size_t sourceSize, uint32_t sourceHash)
+{
+    size_t size;
+    uint8_t* data = (uint8_t*)mapFile(cachePath, &size);
+    if (!data) {
+        return NULL;
+    }
+
+    MappingCacheHeader* header = (MappingCacheHeader*)data;
+    size_t recordBytes = 0;
+    size_t indexBytes = 0;
+    bool valid = size >= sizeof(MappingCacheHeader) &&
+        header->magic == MappingCacheMagic &&
+        header->version == MappingCacheVersion &&
+        header->recordSize == sizeof(MappingRecord) &&
+        header->slotSize == sizeof(NameIndexSlot) &&
+        header->sourceSize == sourceSize &&
+        header->sourceHash == sourceHash &&
+        header->indexSize > 0 && (header->indexSize & (header->indexSize - 1)) == 0 &&
+        header->poolSize > 0;
+
+    if (valid) {
+        recordBytes = (size_t)header->count * sizeof(MappingRecord);
+        indexBytes = (size_t)header->indexSize * sizeof(NameIndexSlot);
+        valid = size == sizeof(MappingCacheHeader) + recordBytes + indexBytes + header->poolSize &&
+            header->checksum == hashBytes(2166136261u, data + sizeof(MappingCacheHeader), size - sizeof(MappingCacheHeader)) &&
+            data[size - 1] == '\0';
+    }
+
+    if (valid) {
+        valid = validSlots((const NameIndexSlot*)(data + sizeof(MappingCacheHeader) + recordBytes), header);
+    }
+
+    MappingTable* table = valid ? (MappingTable*)calloc(1, sizeof(MappingTable)) : NULL;
+    if (!table) {
+        unmapFile(data, size);
+        return NULL;
+    }
+
+    const MappingRecord* records = (const MappingRecord*)(data + sizeof(MappingCacheHeader));
+    NameIndexSlot* slots = (NameIndexSlot*)(data + sizeof(MappingCacheHeader) + recordBytes);
+    table->pool = (char*)slots + indexBytes;
+    table->poolSize = header->poolSize;
+    table->cache = data;
+    table->cacheSize = size;
+    nameIndexAttach(&table->index, slots, header->indexSize, header->indexCount, table->pool);
+    if (!bindMappings(table, records, header->count)) {
+        mappingFree(table);
+        return NULL;
+    }
+    return table;
+}
+
+// Written to a temporary file then renamed, so a cache is never seen
+// half written. Failing to save is not an error, it just means parsing
+// the text again next time.
+static void saveCache(const char* cachePath, const MappingBuilder* b, size_t sourceSize, uint32_t sourceHash)
+{
+    MappingCacheHeader header;
+    size_t recordBytes = (size_t)b->count * sizeof(MappingRecord);
+    size_t indexBytes = (size_t)(b->index.mask + 1) * sizeof(NameIndexSlot);
+
+    if (b->count == 0) {
+        return;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = MappingCacheMagic;
+    header.version = MappingCacheVersion;
+    header.recordSize = sizeof(MappingRecord);
+    header.slotSize = sizeof(NameIndexSlot);
+    header.sourceSize = sourceSize;
+    header.sourceHash = sourceHash;
+    header.count = b->count;
+    header.indexSize = b->index.mask + 1;
+    header.indexCount = b->index.count;
+    header.poolSize = b->poolSize;
+    header.checksum = hashBytes(2166136261u, b->records, recordBytes);
+    header.checksum = hashBytes(header.checksum, b->index.slots, indexBytes);
+    header.checksum = hashBytes(header.checksum, b->pool, b->poolSize);
+
+    char tempPath[520];
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", cachePath);
+    FILE* outf = fopen(tempPath, "wb");
+    if (!outf) {
+        return;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, outf) == 1 &&
+        fwrite(b->records, recordBytes, 1, outf) == 1 &&
+        fwrite(b->index.slots, indexBytes, 1, outf) == 1 &&
+        fwrite(b->pool, b->poolSize, 1, outf) == 1;
+    if (fclose(outf) != 0) {
+        ok = false;
+    }
+
+#ifdef _WIN32
+    if (ok) {
+        remove(cachePath);
+    }
+#endif
+    if (!ok || rename(tempPath, cachePath) != 0) {
+        remove(tempPath);
+    }
+}
+
+// Parse the text into a new table and save it as the cache
+static MappingTable* compileMappings(const char* text, const char* cachePath, size_t sourceSize, uint32_t sourceHash)
+{
+    MappingBuilder b;
+    memset(&b, 0, sizeof(b));
+
+    MappingTable* table = NULL;
+    if (parseMappings(&b, text)) {
+        table = (MappingTable*)calloc(1, sizeof(MappingTable));
+    }
+    if (table) {
+        saveCache(cachePath, &b, sourceSize, sourceHash);
+        table->pool = b.pool;
+        table->poolSize = b.poolSize;
+        table->index = b.index;
+        b.pool = NULL;
+        b.index.slots = NULL;
+        if (!bindMappings(table, b.records, b.count)) {
+            printf("Out of memory for data mappings\n");
+            mappingFree(table);
+            table = NULL;
+        }
+    }
+    freeBuilder(&b);
+    return table;
+}
+
+// Load the data mappings from path, using the compiled cache if it was
+// made from the same text. Returns NULL after printing what was wrong.
+MappingTable* mappingLoad(const char* path)
+{
+    size_t size;
+    char* text = readText(path, &size);
+    if (!text) {
+        printf("File not found: %s\n", path);
+        return NULL;
+    }
+
+    printf("Loading data mappings from %s\n", path);
+
+    char cachePath[512];
+    snprintf(cachePath, sizeof(cachePath), "%s.cache", path);
+    uint32_t hash = hashBytes(2166136261u, text, size);
+
+    MappingTable* table = loadCache(cachePath, size, hash);
+    if (!table) {
+        table = compileMappings(text, cachePath, size, hash);
+    }
+    free(text);
+
+    if (table) {
+        printf("Loaded %d data mappings%s\n", table->count, table->cache ? " from cache" : "");
+    }
+    return table;
+}
+
+void mappingFree(MappingTable* table)
+{
+    if (!table) {
+        return;
+    }
+
+    free(table->mapping);
+    if (table->cache) {
+        unmapFile(table->cache, table->cacheSize);
+    }
+    else {
+        free(table->pool);
+        nameIndexFree(&table->index);
+    }
+    free(table);
+}
+
+static bool sameMapping(const DataMapping* a, const DataMapping* b)
+{
+    return strcmp(a->readVar, b->readVar) == 0 && strcmp(a->readVarUnits, b->readVarUnits) == 0 &&
+        strcmp(a->writeVar, b->writeVar) == 0 && strcmp(a->writeVarUnits, b->writeVarUnits) == 0 &&
+        a->readScale == b->readScale && a->writeScale == b->writeScale &&
+        a->testInit == b->testInit && a->testAdjust == b->testAdjust &&
+        a->deadband == b->deadband && a->precision == b->precision && a->maxRate == b->maxRate &&
+        a->priority == b->priority;
+}
+
+// When a reloaded table replaces the old one, mappings that are the same
+// in both keep their run time state, so a test value that a Teensy has
+// changed isn't put back. Returns the number of new or changed mappings.
+int mappingCarryOver(MappingTable* table, const MappingTable* old)
+{
+    int changed = 0;
+
+    for (int i = 0; i < table->count; i++) {
+        DataMapping* m = &table->mapping[i];
+        int j = nameIndexFind(&old->index, m->dataRef, strlen(m->dataRef));
+        if (j == -1 || !sameMapping(m, &old->mapping[j])) {
+            changed++;
+            continue;
+        }
+
+        const DataMapping* o = &old->mapping[j];
+        m->readOffset = o->readOffset;
+        m->testValue = o->testValue;
+        m->setValue = o->setValue;
+        m->setDelay = o->setDelay;
+    }
+
+    return changed;
+}
+
+// Rounds a value to the mapping's precision, if it has one
+double mappingRound(const DataMapping* m, double value)
+{
+    if (m->precision < 0 || value == MAXINT) {
+        return value;
+    }
+
+    double scale = pow(10, m->precision);
+    return round(value * scale) / scale;
+}
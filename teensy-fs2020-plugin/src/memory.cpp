@@ -11,32 +11,71 @@ teensy_t * TeensyControls_first_teensy = NULL;
 // called from any thread
 teensy_t * TeensyControls_new_teensy(void)
 {
-	teensy_t *n, *p;
+	teensy_t *n;
+
+	n = TeensyControls_alloc_teensy();
+	if (n) TeensyControls_add_teensy(n);
+	return n;
+}
+
+// TEENSY_OUTPUT_RATE sets the reports a second for every Teensy
+static uint32_t default_output_rate(void)
+{
+	const char *rate = getenv("TEENSY_OUTPUT_RATE");
+	return rate ? (uint32_t)atoi(rate) : 0;
+}
+
+// allocate a Teensy without adding it to the list, so another
+// thread can set it up before handing it to the main thread
+teensy_t * TeensyControls_alloc_teensy(void)
+{
+	static int next_index = 0;
+	teensy_t *n;
 
 	n = (teensy_t *)malloc(sizeof(teensy_t));
 	if (!n) return NULL;
-	memset(n, 0, sizeof(teensy_t));
+	memset((void *)n, 0, sizeof(teensy_t));
 	//printf("Teensy Detected\n");
 	n->online = 1;
+	n->index = next_index++;
 	n->unknown_id_heard = 1;
+	n->output_multi = -1;
+	n->output_wake_fd = -1;
 	n->next = NULL;
-	pthread_mutex_init(&n->input_mutex, NULL);
 	pthread_mutex_init(&n->output_mutex, NULL);
 	pthread_cond_init(&n->output_event, NULL);
+	TeensyControls_output_rate(n, default_output_rate());
+	return n;
+}
+
+// reports a second a Teensy may be sent, as a token bucket that holds
+// up to OUTPUT_QUEUE_LIMIT reports. 0 means only the queue limits it.
+void TeensyControls_output_rate(teensy_t *t, uint32_t rate)
+{
+	t->output_rate = rate;
+	t->output_tokens = OUTPUT_QUEUE_LIMIT;
+	t->output_token_time = TeensyControls_usec();
+}
+
+// always called from main thread
+void TeensyControls_add_teensy(teensy_t *n)
+{
+	teensy_t *p;
+
+	n->next = NULL;
 	if (TeensyControls_first_teensy == NULL) {
 		TeensyControls_first_teensy = n;
 	} else {
 		for (p = TeensyControls_first_teensy; p->next; p = p->next) ;
 		p->next = n;
 	}
-	return n;
 }
 
 // always called from main thread
 static void delete_teensy(teensy_t *t)
 {
 	teensy_t *p, *q=NULL;
-	item_t *item, *nitem;
+	int i;
 
 	printf("Teensy Removed\n");
 	for (p = TeensyControls_first_teensy; p; p = p->next) {
@@ -46,16 +85,17 @@ static void delete_teensy(teensy_t *t)
 			} else {
 				TeensyControls_first_teensy = p->next;
 			}
-			for (item = p->items; item; item = nitem) {
-				if (item->type == 0 && item->command_began) {
-					//XPLMCommandEnd(item->cmdref);
+			for (i = 0; i < p->item_count; i++) {
+				if (p->items[i].type == 0 && p->item_info[i].command_began) {
+					//XPLMCommandEnd(p->item_info[i].cmdref);
 					printf("Command end\n");
-					item->command_began = 0;
+					p->item_info[i].command_began = 0;
 				}
-				nitem = item->next;
-				free(item);
 			}
-			pthread_mutex_destroy(&p->input_mutex);
+			free(p->items);
+			free(p->item_info);
+			free(p->itemlist);
+			free(p->dirty);
 			pthread_mutex_destroy(&p->output_mutex);
 			pthread_cond_destroy(&p->output_event);
 			free(p);
@@ -84,67 +124,150 @@ void TeensyControls_delete_offline_teensy(void)
 	} while (anydeleted);
 }
 
-void TeensyControls_input_store(teensy_t *t, const uint8_t *packet)
+// called from input thread only, returns 0 if the buffer is full
+int  TeensyControls_input_store(teensy_t *t, const uint8_t *packet)
+{
+	return TeensyControls_input_store_batch(t, packet, 1, TeensyControls_usec());
+}
+
+// called from input thread only. Stores as many of the packets as fit
+// and makes them all visible to the main thread at once.
+// usec is when the packets were read.
+int  TeensyControls_input_store_batch(teensy_t *t, const uint8_t *packets, int count, uint64_t usec)
 {
-	int head;
-	pthread_mutex_lock(&t->input_mutex);
-	head = t->input_head;
-	if (++head >= INPUT_BUFSIZE) head = 0;
-	if (head != t->input_tail) {
-		memcpy(t->input_buffer + head * 64, packet, 64);
-		t->input_head = head;
+	int head, next, tail, stored = 0;
+	head = t->input_head.load(std::memory_order_relaxed);
+	tail = t->input_tail.load(std::memory_order_acquire);
+	while (stored < count) {
+		next = head + 1;
+		if (next >= INPUT_BUFSIZE) next = 0;
+		if (next == tail) break;
+		memcpy(t->input_buffer + next * 64, packets + stored * 64, 64);
+		t->input_time[next] = usec;
+		head = next;
+		stored++;
 	}
-	pthread_mutex_unlock(&t->input_mutex);
+	if (stored > 0) {
+		t->input_head.store(head, std::memory_order_release);
+	}
+	return stored;
 }
 
+// called from main thread only
 int  TeensyControls_input_fetch(teensy_t *t, uint8_t *packet)
 {
 	int tail;
-	pthread_mutex_lock(&t->input_mutex);
-	tail = t->input_tail;
-	if (tail == t->input_head) {
-		pthread_mutex_unlock(&t->input_mutex);
-		return 0;
-	}
+	tail = t->input_tail.load(std::memory_order_relaxed);
+	if (tail == t->input_head.load(std::memory_order_acquire)) return 0;
 	if (++tail >= INPUT_BUFSIZE) tail = 0;
 	memcpy(packet, t->input_buffer + tail * 64, 64);
-	t->input_tail = tail;
-	pthread_mutex_unlock(&t->input_mutex);
+	t->input_fetch_time = t->input_time[tail];
+	t->input_tail.store(tail, std::memory_order_release);
 	return 1;
 }
 
-void TeensyControls_output_store(teensy_t *t, const uint8_t *packet)
+// called from main thread only. Returns the oldest input report in place
+// in the ring, or NULL if there is none. The input thread never writes to
+// this slot until TeensyControls_input_release hands it back.
+const uint8_t * TeensyControls_input_peek(teensy_t *t)
 {
-	int head;
-	pthread_mutex_lock(&t->output_mutex);
-	head = t->output_head;
+	int tail;
+	tail = t->input_tail.load(std::memory_order_relaxed);
+	if (tail == t->input_head.load(std::memory_order_acquire)) return NULL;
+	if (++tail >= INPUT_BUFSIZE) tail = 0;
+	t->input_fetch_time = t->input_time[tail];
+	return t->input_buffer + tail * 64;
+}
+
+// called from main thread only, after the report from input_peek is used
+void TeensyControls_input_release(teensy_t *t)
+{
+	int tail;
+	tail = t->input_tail.load(std::memory_order_relaxed);
+	if (++tail >= INPUT_BUFSIZE) tail = 0;
+	t->input_tail.store(tail, std::memory_order_release);
+}
+
+// called from main thread only, returns 0 if the buffer is full.
+// changed is when the oldest sim value in the packet changed, or 0.
+int  TeensyControls_output_store(teensy_t *t, const uint8_t *packet, uint64_t changed)
+{
+	int head, stored = 0;
+	head = t->output_head.load(std::memory_order_relaxed);
 	if (++head >= OUTPUT_BUFSIZE) head = 0;
-	if (head != t->output_tail) {
+	if (head != t->output_tail.load(std::memory_order_acquire)) {
 		memcpy(t->output_buffer + head * 64, packet, 64);
-		t->output_head = head;
+		t->output_changed[head] = changed;
+		t->output_queued[head] = changed ? TeensyControls_usec() : 0;
+		// seq_cst store pairs with output_thread_waiting, see output_wait
+		t->output_head.store(head);
+		stored = 1;
+	}
+#ifndef _WIN32
+	// a Teensy on the USB reactor is woken through its eventfd
+	if (t->output_thread_waiting.load() && t->output_wake_fd >= 0) {
+		uint64_t one = 1;
+		write(t->output_wake_fd, &one, sizeof(one));
+		return stored;
 	}
-	if (t->output_thread_waiting) {
+#endif
+	if (t->output_thread_waiting.load()) {
+		pthread_mutex_lock(&t->output_mutex);
 		pthread_cond_signal(&t->output_event);
+		pthread_mutex_unlock(&t->output_mutex);
 	}
-	pthread_mutex_unlock(&t->output_mutex);
+	return stored;
 }
 
+// called from output thread only
 int  TeensyControls_output_fetch(teensy_t *t, uint8_t *packet)
 {
 	int tail;
-	pthread_mutex_lock(&t->output_mutex);
-	tail = t->output_tail;
-	if (tail == t->output_head) {
-		pthread_mutex_unlock(&t->output_mutex);
-		return 0;
-	}
+	tail = t->output_tail.load(std::memory_order_relaxed);
+	if (tail == t->output_head.load(std::memory_order_acquire)) return 0;
 	if (++tail >= OUTPUT_BUFSIZE) tail = 0;
 	memcpy(packet, t->output_buffer + tail * 64, 64);
-	t->output_tail = tail;
-	pthread_mutex_unlock(&t->output_mutex);
+	t->output_fetch_changed = t->output_changed[tail];
+	t->output_fetch_queued = t->output_queued[tail];
+	t->output_tail.store(tail, std::memory_order_release);
 	return 1;
 }
 
+// number of reports waiting for the output thread
+int  TeensyControls_output_pending(teensy_t *t)
+{
+	int n;
+	n = t->output_head.load(std::memory_order_acquire) - t->output_tail.load(std::memory_order_acquire);
+	if (n < 0) n += OUTPUT_BUFSIZE;
+	return n;
+}
+
+// called from output thread when the output buffer is empty. The waiting
+// flag is set before head is checked again, and output_store sets head
+// before it checks the flag, so one of them always sees the other.
+void TeensyControls_output_wait(teensy_t *t, int msec)
+{
+	pthread_mutex_lock(&t->output_mutex);
+	t->output_thread_waiting.store(1);
+	if (t->output_head.load() == t->output_tail.load(std::memory_order_relaxed) && t->online) {
+#ifdef _WIN32
+		pthread_cond_wait_timeout(&t->output_event, &t->output_mutex, msec);
+#else
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += msec / 1000;
+		ts.tv_nsec += (msec % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&t->output_event, &t->output_mutex, &ts);
+#endif
+	}
+	t->output_thread_waiting.store(0);
+	pthread_mutex_unlock(&t->output_mutex);
+}
+
 // finds any "[##]" suffix on the string, returns the index, and removes it
 // from the string.  If none is found, -1 is returns and the string unchanged.
 //
@@ -168,14 +291,56 @@ static int parse_array_indexNOTUSED(char *str)
 	return index;
 }
 
+// store item index in the ID lookup table, growing the table as needed.
+// Teensy IDs are 16 bit, so the table never exceeds 65536 slots.
+static int add_itemlist(teensy_t *t, int id, int index)
+{
+	int *list;
+	int i, size;
+
+	if (id < 0 || id > 65535) return 0;
+	if (id >= t->itemlist_size) {
+		size = t->itemlist_size ? t->itemlist_size : 64;
+		while (size <= id) size *= 2;
+		list = (int *)realloc(t->itemlist, size * sizeof(int));
+		if (!list) return 0;
+		for (i = t->itemlist_size; i < size; i++) list[i] = -1;
+		t->itemlist = list;
+		t->itemlist_size = size;
+	}
+	t->itemlist[id] = index;
+	return 1;
+}
+
+// make room for one more item in both item arrays
+static int grow_items(teensy_t *t)
+{
+	item_t *items;
+	item_info_t *info;
+	int size;
+
+	if (t->item_count < t->item_size) return 1;
+	size = t->item_size ? t->item_size * 2 : 64;
+	items = (item_t *)realloc(t->items, size * sizeof(item_t));
+	if (!items) return 0;
+	t->items = items;
+	info = (item_info_t *)realloc(t->item_info, size * sizeof(item_info_t));
+	if (!info) return 0;
+	t->item_info = info;
+	t->item_size = size;
+	return 1;
+}
+
 void TeensyControls_new_item(teensy_t *t, int id, int type, const char *name, int namelen)
 {
 	item_t *item;
+	item_info_t *info;
 	char str[1024];
 	int cmdref = 0;	// XPLMCommandRef
 	int dataref = 0;	// XPLMDataRef 
 	int datatype = 0;	// XPLMDataTypeID
 	int index, datawritable = 0;
+	int min_interval = 0;
 
 	if (!t || !name || namelen >= 1024) return;
 	t->frames_without_id=0;
@@ -190,11 +355,9 @@ void TeensyControls_new_item(teensy_t *t, int id, int type, const char *name, in
 			return;
 		}
 	} else {
-		dataref = dataRefNum(str, id);
-		if (dataref == -1) {
-			//printf("Teensy request data %s does not exist\n", str);
-			return;
-		}
+		// an unmapped item is still added, unbound, so that reloading
+		// the data mappings can bind it later
+		dataref = dataRefNum(str, namelen, id);
 		datatype = 0; // XPLMGetDataRefTypes(dataref);
 		datawritable = 0;  // XPLMCanWriteDataRef(dataref);
 	}
@@ -202,9 +365,12 @@ void TeensyControls_new_item(teensy_t *t, int id, int type, const char *name, in
 	if (item) {
 		// TODO: item exists - check if our data is correct
 	} else {
-		item = (item_t *)malloc(sizeof(item_t));
-		if (!item) return;
-		if (type == 1) {
+		if (!grow_items(t)) return;
+		if (!add_itemlist(t, id, t->item_count)) return;
+		if (dataref == -1) {
+			// dataRefNum has already said so
+		}
+		else if (type == 1) {
 			printf("Data Ref %-65s (int)   -> %s\n", str, dataRefName(dataref));
 		}
 		else if (type == 2) {
@@ -213,32 +379,99 @@ void TeensyControls_new_item(teensy_t *t, int id, int type, const char *name, in
 		else {
 			printf("Data Ref %-65s (unknown type) -> %s\n", str, dataRefName(dataref));
 		}
+		item = &t->items[t->item_count];
+		info = &t->item_info[t->item_count];
+		t->item_count++;
 		memset(item, 0, sizeof(item_t));
+		memset(info, 0, sizeof(item_info_t));
 		item->id = id;
 		item->type = type;
-		item->index = index;
-		item->cmdref = cmdref;
 		item->dataref = dataref;
-		item->datatype = datatype;
-		item->datawritable = datawritable;
-		strcpy(item->name, str);
-		item->next = t->items;
-		t->items = item;
+		info->index = index;
+		info->cmdref = cmdref;
+		info->datatype = datatype;
+		info->datawritable = datawritable;
+		if (namelen >= (int)sizeof(info->name)) namelen = sizeof(info->name) - 1;
+		memcpy(info->name, str, namelen);
+		info->name[namelen] = 0;
 		//printf("New item %d = %s\n", id, name);
 		item->intval = MAXINT;
 		item->intval_remote = MAXINT;
 		item->floatval = MAXINT;
 		item->floatval_remote = MAXINT;
+		item->priority = OUTPUT_NORMAL;
+		if (dataref != -1) {
+			dataRefLimits(dataref, &item->deadband, &min_interval, &item->priority);
+			item->min_interval = min_interval;
+		}
 	}
 }
 
+// Called between frames after the data mappings have been replaced.
+// Every data item is looked up again by name but only those whose
+// binding changed are touched. Anything the Teensy wrote under the old
+// binding is dropped and, if the item is now bound, the value it has is
+// forgotten so that the new one is sent. Returns the items rebound.
+int TeensyControls_rebind_items(int (*find)(const char *name))
+{
+	teensy_t *t;
+	item_t *item;
+	int n, dataref, min_interval, count = 0;
+
+	for (t = TeensyControls_first_teensy; t; t = t->next) {
+		for (n = 0; n < t->item_count; n++) {
+			item = &t->items[n];
+			if (item->type == 0) continue;
+			dataref = find(t->item_info[n].name);
+			if (dataref != -1) {
+				// limits can change without the binding changing
+				dataRefLimits(dataref, &item->deadband, &min_interval, &item->priority);
+				item->min_interval = min_interval;
+			}
+			if (dataref == item->dataref) continue;
+			item->dataref = dataref;
+			item->changed_by_teensy = 0;
+			t->item_info[n].unmapped_logged = 0;
+			if (dataref == -1) {
+				item->intval_remote = item->intval;
+				item->floatval_remote = item->floatval;
+			} else {
+				item->intval_remote = MAXINT;
+				item->floatval_remote = MAXINT;
+			}
+			count++;
+		}
+	}
+	return count;
+}
+
+// pointers into the item arrays are only valid until the next new item
 item_t * TeensyControls_find_item(teensy_t *t, int id)
 {
-	item_t *p;
+	if (!t || id < 0 || id >= t->itemlist_size) return NULL;
+	if (t->itemlist[id] < 0) return NULL;
+	return &t->items[t->itemlist[id]];
+}
+
+item_info_t * TeensyControls_item_info(teensy_t *t, item_t *item)
+{
+	return &t->item_info[item - t->items];
+}
+
+// add item to the list of items that need sending to the Teensy
+void TeensyControls_dirty_item(teensy_t *t, item_t *item)
+{
+	int *list;
+	int size;
 
-	if (!t) return NULL;
-	for (p = t->items; p; p = p->next) {
-		if (p->id == id) return p;
+	if (item->dirty) return;
+	if (t->dirty_count >= t->dirty_size) {
+		size = t->dirty_size ? t->dirty_size * 2 : 64;
+		list = (int *)realloc(t->dirty, size * sizeof(int));
+		if (!list) return;
+		t->dirty = list;
+		t->dirty_size = size;
 	}
-	return NULL;
+	t->dirty[t->dirty_count++] = (int)(item - t->items);
+	item->dirty = 1;
 }
@@ -0,0 +1,105 @@
+#include <stdlib.h>
+#include <string.h>
+#include "nameindex.h"
+
+// FNV-1a
+static uint32_t nameHash(const char* name, int len)
+{
+    uint32_t hash = 2166136261u;
+
+    for (int i = 0; i < len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Table is at least twice capacity so probe runs stay short
+bool nameIndexInit(NameIndex* index, int capacity, const char* pool)
+{
+    int size = 16;
+    while (size < capacity * 2) {
+        size *= 2;
+    }
+
+    index->pool = pool;
+    index->count = 0;
+    index->slots = (NameIndexSlot*)malloc(size * sizeof(NameIndexSlot));
+    if (!index->slots) {
+        index->mask = 0;
+        return false;
+    }
+
+    for (int i = 0; i < size; i++) {
+        index->slots[i].value = -1;
+    }
+    index->mask = size - 1;
+    return true;
+}
+
+// Use slots built earlier, e.g. loaded from a file. Size must be a
+// power of two. The slots are not freed by nameIndexFree.
+void nameIndexAttach(NameIndex* index, NameIndexSlot* slots, int size, int count, const char* pool)
+{
+    index->slots = slots;
+    index->mask = size - 1;
+    index->count = count;
+    index->pool = pool;
+}
+
+void nameIndexFree(NameIndex* index)
+{
+    free(index->slots);
+    index->slots = NULL;
+    index->mask = 0;
+    index->count = 0;
+}
+
+// Name is the offset of a null terminated name in the pool. Returns
+// false if the name is already in the index or the index is full.
+bool nameIndexAdd(NameIndex* index, int name, int value)
+{
+    if (!index->slots || index->count * 2 >= index->mask + 1) {
+        return false;
+    }
+
+    const char* str = index->pool + name;
+    int len = strlen(str);
+    uint32_t hash = nameHash(str, len);
+    int i = hash & index->mask;
+
+    while (index->slots[i].value != -1) {
+        NameIndexSlot* slot = &index->slots[i];
+        if (slot->hash == hash && slot->len == len && memcmp(index->pool + slot->name, str, len) == 0) {
+            return false;
+        }
+        i = (i + 1) & index->mask;
+    }
+
+    index->slots[i].hash = hash;
+    index->slots[i].len = len;
+    index->slots[i].name = name;
+    index->slots[i].value = value;
+    index->count++;
+    return true;
+}
+
+// Name need not be null terminated. Returns -1 if not found.
+int nameIndexFind(const NameIndex* index, const char* name, int len)
+{
+    if (!index->slots) {
+        return -1;
+    }
+
+    uint32_t hash = nameHash(name, len);
+    int i = hash & index->mask;
+
+    while (index->slots[i].value != -1) {
+        const NameIndexSlot* slot = &index->slots[i];
+        if (slot->hash == hash && slot->len == len && memcmp(index->pool + slot->name, name, len) == 0) {
+            return slot->value;
+        }
+        i = (i + 1) & index->mask;
+    }
+    return -1;
+}
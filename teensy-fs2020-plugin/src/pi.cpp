@@ -1,32 +1,43 @@
 #include "TeensyControls.h"
-#include <map>
-#include <string>
 #include <math.h>
+#include <ctype.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/inotify.h>
+#include <signal.h>
 #include "pi.h"
 #include "gpio.h"
+#include "mapping.h"
+#include "simbackend.h"
 
 const char* VersionString = "v1.0.1";
 
-const int MaxDataMappings = 256;
 const int MaxButtons = 9;
+const int DefaultDebounceMs = 20;
 
 bool quit = false;
+volatile sig_atomic_t printStats = 0;
 int dataMappings = 0;
 int readMappings = 0;
-DataMapping dataMapping[MaxDataMappings];
-std::map<std::string, int> dataMap;
+MappingTable* mappings = NULL;
+DataMapping* dataMapping = NULL;
+char mappingPath[256];
+std::atomic<MappingTable*> reloadedMappings(NULL);
+int reloadFd = -1;
 int buttonCount = 0;
 ButtonData buttonData[MaxButtons];
+SimBackend* sim;
 
 
-int dataRefNum(const char* dataRef, int id)
+// Name need not be null terminated
+int dataRefNum(const char* dataRef, int len, int id)
 {
-    if (dataMap.count(dataRef) == 0) {
-        printf("Teensy requested an unmapped Data Ref #%d: %s\n", id, dataRef);
-        return -1;
+    int refNum = nameIndexFind(&mappings->index, dataRef, len);
+    if (refNum == -1) {
+        printf("Teensy requested an unmapped Data Ref #%d: %.*s\n", id, len, dataRef);
     }
 
-    return dataMap[dataRef];
+    return refNum;
 }
 
 char* dataRefName(int refNum)
@@ -49,14 +60,39 @@ char* dataRefName(int refNum)
 
 double dataRefRead(int refNum)
 {
-    return dataMapping[refNum].testValue;
+    DataMapping* m = &dataMapping[refNum];
+    double value;
+
+    if (*m->readVar != '\0' && m->testValue == MAXINT && sim->read(refNum, &value)) {
+        return mappingRound(m, value * m->readScale);
+    }
+    return mappingRound(m, m->testValue);
 }
 
 void dataRefWrite(int refNum, double value, bool isAdjust)
 {
-    double origVal = dataMapping[refNum].testValue;
+    DataMapping* m = &dataMapping[refNum];
     value = round(value * 1000.0) / 1000.0;
 
+    if (*m->readVar != '\0' && m->testValue == MAXINT && sim->eventFd() >= 0) {
+        double simVal;
+        bool known = sim->read(refNum, &simVal);
+        if (isAdjust) {
+            if (!known) {
+                return;
+            }
+            value += simVal * m->readScale;
+        }
+        else if (known && round(simVal * m->readScale * 1000.0) / 1000.0 == value) {
+            return;
+        }
+
+        sim->write(refNum, m, round(value * m->writeScale * 1000.0) / 1000.0);
+        return;
+    }
+
+    double origVal = dataMapping[refNum].testValue;
+
     if (isAdjust) {
         value += origVal;
     }
@@ -72,22 +108,68 @@ void dataRefWrite(int refNum, double value, bool isAdjust)
 }
 
 bool dataRefWritten(int refNum)
+{
+    return sim->written(refNum);
+}
+
+// How much a value must change, and how long after it was last sent in
+// usec, before it is sent to a Teensy again, and how soon it is sent
+void dataRefLimits(int refNum, double* deadband, int* minInterval, int* priority)
+{
+    *deadband = dataMapping[refNum].deadband;
+    *minInterval = dataMapping[refNum].maxRate > 0 ? 1000000 / dataMapping[refNum].maxRate : 0;
+    *priority = dataMapping[refNum].priority;
+}
+
+// With no sim only the test values in the mapping file are used
+bool testSimOpen(const char* address)
+{
+    return true;
+}
+
+void testSimClose()
+{
+}
+
+int testSimEventFd()
+{
+    return -1;
+}
+
+void testSimSubscribe(const MappingTable* table)
+{
+}
+
+void testSimReceive()
+{
+}
+
+bool testSimRead(int refNum, double* value)
 {
     return false;
 }
 
-void strTrunc(char* dest, char* src)
+void testSimWrite(int refNum, const DataMapping* m, double value)
 {
-    while (*src == ' ' || *src == '\t') {
-        src++;
-    }
-    strcpy(dest, src);
+}
 
-    while (strlen(dest) > 0 && (dest[strlen(dest) - 1] == ' ' || dest[strlen(dest) - 1] == '\t')) {
-        dest[strlen(dest) - 1] = '\0';
-    }
+bool testSimWritten(int refNum)
+{
+    return false;
 }
 
+SimBackend testSimBackend = {
+    "test values",
+    testSimOpen,
+    testSimClose,
+    testSimEventFd,
+    testSimSubscribe,
+    testSimReceive,
+    testSimRead,
+    testSimWrite,
+    testSimWritten
+};
+
 bool loadDataMappings(const char* exe, const char* filename)
 {
     char path[256];
@@ -103,138 +185,141 @@ bool loadDataMappings(const char* exe, const char* filename)
         strcpy(pos + 1, filename);
     }
 
-    FILE* inf = fopen(path, "r");
-    if (!inf) {
-        printf("File not found: %s\n", path);
+    mappings = mappingLoad(path);
+    if (!mappings) {
         return false;
     }
 
-    printf("Loading data mappings from %s\n", path);
-
-    char line[1024];
-    int lineNum = 0;
-    while (fgets(line, 1024, inf) != 0) {
-        lineNum++;
+    strcpy(mappingPath, path);
+    dataMapping = mappings->mapping;
+    dataMappings = mappings->count;
+    return true;
+}
 
-        char* pos = strchr(line, '#');
-        if (pos) {
-            *pos = '\0';
+bool isMappingEvent(const char* events, int len, const char* name)
+{
+    const char* pos = events;
+    while (pos < events + len) {
+        const struct inotify_event* event = (const struct inotify_event*)pos;
+        if (event->len > 0 && strcmp(event->name, name) == 0) {
+            return true;
         }
+        pos += sizeof(struct inotify_event) + event->len;
+    }
 
-        char* end = &line[strlen(line) - 1];
-        while (end >= &line[0] && *end == '\r' || *end == '\n' || *end == ' ' || *end == '\t') {
-            end--;
-        }
-        if (end < &line[0]) {
+    return false;
+}
+
+// Loads the data mappings again whenever the file is saved. This runs
+// in the background so a big file never holds up a frame, and the main
+// loop is woken through reloadFd to swap the new table in. Editors often
+// save by renaming a new file over the old one so the directory is
+// watched rather than the file.
+void mappingWatcher(void* arg)
+{
+    int watchFd = (int)(intptr_t)arg;
+    const char* name = strrchr(mappingPath, '/') + 1;
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (!quit) {
+        int len = read(watchFd, events, sizeof(events));
+        if (len < 0 && errno == EINTR) {
             continue;
         }
-        *(end+1) = '\0';
+        if (len <= 0) {
+            printf("Stopped watching %s, errno = %d\n", mappingPath, errno);
+            break;
+        }
 
-        if (strlen(line) == 0) {
+        if (!isMappingEvent(events, len, name)) {
             continue;
         }
 
-        char* readVarPos = strchr(line, ';');
-        if (!readVarPos) {
-            printf("Error in data mapping file: Line %d does not contain a semi-colon\n", lineNum);
-            return false;
-        }
-        *readVarPos = '\0';
-        strTrunc(dataMapping[dataMappings].dataRef, line);
-        if (*dataMapping[dataMappings].dataRef == '\0') {
-            printf("Error in data mapping file: Line %d has a missing Data Ref\n", lineNum);
-            return false;
+        // One save can be several events so wait until they stop
+        struct pollfd pfd;
+        pfd.fd = watchFd;
+        pfd.events = POLLIN;
+        while (poll(&pfd, 1, 200) > 0 && read(watchFd, events, sizeof(events)) > 0) {
         }
-        readVarPos++;
 
-        *dataMapping[dataMappings].writeVar = '\0';
-        *dataMapping[dataMappings].writeVarUnits = '\0';
-        dataMapping[dataMappings].testValue = MAXINT;
-
-        char* writeVarPos = strchr(readVarPos, ';');
-        if (writeVarPos) {
-            *writeVarPos = '\0';
-            strTrunc(dataMapping[dataMappings].writeVar, writeVarPos + 1);
-            if (*dataMapping[dataMappings].writeVar != '\0') {
-                if (strchr(dataMapping[dataMappings].writeVar, ';')) {
-                    printf("Error in data mapping file: Line %d contains more than two semi-colons\n", lineNum);
-                    return false;
-                }
-
-                char* unitsPos = strchr(dataMapping[dataMappings].writeVar, ',');
-                if (!unitsPos) {
-                    printf("Error in data mapping file: Line %d Write Var does not contain a comma\n", lineNum);
-                    return false;
-                }
-                *unitsPos = '\0';
-                strTrunc(dataMapping[dataMappings].writeVarUnits, unitsPos + 1);
-            }
+        MappingTable* table = mappingLoad(mappingPath);
+        if (!table) {
+            printf("Keeping the current data mappings\n");
+            continue;
         }
 
-        strTrunc(dataMapping[dataMappings].readVar, readVarPos);
-        if (*dataMapping[dataMappings].readVar != '\0') {
-            if (isdigit(*dataMapping[dataMappings].readVar)) {
-                char* adjustPos = strchr(dataMapping[dataMappings].readVar, '+');
-                if (!adjustPos) {
-                    adjustPos = strchr(dataMapping[dataMappings].readVar, '-');
-                }
-                if (adjustPos) {
-                    sscanf(adjustPos, "%lf", &dataMapping[dataMappings].testAdjust);
-                    *adjustPos = '\0';
-                }
-                else {
-                    dataMapping[dataMappings].testAdjust = 0;
-                }
+        // Replaces a table not swapped in yet if saved again quickly
+        mappingFree(reloadedMappings.exchange(table));
+        uint64_t one = 1;
+        write(reloadFd, &one, sizeof(one));
+    }
 
-                sscanf(dataMapping[dataMappings].readVar, "%lf", &dataMapping[dataMappings].testValue);
-                *dataMapping[dataMappings].readVar = '\0';
+    close(watchFd);
+}
 
-#ifdef MORE_DEBUG
-                printf("Data Ref Test %d = %s  Value: %.3f  Adjust: %.3f\n", dataMappings, dataMapping[dataMappings].dataRef,
-                    dataMapping[dataMappings].testValue, dataMapping[dataMappings].testAdjust);
-#endif
-            }
-            else {
-                char* unitsPos = strchr(dataMapping[dataMappings].readVar, ',');
-                if (!unitsPos) {
-                    printf("Error in data mapping file: Line %d Read Var does not contain a comma\n", lineNum);
-                    return false;
-                }
-                *unitsPos = '\0';
-                strTrunc(dataMapping[dataMappings].readVarUnits, unitsPos + 1);
-                if (*dataMapping[dataMappings].readVarUnits == '\0') {
-                    printf("Error in data mapping file: Line %d Read Var has missing Units\n", lineNum);
-                    return false;
-                }
-            }
-        }
+// Returns the fd that is readable when new mappings are ready, or -1 if
+// the file can't be watched
+int watchDataMappings()
+{
+    char dir[256];
+    strcpy(dir, mappingPath);
+    *strrchr(dir, '/') = '\0';
+    if (*dir == '\0') {
+        strcpy(dir, "/");
+    }
 
-        if (*dataMapping[dataMappings].writeVar == '\0') {
-            strcpy(dataMapping[dataMappings].writeVar, dataMapping[dataMappings].readVar);
+    int watchFd = inotify_init1(IN_CLOEXEC);
+    reloadFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (watchFd < 0 || reloadFd < 0 || inotify_add_watch(watchFd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0 ||
+        !thread_start(mappingWatcher, (void*)(intptr_t)watchFd))
+    {
+        printf("Not watching %s for changes, errno = %d\n", mappingPath, errno);
+        if (watchFd >= 0) {
+            close(watchFd);
         }
-
-        if (*dataMapping[dataMappings].writeVarUnits == '\0') {
-            strcpy(dataMapping[dataMappings].writeVarUnits, dataMapping[dataMappings].readVarUnits);
+        if (reloadFd >= 0) {
+            close(reloadFd);
         }
+        reloadFd = -1;
+        return -1;
+    }
 
-#ifdef MORE_DEBUG
-        printf("Data Mapping %d = %s, %s (%s), %s (%s)\n", dataMappings, dataMapping[dataMappings].dataRef, dataMapping[dataMappings].readVar,
-            dataMapping[dataMappings].readVarUnits, dataMapping[dataMappings].writeVar, dataMapping[dataMappings].writeVarUnits);
-#endif
+    printf("Watching %s for changes\n", mappingPath);
+    return reloadFd;
+}
 
-        if (!dataMap.insert(std::make_pair(std::string(dataMapping[dataMappings].dataRef), dataMappings)).second) {
-            printf("Error in data mapping file: Line %d has duplicate Data Ref\n", lineNum);
-            return false;
-        }
+int findDataRef(const char* name)
+{
+    return nameIndexFind(&mappings->index, name, strlen(name));
+}
 
-        dataMapping[dataMappings].setDelay = 0;
-        dataMappings++;
+// Called between frames so nothing is part way through using the old
+// table. Teensys stay registered and only the items whose Data Ref now
+// maps somewhere else are rebound.
+void swapDataMappings()
+{
+    MappingTable* table = reloadedMappings.exchange(NULL);
+    if (!table) {
+        return;
     }
 
-    fclose(inf);
+    MappingTable* old = mappings;
+    int changed = mappingCarryOver(table, old);
+    mappings = table;
+    dataMapping = table->mapping;
+    dataMappings = table->count;
 
-    printf("Loaded %d data mappings\n", dataMappings);
-    return true;
+    sim->subscribe(table);
+    int rebound = TeensyControls_rebind_items(findDataRef);
+    for (int i = 0; i < buttonCount; i++) {
+        buttonData[i].refNum = findDataRef(buttonData[i].dataRef);
+        if (buttonData[i].refNum == -1) {
+            printf("Hardware button %d Data Ref is no longer mapped: %s\n", buttonData[i].button, buttonData[i].dataRef);
+        }
+    }
+
+    mappingFree(old);
+    printf("Swapped in new data mappings, %d new or changed, %d Teensy items rebound\n", changed, rebound);
 }
 
 int buttonToGpioPin(int button) {
@@ -263,6 +348,12 @@ bool loadButtons(const char* filename)
 
     printf("Loading hardware buttons from %s\n", filename);
 
+    // Lines such as debounce=<ms> or repeat=<ms> apply to the buttons
+    // after them. Repeat options can also follow a button's value.
+    int debounceMs = DefaultDebounceMs;
+    ButtonRepeat repeat;
+    buttonRepeatDefaults(&repeat);
+
     char line[1024];
     int lineNum = 0;
     while (fgets(line, 1024, inf) != 0) {
@@ -292,6 +383,19 @@ bool loadButtons(const char* filename)
         }
 
 
+        if (strncmp(line, "debounce=", 9) == 0) {
+            debounceMs = atoi(&line[9]);
+            printf("Debouncing hardware buttons for %d ms\n", debounceMs);
+            continue;
+        }
+
+        if (!isdigit(*line)) {
+            if (!buttonRepeatOption(&repeat, line)) {
+                printf("Ignored unknown setting: %s\n", line);
+            }
+            continue;
+        }
+
         pos = strchr(line, '=');
         if (!pos) {
             printf("Ignored bad line (no =): %s\n", line);
@@ -319,10 +423,24 @@ bool loadButtons(const char* filename)
 
         *sepPos = '\0';
         sepPos++;
-        buttonData[buttonCount].refNum = dataRefNum(pos, 0);
+
+        ButtonRepeat buttonRepeat = repeat;
+        char* options = strchr(sepPos, ' ');
+        if (options) {
+            *options = '\0';
+            for (char* option = strtok(options + 1, " \t"); option; option = strtok(NULL, " \t")) {
+                if (!buttonRepeatOption(&buttonRepeat, option)) {
+                    printf("Ignored unknown button option: %s\n", option);
+                }
+            }
+        }
+        buttonActionInit(&buttonData[buttonCount].action, &buttonRepeat);
+
+        buttonData[buttonCount].refNum = dataRefNum(pos, strlen(pos), 0);
         if (buttonData[buttonCount].refNum == -1) {
             continue;
         }
+        strcpy(buttonData[buttonCount].dataRef, pos);
 
         if (isdigit(*sepPos)) {
             buttonData[buttonCount].initValue = atof(sepPos);
@@ -343,7 +461,7 @@ bool loadButtons(const char* filename)
             buttonData[buttonCount].adjust = 0;
         }
 
-        gpioAdd(buttonData[buttonCount].gpioPin);
+        gpioAdd(buttonData[buttonCount].gpioPin, debounceMs);
 
         if (buttonData[buttonCount].initValue == MAXINT) {
             printf("Added hardware button %d gpio %d to adjust %s by %.3f\n",
@@ -368,12 +486,89 @@ bool loadButtons(const char* filename)
 void hardwareInit()
 {
     for (int i = 0; i < buttonCount; i++) {
-        if (buttonData[i].initValue != MAXINT) {
+        if (buttonData[i].initValue != MAXINT && buttonData[i].refNum != -1) {
             dataRefWrite(buttonData[i].refNum, buttonData[i].initValue);
         }
     }
 }
 
+// Every debounced press adjusts once, even if it was released again
+// before this read. A button held down then repeats on its own timing.
+void readButtons(uint64_t now)
+{
+    gpioReadAll();
+
+    for (int i = 0; i < buttonCount; i++) {
+        int pin = buttonData[i].gpioPin;
+        int adjusts = gpioPresses(pin);
+        if (gpioGetState(pin) != 0) {
+            buttonActionRelease(&buttonData[i].action);
+        }
+        else if (adjusts > 0 || !buttonData[i].action.held) {
+            buttonActionPress(&buttonData[i].action, gpioChangeTime(pin));
+        }
+        adjusts += buttonActionRun(&buttonData[i].action, now);
+
+        if (buttonData[i].refNum == -1) {
+            continue;
+        }
+
+        for (int j = 0; j < adjusts; j++) {
+            printf("Adjust %s by %.3f\n", dataRefName(buttonData[i].refNum), buttonData[i].adjust);
+            dataRefWrite(buttonData[i].refNum, buttonData[i].adjust, true);
+        }
+
+        // Send the adjust on this wakeup, not the next frame
+        if (adjusts > 0) {
+            TeensyControls_read_xplane_ref(buttonData[i].refNum);
+        }
+    }
+}
+
+// Wakes the main loop when the next button repeat is due
+void scheduleRepeats(int repeatFd)
+{
+    uint64_t next = 0;
+    for (int i = 0; i < buttonCount; i++) {
+        uint64_t due = buttonActionNext(&buttonData[i].action);
+        if (due != 0 && (next == 0 || due < next)) {
+            next = due;
+        }
+    }
+
+    struct itimerspec timer;
+    memset(&timer, 0, sizeof(timer));
+    timer.it_value.tv_sec = next / 1000000;
+    timer.it_value.tv_nsec = (next % 1000000) * 1000;
+    timerfd_settime(repeatFd, TFD_TIMER_ABSTIME, &timer, NULL);
+}
+
+bool addEventFd(int epollFd, int fd)
+{
+    if (fd < 0) {
+        // Optional event source not available
+        return true;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    return epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+void statsRequested(int signum)
+{
+    printStats = 1;
+}
+
+void clearEventFd(int fd)
+{
+    uint64_t count;
+    while (read(fd, &count, sizeof(count)) == sizeof(count)) {
+    }
+}
+
 int main(int argc, char* argv[])
 {
     printf("Teensy Pi Plugin %s Copyright (c) 2025 Scott Vincent\n", VersionString);
@@ -396,6 +591,19 @@ int main(int argc, char* argv[])
         }
     }
 
+    // TEENSY_SIM=<socket> takes sim values from teensy-sim, the stand-in
+    // simulator, as well as the test values in the mapping file
+    sim = &testSimBackend;
+    const char* simAddress = getenv("TEENSY_SIM");
+    if (simAddress) {
+        sim = &socketSimBackend;
+        if (!sim->open(simAddress)) {
+            return 1;
+        }
+    }
+    sim->subscribe(mappings);
+    printf("Sim values from %s\n", sim->name);
+
     gpioInit();
 
     char buttonFile[256];
@@ -404,42 +612,153 @@ int main(int argc, char* argv[])
         printf("Failed to read hardware buttons from %s\n", buttonFile);
         return 1;
     }
+    gpioStart();
 
+    // Periodic work (sim reads, buttons) runs every loopMillis but Teensy
+    // input and new Teensys are processed as soon as they arrive.
     int loopMillis = 30;
-    int retryDelay = 0;
+
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    int timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    int repeatFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    int usbFd = TeensyControls_usb_wake_fd();
+
+    // TEENSY_CAPTURE=<file> logs every USB report. TEENSY_REPLAY=<file>
+    // plays a capture back instead of using USB devices, at the speed
+    // multiple in TEENSY_REPLAY_SPEED (default 1, 0 is as fast as possible).
+    const char* replayPath = getenv("TEENSY_REPLAY");
+    const char* capturePath = getenv("TEENSY_CAPTURE");
+    if (replayPath) {
+        const char* speed = getenv("TEENSY_REPLAY_SPEED");
+        if (!TeensyControls_replay_start(replayPath, speed ? atof(speed) : 1, usbFd)) {
+            printf("Failed to replay %s\n", replayPath);
+            return 1;
+        }
+    }
+    else {
+        if (capturePath) {
+            TeensyControls_capture_open(capturePath);
+        }
+
+        // Starts the hotplug thread, which wakes us through usbFd
+        TeensyControls_find_new_usb_devices();
+    }
+    int gpioFd = gpioEventFd();
+    int mappingFd = watchDataMappings();
+    int simFd = sim->eventFd();
+
+    struct itimerspec interval;
+    interval.it_interval.tv_sec = 0;
+    interval.it_interval.tv_nsec = loopMillis * 1000000;
+    interval.it_value = interval.it_interval;
+
+    if (epollFd < 0 || timerFd < 0 || repeatFd < 0 || usbFd < 0 || timerfd_settime(timerFd, 0, &interval, NULL) != 0 ||
+        !addEventFd(epollFd, timerFd) || !addEventFd(epollFd, repeatFd) || !addEventFd(epollFd, usbFd) ||
+        !addEventFd(epollFd, gpioFd) || !addEventFd(epollFd, mappingFd) || !addEventFd(epollFd, simFd))
+    {
+        printf("Failed to set up event loop, errno = %d\n", errno);
+        return 1;
+    }
+
+    // kill -USR1 <pid> prints the USB statistics
+    signal(SIGUSR1, statsRequested);
 
     bool firstTime = true;
     while (!quit)
     {
-        TeensyControls_delete_offline_teensy();
-        TeensyControls_find_new_usb_devices();
-        TeensyControls_input(0, 0);
-        TeensyControls_update_xplane(0);
-        TeensyControls_output(0, 0);
+        if (printStats) {
+            printStats = 0;
+            TeensyControls_print_stats();
+        }
 
-        if (firstTime) {
-            firstTime = false;
-            hardwareInit();
+        struct epoll_event events[8];
+        int count = epoll_wait(epollFd, events, 8, -1);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("Event loop failed, errno = %d\n", errno);
+            break;
         }
 
-        gpioReadAll();
+        bool isFrame = false;
+        bool isButton = false;
+        bool isReload = false;
 
-        for (int i = 0; i < buttonCount; i++) {
-            int val = gpioGetState(buttonData[i].gpioPin);
-            //if (buttonData[i].prevGpioVal != val) {
-                buttonData[i].prevGpioVal = val;
-                if (val == 0) {
-                    printf("Adjust %s by %.3f\n", dataRefName(buttonData[i].refNum), buttonData[i].adjust);
-                    dataRefWrite(buttonData[i].refNum, buttonData[i].adjust, true);
-                }
-            //}
+        for (int i = 0; i < count; i++) {
+            int fd = events[i].data.fd;
+            if (fd == usbFd) {
+                clearEventFd(fd);
+            }
+            else if (fd == timerFd) {
+                clearEventFd(fd);
+                isFrame = true;
+            }
+            else if (fd == gpioFd) {
+                isButton = true;
+            }
+            else if (fd == repeatFd) {
+                clearEventFd(fd);
+                isButton = true;
+            }
+            else if (fd == mappingFd) {
+                clearEventFd(fd);
+                isReload = true;
+            }
+            else if (fd == simFd) {
+                sim->receive();
+            }
+        }
+
+        // New Teensys are woken for as soon as they are found
+        if (!replayPath) {
+            TeensyControls_find_new_usb_devices();
+        }
+
+        if (isReload) {
+            swapDataMappings();
         }
 
-        usleep(loopMillis * 1000);
+        if (isFrame) {
+            TeensyControls_delete_offline_teensy();
+
+            if (firstTime) {
+                firstTime = false;
+                hardwareInit();
+            }
+        }
+
+        if (isFrame || isButton) {
+            readButtons(TeensyControls_usec());
+            scheduleRepeats(repeatFd);
+        }
+
+        // Pass Teensy changes to the sim straight away. The sim is read,
+        // each Data Ref once, only on a frame as that visits every item.
+        // A button adjust has already re-read its own Data Ref above, so
+        // anything still to send goes on a frame or button change.
+        TeensyControls_input(0, 0);
+        TeensyControls_write_xplane();
+
+        if (isFrame) {
+            TeensyControls_read_xplane();
+        }
+        if (isFrame || isButton) {
+            TeensyControls_output(0, 0);
+        }
     }
 
+    close(timerFd);
+    close(repeatFd);
+    close(epollFd);
+
+    if (replayPath) {
+        TeensyControls_replay_stop();
+    }
     TeensyControls_usb_close();
+    TeensyControls_capture_close();
     TeensyControls_delete_offline_teensy();
+    sim->close();
 
     printf("Teensy Pi Plugin stopping\n");
 
@@ -0,0 +1,461 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "simsocket.h"
+
+// Stand-in simulator for running the plugin headless under sim load. It
+// serves the sim vars the plugin subscribes to over a Unix socket and
+// changes a share of them every frame, like gauges, counters and
+// switches in a busy cockpit. Writes from the plugin set the var.
+//
+//   teensy-sim [options]
+//     -s <path>      socket path, default /tmp/teensy-sim.sock
+//     -f <rate>      frames a second, default 30
+//     -c <percent>   vars changed each frame, default 10
+//     -g <count>     also serve count generated vars and write
+//                    standin_mapping.txt and standin_items.txt for them
+//     -t <seconds>   run time, default until Ctrl-C
+//
+// Run the plugin with TEENSY_SIM=<path> to use it. standin_items.txt
+// is an items file for teensy-virtual that registers every generated var.
+
+const int MaxClients = 8;
+
+enum VarKind {
+    VarGauge,       // moves smoothly, two decimal places
+    VarCounter,     // int that counts up
+    VarSwitch       // 0 or 1
+};
+
+struct SimVar {
+    std::string name;
+    int kind;
+    double value;
+    double phase;
+    uint64_t changedFrame;
+};
+
+struct SimSub {
+    uint32_t refNum;
+    int var;
+};
+
+struct SimClient {
+    int fd;
+    uint32_t generation;
+    bool sendAll;                   // every value goes in the next frame
+    uint64_t sentFrame;             // last frame sent
+    std::vector<SimSub> subs;
+    std::vector<uint8_t> inBuf;
+    uint64_t framesSent;
+    uint64_t valuesSent;
+    uint64_t writes;
+};
+
+static volatile sig_atomic_t quit = 0;
+static std::vector<SimVar> vars;
+static std::map<std::string, int> varIndex;
+static SimClient clients[MaxClients];
+static uint64_t frame = 0;
+
+static void stopRequested(int signum)
+{
+    quit = 1;
+}
+
+static uint64_t nowMicros()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// The kind of var is picked from its name so runs are repeatable
+static int findVar(const std::string& name)
+{
+    auto it = varIndex.find(name);
+    if (it != varIndex.end()) {
+        return it->second;
+    }
+
+    uint32_t hash = 2166136261u;
+    for (char ch : name) {
+        hash = (hash ^ (uint8_t)ch) * 16777619u;
+    }
+
+    SimVar var;
+    var.name = name;
+    var.kind = hash % 3;
+    var.phase = (hash >> 8) % 628 / 100.0;
+    var.value = var.kind == VarGauge ? 100 : var.kind == VarCounter ? (hash >> 4) % 1000 : 0;
+    var.changedFrame = frame;
+    vars.push_back(var);
+    varIndex[name] = vars.size() - 1;
+    return vars.size() - 1;
+}
+
+static void changeVar(SimVar* var)
+{
+    switch (var->kind) {
+    case VarGauge:
+        var->phase += 0.05;
+        var->value = round((100 + 50 * sin(var->phase)) * 100) / 100;
+        break;
+
+    case VarCounter:
+        var->value += 1;
+        break;
+
+    case VarSwitch:
+        var->value = var->value == 0 ? 1 : 0;
+        break;
+    }
+    var->changedFrame = frame;
+}
+
+static bool generateFiles(int count)
+{
+    FILE* mappingFile = fopen("standin_mapping.txt", "w");
+    FILE* itemsFile = fopen("standin_items.txt", "w");
+    if (!mappingFile || !itemsFile) {
+        printf("Unable to write the generated mapping and items files\n");
+        return false;
+    }
+
+    fprintf(mappingFile, "# Generated by teensy-sim\n");
+    fprintf(itemsFile, "# Generated by teensy-sim, for teensy-virtual\n");
+    for (int i = 0; i < count; i++) {
+        char name[64];
+        sprintf(name, "STANDIN VAR %d", i);
+        int v = findVar(name);
+        fprintf(mappingFile, "sim/standin/var_%d; %s, number\n", i, name);
+        fprintf(itemsFile, "%s sim/standin/var_%d\n", vars[v].kind == VarGauge ? "float" : "int", i);
+    }
+
+    fclose(mappingFile);
+    fclose(itemsFile);
+    printf("Wrote standin_mapping.txt and standin_items.txt for %d vars\n", count);
+    return true;
+}
+
+static bool sendAll(SimClient* client, const void* data, size_t len)
+{
+    const uint8_t* pos = (const uint8_t*)data;
+    while (len > 0) {
+        ssize_t n = send(client->fd, pos, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        pos += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void dropClient(SimClient* client)
+{
+    printf("Plugin disconnected after %llu frames, %llu values sent, %llu writes\n",
+        (unsigned long long)client->framesSent, (unsigned long long)client->valuesSent,
+        (unsigned long long)client->writes);
+    close(client->fd);
+    client->fd = -1;
+    client->subs.clear();
+    client->inBuf.clear();
+}
+
+static void takeSubscribe(SimClient* client, const uint8_t* payload, uint32_t len)
+{
+    if (len < sizeof(uint32_t)) {
+        return;
+    }
+
+    memcpy(&client->generation, payload, sizeof(uint32_t));
+    client->subs.clear();
+    size_t pos = sizeof(uint32_t);
+    while (pos + sizeof(uint32_t) < len) {
+        SimSub sub;
+        memcpy(&sub.refNum, payload + pos, sizeof(uint32_t));
+        pos += sizeof(uint32_t);
+        const char* name = (const char*)payload + pos;
+        size_t nameLen = strnlen(name, len - pos);
+        if (nameLen == len - pos) {
+            break;
+        }
+        pos += nameLen + 1;
+        sub.var = findVar(name);
+        client->subs.push_back(sub);
+    }
+    client->sendAll = true;
+    printf("Plugin subscribed to %d vars\n", (int)client->subs.size());
+}
+
+static void takeWrite(SimClient* client, const uint8_t* payload, uint32_t len)
+{
+    double value;
+
+    if (len <= sizeof(double) || payload[len - 1] != '\0') {
+        return;
+    }
+    memcpy(&value, payload, sizeof(double));
+    SimVar* var = &vars[findVar((const char*)payload + sizeof(double))];
+    var->value = value;
+    var->changedFrame = frame + 1;
+    client->writes++;
+}
+
+static void readClient(SimClient* client)
+{
+    uint8_t buf[65536];
+
+    while (true) {
+        ssize_t n = recv(client->fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n <= 0) {
+            dropClient(client);
+            return;
+        }
+        client->inBuf.insert(client->inBuf.end(), buf, buf + n);
+    }
+
+    size_t pos = 0;
+    while (client->inBuf.size() - pos >= sizeof(SimMessage)) {
+        SimMessage header;
+        memcpy(&header, &client->inBuf[pos], sizeof(header));
+        if (header.length > SIM_MAX_MESSAGE) {
+            dropClient(client);
+            return;
+        }
+        if (client->inBuf.size() - pos < sizeof(header) + header.length) {
+            break;
+        }
+        const uint8_t* payload = &client->inBuf[pos + sizeof(header)];
+        if (header.type == SimSubscribe) {
+            takeSubscribe(client, payload, header.length);
+        }
+        else if (header.type == SimWrite) {
+            takeWrite(client, payload, header.length);
+        }
+        pos += sizeof(header) + header.length;
+    }
+    client->inBuf.erase(client->inBuf.begin(), client->inBuf.begin() + pos);
+}
+
+// The subscribed values changed since the last frame sent, or all of
+// them after a subscribe
+static void sendFrame(SimClient* client, std::vector<uint8_t>* out)
+{
+    out->resize(sizeof(SimMessage) + 2 * sizeof(uint32_t));
+    uint32_t count = 0;
+    for (const SimSub& sub : client->subs) {
+        const SimVar& var = vars[sub.var];
+        if (client->sendAll || var.changedFrame > client->sentFrame) {
+            SimValue entry;
+            entry.refNum = sub.refNum;
+            entry.value = var.value;
+            const uint8_t* bytes = (const uint8_t*)&entry;
+            out->insert(out->end(), bytes, bytes + sizeof(entry));
+            count++;
+        }
+    }
+    client->sendAll = false;
+    client->sentFrame = frame;
+
+    SimMessage header;
+    header.type = SimFrame;
+    header.length = out->size() - sizeof(SimMessage);
+    memcpy(out->data(), &header, sizeof(header));
+    memcpy(out->data() + sizeof(header), &client->generation, sizeof(uint32_t));
+    memcpy(out->data() + sizeof(header) + sizeof(uint32_t), &count, sizeof(uint32_t));
+    if (count == 0) {
+        return;
+    }
+
+    if (!sendAll(client, out->data(), out->size())) {
+        dropClient(client);
+        return;
+    }
+    client->framesSent++;
+    client->valuesSent += count;
+}
+
+static void usage()
+{
+    printf("Usage: teensy-sim [-s path] [-f rate] [-c percent] [-g count] [-t seconds]\n");
+    printf("  -s <path>      socket path, default %s\n", SIM_SOCKET_PATH);
+    printf("  -f <rate>      frames a second, default 30\n");
+    printf("  -c <percent>   vars changed each frame, default 10\n");
+    printf("  -g <count>     serve count generated vars, writing standin_mapping.txt and standin_items.txt\n");
+    printf("  -t <seconds>   run time, default until Ctrl-C\n");
+}
+
+int main(int argc, char* argv[])
+{
+    const char* path = SIM_SOCKET_PATH;
+    double rate = 30;
+    double percent = 10;
+    int generate = 0;
+    double runSeconds = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:f:c:g:t:")) != -1) {
+        switch (opt) {
+        case 's': path = optarg; break;
+        case 'f': rate = atof(optarg); break;
+        case 'c': percent = atof(optarg); break;
+        case 'g': generate = atoi(optarg); break;
+        case 't': runSeconds = atof(optarg); break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (rate <= 0 || percent < 0 || percent > 100 || generate < 0) {
+        usage();
+        return 1;
+    }
+
+    if (generate > 0 && !generateFiles(generate)) {
+        return 1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Socket path is too long: %s\n", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+
+    long frameNanos = (long)(1e9 / rate);
+    struct itimerspec interval;
+    interval.it_interval.tv_sec = frameNanos / 1000000000;
+    interval.it_interval.tv_nsec = frameNanos % 1000000000;
+    interval.it_value = interval.it_interval;
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    if (listenFd < 0 || timerFd < 0 || epollFd < 0 ||
+        bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listenFd, MaxClients) != 0 ||
+        timerfd_settime(timerFd, 0, &interval, NULL) != 0)
+    {
+        printf("Unable to serve %s, errno = %d\n", path, errno);
+        return 1;
+    }
+    event.data.fd = listenFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event);
+    event.data.fd = timerFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, timerFd, &event);
+
+    for (int i = 0; i < MaxClients; i++) {
+        clients[i].fd = -1;
+    }
+
+    signal(SIGINT, stopRequested);
+    signal(SIGTERM, stopRequested);
+    printf("Stand-in sim on %s, %.0f frames a second, %.0f%% of vars changing\n", path, rate, percent);
+
+    unsigned int seed = 1;
+    uint64_t start = nowMicros();
+    uint64_t frameMicros = 0;
+    std::vector<uint8_t> out;
+    while (!quit) {
+        if (runSeconds > 0 && nowMicros() - start >= runSeconds * 1000000) {
+            break;
+        }
+
+        struct epoll_event events[MaxClients + 2];
+        int count = epoll_wait(epollFd, events, MaxClients + 2, 100);
+        for (int i = 0; i < count; i++) {
+            int fd = events[i].data.fd;
+            if (fd == listenFd) {
+                int clientFd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+                int slot = 0;
+                while (slot < MaxClients && clients[slot].fd >= 0) {
+                    slot++;
+                }
+                if (clientFd < 0 || slot == MaxClients) {
+                    if (clientFd >= 0) {
+                        close(clientFd);
+                    }
+                    continue;
+                }
+                SimClient* client = &clients[slot];
+                client->fd = clientFd;
+                client->generation = 0;
+                client->sendAll = false;
+                client->sentFrame = frame;
+                client->framesSent = 0;
+                client->valuesSent = 0;
+                client->writes = 0;
+                event.data.fd = clientFd;
+                epoll_ctl(epollFd, EPOLL_CTL_ADD, clientFd, &event);
+                printf("Plugin connected\n");
+            }
+            else if (fd == timerFd) {
+                uint64_t expirations;
+                read(timerFd, &expirations, sizeof(expirations));
+                uint64_t frameStart = nowMicros();
+                frame++;
+                for (size_t v = 0; v < vars.size(); v++) {
+                    if (rand_r(&seed) % 10000 < percent * 100) {
+                        changeVar(&vars[v]);
+                    }
+                }
+                for (int c = 0; c < MaxClients; c++) {
+                    if (clients[c].fd >= 0) {
+                        sendFrame(&clients[c], &out);
+                    }
+                }
+                frameMicros += nowMicros() - frameStart;
+            }
+            else {
+                for (int c = 0; c < MaxClients; c++) {
+                    if (clients[c].fd == fd) {
+                        readClient(&clients[c]);
+                    }
+                }
+            }
+        }
+    }
+
+    double seconds = (nowMicros() - start) / 1000000.0;
+    printf("%llu frames in %.1f s, %d vars, %.1f us a frame to change and send\n",
+        (unsigned long long)frame, seconds, (int)vars.size(), frame ? (double)frameMicros / frame : 0.0);
+    for (int c = 0; c < MaxClients; c++) {
+        if (clients[c].fd >= 0) {
+            dropClient(&clients[c]);
+        }
+    }
+    close(listenFd);
+    unlink(path);
+    return 0;
+}
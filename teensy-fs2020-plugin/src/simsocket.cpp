@@ -0,0 +1,273 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "simbackend.h"
+#include "simsocket.h"
+
+// Sim values from teensy-sim. Frames arrive on the socket whenever the
+// stand-in sim has them and are taken in by receive() from the main loop,
+// so reads never wait on the socket.
+
+const int WrittenFrames = 3;    // frames a write may take to be read back
+
+static int simFd = -1;
+static uint32_t generation = 0;
+static int valueCount = 0;
+static double* values = NULL;
+static bool* hasValue = NULL;
+static int* writtenFrames = NULL;
+static uint8_t* inBuf = NULL;
+static size_t inSize = 0;
+static size_t inLen = 0;
+
+// The socket is non-blocking for reads so wait for room to write
+static bool sendAll(const void* data, size_t len)
+{
+    const uint8_t* pos = (const uint8_t*)data;
+    while (len > 0) {
+        ssize_t n = send(simFd, pos, len, MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd pfd;
+            pfd.fd = simFd;
+            pfd.events = POLLOUT;
+            poll(&pfd, 1, 100);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            printf("Lost the connection to the sim, errno = %d\n", errno);
+            return false;
+        }
+        pos += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool sendMessage(uint32_t type, const void* payload, size_t len)
+{
+    SimMessage header;
+    header.type = type;
+    header.length = len;
+    return sendAll(&header, sizeof(header)) && sendAll(payload, len);
+}
+
+static bool socketOpen(const char* address)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(address) >= sizeof(addr.sun_path)) {
+        printf("Sim socket path is too long: %s\n", address);
+        return false;
+    }
+    strcpy(addr.sun_path, address);
+
+    simFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (simFd < 0 || connect(simFd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        printf("Unable to connect to the sim at %s, errno = %d\n", address, errno);
+        if (simFd >= 0) {
+            close(simFd);
+        }
+        simFd = -1;
+        return false;
+    }
+
+    printf("Connected to the sim at %s\n", address);
+    return true;
+}
+
+static void socketClose()
+{
+    if (simFd >= 0) {
+        close(simFd);
+        simFd = -1;
+    }
+    free(values);
+    free(hasValue);
+    free(writtenFrames);
+    free(inBuf);
+    values = NULL;
+    hasValue = NULL;
+    writtenFrames = NULL;
+    inBuf = NULL;
+    inSize = 0;
+    inLen = 0;
+    valueCount = 0;
+}
+
+static int socketEventFd()
+{
+    return simFd;
+}
+
+// Refs are numbered by the new table, so values for the old one are
+// dropped and frames still on their way for it are ignored
+static void socketSubscribe(const MappingTable* table)
+{
+    valueCount = table->count;
+    values = (double*)realloc(values, (valueCount + 1) * sizeof(double));
+    hasValue = (bool*)realloc(hasValue, (valueCount + 1) * sizeof(bool));
+    writtenFrames = (int*)realloc(writtenFrames, (valueCount + 1) * sizeof(int));
+    memset(hasValue, 0, (valueCount + 1) * sizeof(bool));
+    memset(writtenFrames, 0, (valueCount + 1) * sizeof(int));
+    generation++;
+    if (simFd < 0) {
+        return;
+    }
+
+    size_t len = sizeof(uint32_t);
+    int subscribed = 0;
+    for (int i = 0; i < table->count; i++) {
+        if (*table->mapping[i].readVar != '\0') {
+            len += sizeof(uint32_t) + strlen(table->mapping[i].readVar) + 1;
+        }
+    }
+
+    uint8_t* payload = (uint8_t*)malloc(len);
+    uint8_t* pos = payload;
+    memcpy(pos, &generation, sizeof(uint32_t));
+    pos += sizeof(uint32_t);
+    for (int i = 0; i < table->count; i++) {
+        const char* readVar = table->mapping[i].readVar;
+        if (*readVar != '\0') {
+            uint32_t refNum = i;
+            memcpy(pos, &refNum, sizeof(uint32_t));
+            pos += sizeof(uint32_t);
+            strcpy((char*)pos, readVar);
+            pos += strlen(readVar) + 1;
+            subscribed++;
+        }
+    }
+
+    sendMessage(SimSubscribe, payload, len);
+    free(payload);
+    printf("Subscribed to %d sim vars\n", subscribed);
+}
+
+static void takeFrame(const uint8_t* payload, uint32_t len)
+{
+    uint32_t frameGeneration, count;
+
+    if (len < 2 * sizeof(uint32_t)) {
+        return;
+    }
+    memcpy(&frameGeneration, payload, sizeof(uint32_t));
+    memcpy(&count, payload + sizeof(uint32_t), sizeof(uint32_t));
+    if (frameGeneration != generation || count > (len - 2 * sizeof(uint32_t)) / sizeof(SimValue)) {
+        return;
+    }
+
+    for (int i = 0; i < valueCount; i++) {
+        if (writtenFrames[i] > 0) {
+            writtenFrames[i]--;
+        }
+    }
+
+    const SimValue* entry = (const SimValue*)(payload + 2 * sizeof(uint32_t));
+    for (uint32_t i = 0; i < count; i++, entry++) {
+        if (entry->refNum < (uint32_t)valueCount) {
+            values[entry->refNum] = entry->value;
+            hasValue[entry->refNum] = true;
+            writtenFrames[entry->refNum] = 0;
+        }
+    }
+}
+
+static void socketReceive()
+{
+    while (simFd >= 0) {
+        if (inSize - inLen < 65536) {
+            inSize = inSize ? inSize * 2 : 131072;
+            inBuf = (uint8_t*)realloc(inBuf, inSize);
+        }
+
+        ssize_t n = recv(simFd, inBuf + inLen, inSize - inLen, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n <= 0) {
+            printf("Lost the connection to the sim, errno = %d\n", n < 0 ? errno : 0);
+            close(simFd);
+            simFd = -1;
+            memset(hasValue, 0, (valueCount + 1) * sizeof(bool));
+            return;
+        }
+        inLen += n;
+
+        size_t pos = 0;
+        while (inLen - pos >= sizeof(SimMessage)) {
+            SimMessage header;
+            memcpy(&header, inBuf + pos, sizeof(header));
+            if (header.length > SIM_MAX_MESSAGE) {
+                printf("Bad message from the sim, length %u\n", header.length);
+                close(simFd);
+                simFd = -1;
+                return;
+            }
+            if (inLen - pos < sizeof(header) + header.length) {
+                break;
+            }
+            if (header.type == SimFrame) {
+                takeFrame(inBuf + pos + sizeof(header), header.length);
+            }
+            pos += sizeof(header) + header.length;
+        }
+        memmove(inBuf, inBuf + pos, inLen - pos);
+        inLen -= pos;
+    }
+}
+
+static bool socketRead(int refNum, double* value)
+{
+    if (refNum < 0 || refNum >= valueCount || !hasValue[refNum]) {
+        return false;
+    }
+    *value = values[refNum];
+    return true;
+}
+
+static void socketWrite(int refNum, const DataMapping* m, double value)
+{
+    if (simFd < 0 || refNum < 0 || refNum >= valueCount) {
+        return;
+    }
+
+    size_t nameLen = strlen(m->writeVar) + 1;
+    uint8_t payload[sizeof(double) + 256];
+    if (nameLen > 256) {
+        return;
+    }
+    memcpy(payload, &value, sizeof(double));
+    memcpy(payload + sizeof(double), m->writeVar, nameLen);
+    if (sendMessage(SimWrite, payload, sizeof(double) + nameLen)) {
+        writtenFrames[refNum] = WrittenFrames;
+    }
+}
+
+static bool socketWritten(int refNum)
+{
+    return refNum >= 0 && refNum < valueCount && writtenFrames[refNum] > 0;
+}
+
+SimBackend socketSimBackend = {
+    "teensy-sim socket",
+    socketOpen,
+    socketClose,
+    socketEventFd,
+    socketSubscribe,
+    socketReceive,
+    socketRead,
+    socketWrite,
+    socketWritten
+};
@@ -0,0 +1,134 @@
+#include "TeensyControls.h"
+
+static const char *batch_labels[BATCH_BUCKETS] = {
+	"1", "2-3", "4-7", "8-15", "16-31", "32-63", "64+"
+};
+
+static const char *latency_labels[LATENCY_STAGES] = {
+	"read to decode", "decode to sim write", "read to sim write",
+	"sim change to queued", "queued to write", "sim change to write"
+};
+
+// monotonic clock in microseconds, safe to call from any thread
+uint64_t TeensyControls_usec(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER count;
+
+	if (freq.QuadPart == 0) QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000 +
+		(uint64_t)(count.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+// add one latency sample to a stage. Input stages are recorded by the
+// main thread and output stages by the output thread, so each histogram
+// only ever has a single writer. A start of 0 means not measured.
+void TeensyControls_latency(teensy_t *t, int stage, uint64_t start, uint64_t end)
+{
+	latency_hist_t *h;
+	uint64_t usec;
+	int bucket = 0;
+
+	if (start == 0 || end < start) return;
+	usec = end - start;
+	while ((usec >> (bucket + 1)) > 0 && bucket < LATENCY_BUCKETS - 1) bucket++;
+	h = &t->latency[stage];
+	h->count++;
+	h->total += usec;
+	if (usec > h->max) h->max = usec;
+	h->bucket[bucket]++;
+}
+
+// record latency of the report the output thread just wrote
+void TeensyControls_written_latency(teensy_t *t)
+{
+	uint64_t now;
+
+	if (!t->output_fetch_changed) return;
+	now = TeensyControls_usec();
+	TeensyControls_latency(t, LATENCY_OUTPUT_USB, t->output_fetch_queued, now);
+	TeensyControls_latency(t, LATENCY_OUTPUT_TOTAL, t->output_fetch_changed, now);
+}
+
+// upper bound of the bucket holding the given percentile, in msec
+static double latency_percentile(const latency_hist_t *h, int percent)
+{
+	uint64_t want, seen = 0;
+	int i;
+
+	want = ((uint64_t)h->count * percent + 99) / 100;
+	for (i = 0; i < LATENCY_BUCKETS - 1; i++) {
+		seen += h->bucket[i];
+		if (seen >= want) break;
+	}
+	return (double)((uint64_t)1 << (i + 1)) / 1000.0;
+}
+
+// called from input thread each time it wakes and reads count reports
+void TeensyControls_input_batch_stats(teensy_t *t, int count)
+{
+	int bucket = 0;
+
+	while ((count >> (bucket + 1)) > 0 && bucket < BATCH_BUCKETS - 1) bucket++;
+	t->input_wakeups++;
+	t->input_reports += count;
+	if ((uint32_t)count > t->input_batch_max) t->input_batch_max = count;
+	t->input_batch_hist[bucket]++;
+}
+
+// print counters for every Teensy, called from the main thread on demand
+void TeensyControls_print_stats(void)
+{
+	teensy_t *t;
+	int i, n = 0;
+
+	for (t = TeensyControls_first_teensy; t; t = t->next, n++) {
+		printf("Teensy %d: %u reports in %u wakeups", n, t->input_reports, t->input_wakeups);
+		if (t->input_wakeups > 0) {
+			printf(" (%.2f per wakeup, max %u)", (double)t->input_reports / t->input_wakeups,
+				t->input_batch_max);
+		}
+		printf("\n  reports per wakeup:");
+		for (i = 0; i < BATCH_BUCKETS; i++) {
+			printf(" %s=%u", batch_labels[i], t->input_batch_hist[i]);
+		}
+		printf("\n  %u reports sent, %u frames deferred by a full output queue\n",
+			t->output_reports, t->output_deferred);
+		printf("  %u values sent", t->output_values);
+		if (t->output_reports > 0) {
+			printf(" (%.1f per report)", (double)t->output_values / t->output_reports);
+		}
+		printf(", multi write %s\n", (t->output_caps & OUTPUT_CAP_MULTI_WRITE) ? "on" : "off");
+		printf("  %u sim changes held back by a deadband or rate limit\n", t->output_suppressed);
+		if (t->output_rate) {
+			printf("  %u frames held back by the budget of %u reports a second\n",
+				t->output_throttled, t->output_rate);
+		}
+		if (t->plug_time) {
+			printf("  plugged in: probed after %.1f ms", (t->found_time - t->plug_time) / 1000.0);
+			if (t->first_input_time) {
+				printf(", first data after %.1f ms", (t->first_input_time - t->plug_time) / 1000.0);
+			}
+			printf("\n");
+		}
+		for (i = 0; i < LATENCY_STAGES; i++) {
+			const latency_hist_t *h = &t->latency[i];
+			if (h->count == 0) continue;
+			printf("  %-21s %7u  mean %7.3f  p50 <%7.3f  p99 <%7.3f  max %7.3f ms\n",
+				latency_labels[i], h->count, (double)h->total / h->count / 1000.0,
+				latency_percentile(h, 50), latency_percentile(h, 99),
+				(double)h->max / 1000.0);
+		}
+	}
+	if (n == 0) {
+		printf("No Teensy connected\n");
+	}
+}
@@ -200,6 +200,8 @@ static void output_thread(void *arg)
 			if (ret) {
 				printf("WriteFile success\n");
 				t->usb.error_count = 0;
+				t->output_reports++;
+				TeensyControls_written_latency(t);
 			} else {
 				n = GetLastError();
 				if (n == ERROR_IO_PENDING) {
@@ -207,6 +209,8 @@ static void output_thread(void *arg)
 						&(t->usb.tx_ov), &n, TRUE);
 					if (ret) {
 						t->usb.error_count = 0;
+						t->output_reports++;
+						TeensyControls_written_latency(t);
 						//printf("WriteFile: GetOverlappedResult success, n=%ld\n", n);
 					} else {
 						printf("WriteFile: GetOverlappedResult failed: %d\n",
@@ -220,16 +224,7 @@ static void output_thread(void *arg)
 			}
 		} else {
 			//printf("output_thread, no data\n");
-			pthread_mutex_lock(&t->output_mutex);
-			if (t->output_head == t->output_tail) {
-				//printf("output_thread, begin wait\n");
-				t->output_thread_waiting = 1;
-				pthread_cond_wait_timeout(&t->output_event,
-					&t->output_mutex, 1000);
-				t->output_thread_waiting = 0;
-				//printf("output_thread, r: %d, errno: %d\n", r, errno);
-			}
-			pthread_mutex_unlock(&t->output_mutex);
+			TeensyControls_output_wait(t, 1000);
 		}
 	}
 	t->output_thread_quit = 1;
@@ -279,106 +274,7 @@ void TeensyControls_usb_close(void)
 
 #else	// LINUX
 
-static void input_thread(void* arg)
-{
-	teensy_t* t = (teensy_t*)arg;
-	fd_set rfds, efds;
-	uint8_t buf[64];
-	int fd, n, r;
-
-	//printf("input_thread begin\n");
-	fd = t->usb.fd;
-	while (t->online) {
-		//printf("input_thread\n");
-		FD_ZERO(&rfds);
-		FD_ZERO(&efds);
-		FD_SET(fd, &rfds);
-		FD_SET(fd, &efds);
-		r = select(fd + 1, &rfds, NULL, &efds, NULL);
-		if (r > 0 && FD_ISSET(fd, &rfds)) {
-			n = read(fd, buf, 64);
-			if (n == 64) {
-				TeensyControls_input_store(t, buf);
-				t->usb.error_count = 0;
-			}
-			else {
-				printf("read error, n = %d, errno = %d", n, errno);
-				printf(", count = %d\n", t->usb.error_count);
-				if (n < 0 && (errno == EAGAIN || errno == EINTR)) continue;
-				if (n < 0 && errno == ENODEV) {
-					t->online = 0;
-				}
-				else {
-					if (++t->usb.error_count > 8) t->online = 0;
-				}
-			}
-		}
-		else {
-			printf("input: select, r = %d", r);
-			if (++t->usb.error_count > 8) t->online = 0;
-		}
-	}
-	t->input_thread_quit = 1;
-	//printf("input_thread end\n");
-}
-
-static void output_thread(void* arg)
-{
-	teensy_t* t = (teensy_t*)arg;
-	struct timespec ts;
-	uint8_t buf[65];
-	int n;
-
-	//printf("output_thread begin\n");
-	while (t->online) {
-		//printf("output_thread\n");
-		if (TeensyControls_output_fetch(t, buf + 1) && t->online) {
-			//printf("output_thread: send\n");
-		tryagain:
-			buf[0] = 0;
-			n = write(t->usb.fd, buf, 65);
-			if (n == 65) {
-				t->usb.error_count = 0;
-			}
-			else {
-				printf("write error, n=%d, errno=%d\n", n, errno);
-				if (n < 0 && errno == EINTR) {
-					usleep(5000);
-					if (++t->usb.error_count < 20) {
-						goto tryagain;
-					}
-				}
-				else if (n < 0 && errno == ENODEV) {
-					t->online = 0;
-				}
-				else {
-					if (++t->usb.error_count > 8) {
-						t->online = 0;
-					}
-				}
-			}
-		}
-		else {
-			//printf("output_thread, no data\n");
-			pthread_mutex_lock(&t->output_mutex);
-			if (t->output_head == t->output_tail) {
-				clock_gettime(CLOCK_REALTIME, &ts);
-				ts.tv_sec += 1;
-				t->output_thread_waiting = 1;
-				//gettimeofday(&tv, NULL);
-				//ts.tv_sec = tv.tv_sec;
-				//ts.tv_nsec = tv.tv_usec*1000;
-				pthread_cond_timedwait(&t->output_event,
-					&t->output_mutex, &ts);
-				t->output_thread_waiting = 0;
-				//printf("output_thread, r: %d, errno: %d\n", r, errno);
-			}
-			pthread_mutex_unlock(&t->output_mutex);
-		}
-	}
-	t->output_thread_quit = 1;
-	//printf("output_thread end\n");
-}
+// reading and writing the devices found here is in usbio.cpp
 
 // using libudev to monitor for device changes
 // http://www.signal11.us/oss/udev/
@@ -387,13 +283,23 @@ static struct udev* udev = NULL;
 static struct udev_monitor* mon = NULL;
 static int monfd = -1;
 
+// Devices are found and probed on the hotplug thread, then wait here
+// until the main thread adds them to the list of Teensys, which only
+// the main thread changes.
+static pthread_mutex_t pending_mutex = PTHREAD_MUTEX_INITIALIZER;
+static teensy_t* pending = NULL;
+static volatile int hotplug_quit = 0;
+static volatile int hotplug_alive = 0;
+
+// plug_time is when udev first saw the device, or 0 if it was already
+// present at startup
 //static void new_usb_device(struct udev_device *dev) __attribute__((noinline));
-static void new_usb_device(struct udev_device* dev)
+static void new_usb_device(struct udev_device* dev, uint64_t plug_time)
 {
 	struct udev_device* usb;
 	const char* str, * devname;
 	int vid = 0, pid = 0, is_teensy = 0;
-	teensy_t* t;
+	teensy_t* t, * p;
 	int r, len, fd = -1;
 	const uint8_t signature[6] = { 0x06,0x1C,0xFF,0x0A,0x39,0xA7 };
 	struct hidraw_devinfo info;
@@ -406,14 +312,24 @@ static void new_usb_device(struct udev_device* dev)
 	devname = udev_device_get_devnode(dev);
 	if (!devname) goto fail;
 	usb = udev_device_get_parent_with_subsystem_devtype(dev, "usb", "usb_device");
-	if (!usb) goto fail;
-	str = udev_device_get_sysattr_value(usb, "idVendor");
-	if (!str || sscanf(str, "%x", &vid) != 1) vid = 0;
-	str = udev_device_get_sysattr_value(usb, "idProduct");
-	if (!str || sscanf(str, "%x", &pid) != 1) pid = 0;
-	str = udev_device_get_sysattr_value(usb, "product");
-	if (str && strstr(str, "Teensy")) is_teensy = 1;
-	//udev_device_unref(usb); // this does NOT need to be unref'd
+	if (usb) {
+		str = udev_device_get_sysattr_value(usb, "idVendor");
+		if (!str || sscanf(str, "%x", &vid) != 1) vid = 0;
+		str = udev_device_get_sysattr_value(usb, "idProduct");
+		if (!str || sscanf(str, "%x", &pid) != 1) pid = 0;
+		str = udev_device_get_sysattr_value(usb, "product");
+		if (str && strstr(str, "Teensy")) is_teensy = 1;
+		//udev_device_unref(usb); // this does NOT need to be unref'd
+	} else {
+		// a uhid device, like teensy-virtual, has no USB parent so
+		// its ids and name come from the HID device, HID_ID=bus:vid:pid
+		usb = udev_device_get_parent_with_subsystem_devtype(dev, "hid", NULL);
+		if (!usb) goto fail;
+		str = udev_device_get_property_value(usb, "HID_ID");
+		if (!str || sscanf(str, "%*x:%x:%x", &vid, &pid) != 2) vid = pid = 0;
+		str = udev_device_get_property_value(usb, "HID_NAME");
+		if (str && strstr(str, "Teensy")) is_teensy = 1;
+	}
 	if (!is_teensy) goto fail;
 	if (vid != 0x16C0) goto fail;
 	if (pid != 0x0488) goto fail;
@@ -444,14 +360,24 @@ static void new_usb_device(struct udev_device* dev)
 	if (r < 0) goto fail;
 	if (memcmp(desc.value, signature, sizeof(signature)) != 0) goto fail;
 	//printf("Teensy descriptors confirmed\n");
-	t = TeensyControls_new_teensy();
+	t = TeensyControls_alloc_teensy();
 	if (!t) goto fail;
 	printf("Found Teensy %s\n", devname);
 	//printf("Teensy success\n");
 	t->usb.fd = fd;
 	t->usb.error_count = 0;
-	if (!thread_start(input_thread, t)) t->input_thread_quit = 1;
-	if (!thread_start(output_thread, t)) t->output_thread_quit = 1;
+	t->plug_time = plug_time;
+	t->found_time = TeensyControls_usec();
+	TeensyControls_usb_start_io(t);
+	pthread_mutex_lock(&pending_mutex);
+	if (pending == NULL) {
+		pending = t;
+	} else {
+		for (p = pending; p->next; p = p->next) ;
+		p->next = t;
+	}
+	pthread_mutex_unlock(&pending_mutex);
+	TeensyControls_usb_wake();
 	return;
 fail:
 	//printf("Teensy fail\n");
@@ -459,62 +385,108 @@ fail:
 	return;
 }
 
-void TeensyControls_find_new_usb_devices(void)
+// probe the devices already present
+static void enumerate_devices(void)
 {
-	fd_set fds;
-	struct timeval tv;
 	struct udev_device* dev;
-	const char* name, * action;
-	static unsigned int count = 0, first = 1;
 	struct udev_enumerate* enumerate;
 	struct udev_list_entry* devices, * dev_list_entry;
 	const char* path;
-	int r;
 
-	if (first) {
-		// set up monitoring
-		//printf("TeensyControls_usb_init: set up udev monitoring\n");
-		mon = udev_monitor_new_from_netlink(udev, "udev");
-		udev_monitor_filter_add_match_subsystem_devtype(mon, "hidraw", NULL);
-		udev_monitor_enable_receiving(mon);
-		monfd = udev_monitor_get_fd(mon);
-		// enumerate all currently attached devices
-		//printf("TeensyControls_usb_init: udev enumerate devices\n");
-		enumerate = udev_enumerate_new(udev);
-		udev_enumerate_add_match_subsystem(enumerate, "hidraw");
-		udev_enumerate_scan_devices(enumerate);
-		devices = udev_enumerate_get_list_entry(enumerate);
-		udev_list_entry_foreach(dev_list_entry, devices) {
-			path = udev_list_entry_get_name(dev_list_entry);
-			//printf("path: %s\n", path);
-			dev = udev_device_new_from_syspath(udev, path);
-			if (dev) {
-				new_usb_device(dev);
-				udev_device_unref(dev);
-			}
+	//printf("udev enumerate devices\n");
+	enumerate = udev_enumerate_new(udev);
+	udev_enumerate_add_match_subsystem(enumerate, "hidraw");
+	udev_enumerate_scan_devices(enumerate);
+	devices = udev_enumerate_get_list_entry(enumerate);
+	udev_list_entry_foreach(dev_list_entry, devices) {
+		path = udev_list_entry_get_name(dev_list_entry);
+		//printf("path: %s\n", path);
+		dev = udev_device_new_from_syspath(udev, path);
+		if (dev) {
+			new_usb_device(dev, 0);
+			udev_device_unref(dev);
 		}
-		udev_enumerate_unref(enumerate);
-		first = 0;
 	}
-	if (++count < 8) return; // only check every 8 frames
-	count = 0;
-	FD_ZERO(&fds);
-	FD_SET(monfd, &fds);
-	tv.tv_sec = 0;
-	tv.tv_usec = 0;
-	r = select(monfd + 1, &fds, NULL, NULL, &tv);
-	if (r > 0 && FD_ISSET(monfd, &fds)) {
-		dev = udev_monitor_receive_device(mon);
-		if (dev) {
+	udev_enumerate_unref(enumerate);
+}
+
+// enumerate devices present at startup, then handle every udev event
+// as it arrives, so several boards powering up together are all found
+// at once and probing them never holds up the main loop. Without a
+// monitor only the startup devices are found.
+static void hotplug_thread(void* arg)
+{
+	struct udev_device* dev;
+	struct pollfd pfd;
+	const char* name, * action;
+	uint64_t plug_time;
+
+	enumerate_devices();
+
+	while (!hotplug_quit && monfd >= 0) {
+		pfd.fd = monfd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		// wake now and then to see if we should quit
+		if (poll(&pfd, 1, 200) <= 0) continue;
+		// the monitor socket is non-blocking, so this drains every event
+		while ((dev = udev_monitor_receive_device(mon)) != NULL) {
 			name = udev_device_get_devnode(dev);
 			action = udev_device_get_action(dev);
 			printf("%s device %s\n", action, name);
-			if (strcmp(action, "add") == 0) {
-				new_usb_device(dev);
+			if (action && strcmp(action, "add") == 0) {
+				plug_time = TeensyControls_usec() - udev_device_get_usec_since_initialized(dev);
+				new_usb_device(dev, plug_time);
 			}
 			udev_device_unref(dev);
 		}
 	}
+	hotplug_alive = 0;
+}
+
+// add devices the hotplug thread has found to the list of Teensys
+static void add_pending_devices(void)
+{
+	teensy_t* t, * next;
+
+	pthread_mutex_lock(&pending_mutex);
+	t = pending;
+	pending = NULL;
+	pthread_mutex_unlock(&pending_mutex);
+	for (; t; t = next) {
+		next = t->next;
+		TeensyControls_add_teensy(t);
+	}
+}
+
+// start the hotplug thread on the first call, then add any devices it
+// has found since the last call. Cheap enough to call on every wakeup.
+void TeensyControls_find_new_usb_devices(void)
+{
+	static int first = 1;
+
+	if (first) {
+		first = 0;
+		// set up monitoring before enumerating, so no device is missed
+		//printf("TeensyControls_usb_init: set up udev monitoring\n");
+		mon = udev_monitor_new_from_netlink(udev, "udev");
+		if (mon) {
+			udev_monitor_filter_add_match_subsystem_devtype(mon, "hidraw", NULL);
+			udev_monitor_enable_receiving(mon);
+			monfd = udev_monitor_get_fd(mon);
+		}
+		if (monfd < 0) {
+			printf("Unable to monitor udev, Teensys plugged in later will not be found\n");
+		}
+		hotplug_alive = 1;
+		if (!thread_start(hotplug_thread, NULL)) {
+			// still find the Teensys already plugged in
+			hotplug_alive = 0;
+			printf("Unable to start the hotplug thread\n");
+			enumerate_devices();
+		}
+	}
+	add_pending_devices();
 }
 
 int TeensyControls_usb_init(void)
@@ -532,6 +504,14 @@ void TeensyControls_usb_close(void)
 	teensy_t* t;
 	int wait = 0;
 
+	// stop finding devices, then close all of them
+	hotplug_quit = 1;
+	while (++wait < 50 && hotplug_alive) {
+		usleep(10000);
+	}
+	add_pending_devices();
+	TeensyControls_usb_stop_io();
+	wait = 0;
 	for (t = TeensyControls_first_teensy; t; t = t->next) {
 		if (t->online) {
 			printf("attempt to end any pending USB device I/O\n");
@@ -0,0 +1,382 @@
+#include "TeensyControls.h"
+
+// Reading and writing hidraw devices on Linux. usb.cpp finds the Teensys
+// and hands each one to TeensyControls_usb_start_io, which services it
+// in one of two ways, chosen by TEENSY_USB_IO:
+//   threads  an input thread and an output thread for every Teensy
+//   reactor  one thread for all of them, waiting on every fd with epoll
+// Threads is the default. hidraw writes wait for the USB transfer even
+// on a non-blocking fd, so the reactor writes one report per Teensy in
+// turn and a slow board holds up the rest for that long.
+
+#ifndef _WIN32
+
+#include <sys/epoll.h>
+
+#define REACTOR_MAX 64		// Teensys one reactor thread will take
+
+// eventfd signalled by the input threads whenever new data is stored,
+// so the main loop can wait on it rather than polling
+static int wakefd = -1;
+
+int TeensyControls_usb_wake_fd(void)
+{
+	if (wakefd < 0) {
+		wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	}
+	return wakefd;
+}
+
+void TeensyControls_usb_wake(void)
+{
+	uint64_t one = 1;
+
+	if (wakefd >= 0) {
+		write(wakefd, &one, sizeof(one));
+	}
+}
+
+static void store_batch(teensy_t* t, const uint8_t* buf, int count, uint64_t usec)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		TeensyControls_capture(t, CAPTURE_INPUT, buf + i * 64, usec);
+	}
+	TeensyControls_input_store_batch(t, buf, count, usec);
+	TeensyControls_usb_wake();
+}
+
+// read every pending report from a non-blocking fd, storing them in batches
+static void read_reports(teensy_t* t)
+{
+	uint8_t buf[64 * INPUT_BATCH];
+	uint64_t usec;
+	int n, count = 0, total = 0;
+
+	usec = TeensyControls_usec();
+	while (t->online) {
+		n = read(t->usb.fd, buf + count * 64, 64);
+		if (n == 64) {
+			t->usb.error_count = 0;
+			if (++count == INPUT_BATCH) {
+				store_batch(t, buf, count, usec);
+				total += count;
+				count = 0;
+			}
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+		if (n < 0 && errno == EINTR) continue;
+		printf("read error, n = %d, errno = %d", n, errno);
+		printf(", count = %d\n", t->usb.error_count);
+		if (n < 0 && errno == ENODEV) {
+			t->online = 0;
+		}
+		else {
+			if (++t->usb.error_count > 8) t->online = 0;
+		}
+		break;
+	}
+	if (count > 0) {
+		store_batch(t, buf, count, usec);
+		total += count;
+	}
+	if (total > 0) {
+		TeensyControls_input_batch_stats(t, total);
+		if (t->first_input_time == 0) {
+			t->first_input_time = usec;
+			if (t->plug_time) {
+				printf("Teensy first data %.1f ms after plug-in\n",
+					(usec - t->plug_time) / 1000.0);
+			}
+		}
+	}
+}
+
+// write one report, buf[0] is the report number. Returns 1 when written,
+// 0 to try again later, -1 if the report was dropped. retries belongs to
+// the writer and counts EINTR and EAGAIN for this report only, so reads
+// resetting error_count can't keep a report retrying for ever.
+static int write_report(teensy_t* t, uint8_t* buf, int* retries)
+{
+	int n;
+
+	buf[0] = 0;
+	n = write(t->usb.fd, buf, 65);
+	if (n == 65) {
+		*retries = 0;
+		t->usb.error_count = 0;
+		t->output_reports++;
+		TeensyControls_written_latency(t);
+		TeensyControls_capture(t, CAPTURE_OUTPUT, buf + 1, TeensyControls_usec());
+		return 1;
+	}
+	if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+		// only said once the retries run out
+		if (++*retries < 20) return 0;
+		*retries = 0;
+		printf("write error, n=%d, errno=%d, report dropped\n", n, errno);
+		return -1;
+	}
+	*retries = 0;
+	printf("write error, n=%d, errno=%d\n", n, errno);
+	if (n < 0 && errno == ENODEV) {
+		t->online = 0;
+	}
+	else {
+		if (++t->usb.error_count > 8) {
+			t->online = 0;
+		}
+	}
+	return -1;
+}
+
+static void input_thread(void* arg)
+{
+	teensy_t* t = (teensy_t*)arg;
+	fd_set rfds, efds;
+	int fd, r;
+
+	//printf("input_thread begin\n");
+	fd = t->usb.fd;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	while (t->online) {
+		//printf("input_thread\n");
+		FD_ZERO(&rfds);
+		FD_ZERO(&efds);
+		FD_SET(fd, &rfds);
+		FD_SET(fd, &efds);
+		r = select(fd + 1, &rfds, NULL, &efds, NULL);
+		if (r > 0 && FD_ISSET(fd, &rfds)) {
+			read_reports(t);
+		}
+		else {
+			printf("input: select, r = %d", r);
+			if (++t->usb.error_count > 8) t->online = 0;
+		}
+	}
+	t->input_thread_quit = 1;
+	//printf("input_thread end\n");
+}
+
+static void output_thread(void* arg)
+{
+	teensy_t* t = (teensy_t*)arg;
+	uint8_t buf[65];
+	int retries = 0;
+
+	//printf("output_thread begin\n");
+	while (t->online) {
+		//printf("output_thread\n");
+		if (TeensyControls_output_fetch(t, buf + 1) && t->online) {
+			//printf("output_thread: send\n");
+			while (write_report(t, buf, &retries) == 0) {
+				usleep(5000);
+			}
+		}
+		else {
+			//printf("output_thread, no data\n");
+			TeensyControls_output_wait(t, 1000);
+		}
+	}
+	t->output_thread_quit = 1;
+	//printf("output_thread end\n");
+}
+
+// The reactor owns the Teensys handed to it until they go offline, then
+// sets both quit flags so the main thread may free them. A report fetched
+// from the output ring but not yet written waits in out.
+typedef struct {
+	teensy_t *t;
+	uint8_t out[65];
+	int out_ready;
+	int retries;		// for the report in out, see write_report
+} reactor_device_t;
+
+static pthread_mutex_t reactor_mutex = PTHREAD_MUTEX_INITIALIZER;
+static reactor_device_t reactor_device[REACTOR_MAX];
+static int reactor_count = 0;
+static int reactor_epfd = -1;
+static int reactor_eventfd = -1;	// output queued, or time to quit
+static volatile int reactor_quit = 0;
+static volatile int reactor_alive = 0;
+
+// write at most one report per Teensy, so one with a full ring doesn't
+// keep the others waiting
+static void reactor_write(void)
+{
+	reactor_device_t *d;
+	int i;
+
+	for (i = 0; i < reactor_count; i++) {
+		d = &reactor_device[i];
+		if (!d->t->online) continue;
+		if (!d->out_ready) {
+			d->out_ready = TeensyControls_output_fetch(d->t, d->out + 1);
+		}
+		if (!d->out_ready) continue;
+		if (write_report(d->t, d->out, &d->retries) != 0) d->out_ready = 0;
+	}
+}
+
+// offline Teensys are handed back to the main thread
+static void reactor_remove_offline(void)
+{
+	teensy_t *t;
+	int i;
+
+	for (i = 0; i < reactor_count; ) {
+		t = reactor_device[i].t;
+		if (t->online && !reactor_quit) {
+			i++;
+			continue;
+		}
+		epoll_ctl(reactor_epfd, EPOLL_CTL_DEL, t->usb.fd, NULL);
+		t->output_wake_fd = -1;
+		reactor_device[i] = reactor_device[--reactor_count];
+		t->input_thread_quit = 1;
+		t->output_thread_quit = 1;
+	}
+}
+
+static void reactor_thread(void* arg)
+{
+	struct epoll_event events[REACTOR_MAX + 1];
+	reactor_device_t *d;
+	teensy_t *t;
+	uint64_t count;
+	int i, n, timeout;
+
+	//printf("reactor_thread begin\n");
+	while (!reactor_quit) {
+		pthread_mutex_lock(&reactor_mutex);
+		reactor_write();
+		// output_store signals reactor_eventfd once these are set, so
+		// head is checked again with a seq_cst load, as in output_wait.
+		// A Teensy holding a write to try again waits as the output thread
+		// would, whatever is queued behind it.
+		timeout = 1000;
+		for (i = 0; i < reactor_count; i++) {
+			d = &reactor_device[i];
+			d->t->output_thread_waiting.store(1);
+			if (d->out_ready) {
+				if (timeout > 5) timeout = 5;
+			} else if (d->t->output_head.load() != d->t->output_tail.load(std::memory_order_relaxed)) {
+				timeout = 0;
+			}
+		}
+		pthread_mutex_unlock(&reactor_mutex);
+
+		n = epoll_wait(reactor_epfd, events, REACTOR_MAX + 1, timeout);
+
+		pthread_mutex_lock(&reactor_mutex);
+		for (i = 0; i < reactor_count; i++) {
+			reactor_device[i].t->output_thread_waiting.store(0);
+		}
+		for (i = 0; i < n; i++) {
+			t = (teensy_t *)events[i].data.ptr;
+			if (!t) {
+				read(reactor_eventfd, &count, sizeof(count));
+			} else if (events[i].events & EPOLLIN) {
+				read_reports(t);
+			} else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+				printf("input: epoll, events = %x\n", events[i].events);
+				t->online = 0;
+			}
+		}
+		reactor_remove_offline();
+		pthread_mutex_unlock(&reactor_mutex);
+	}
+	pthread_mutex_lock(&reactor_mutex);
+	reactor_remove_offline();
+	pthread_mutex_unlock(&reactor_mutex);
+	reactor_alive = 0;
+	//printf("reactor_thread end\n");
+}
+
+// add a Teensy to the reactor, starting it on the first one
+static int reactor_add(teensy_t* t)
+{
+	struct epoll_event ev;
+	uint64_t one = 1;
+	int r = 0;
+
+	pthread_mutex_lock(&reactor_mutex);
+	if (reactor_epfd < 0) {
+		reactor_epfd = epoll_create1(EPOLL_CLOEXEC);
+		reactor_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		epoll_ctl(reactor_epfd, EPOLL_CTL_ADD, reactor_eventfd, &ev);
+	}
+	if (!reactor_alive) {
+		reactor_quit = 0;
+		reactor_alive = 1;
+		if (!thread_start(reactor_thread, NULL)) reactor_alive = 0;
+	}
+	if (reactor_alive && reactor_count < REACTOR_MAX) {
+		fcntl(t->usb.fd, F_SETFL, fcntl(t->usb.fd, F_GETFL) | O_NONBLOCK);
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = t;
+		if (epoll_ctl(reactor_epfd, EPOLL_CTL_ADD, t->usb.fd, &ev) == 0) {
+			t->output_wake_fd = reactor_eventfd;
+			reactor_device[reactor_count].t = t;
+			reactor_device[reactor_count].out_ready = 0;
+			reactor_device[reactor_count].retries = 0;
+			reactor_count++;
+			r = 1;
+		}
+	}
+	pthread_mutex_unlock(&reactor_mutex);
+	if (r) {
+		// so its output is watched from the next pass
+		write(reactor_eventfd, &one, sizeof(one));
+	}
+	return r;
+}
+
+// start reading and writing a newly opened Teensy. Returns 0 if neither
+// way could be started, and the quit flags are set for what didn't start.
+int TeensyControls_usb_start_io(teensy_t* t)
+{
+	const char *mode = getenv("TEENSY_USB_IO");
+
+	if (mode && strcmp(mode, "reactor") == 0) {
+		if (reactor_add(t)) return 1;
+		printf("Unable to add Teensy to the reactor, using threads\n");
+	}
+	if (!thread_start(input_thread, t)) t->input_thread_quit = 1;
+	if (!thread_start(output_thread, t)) t->output_thread_quit = 1;
+	return !t->input_thread_quit || !t->output_thread_quit;
+}
+
+// stop the reactor, which hands back its Teensys, and close the wake fd.
+// Called before the Teensy fds are closed, so the reactor never uses one.
+void TeensyControls_usb_stop_io(void)
+{
+	uint64_t one = 1;
+	int wait = 0;
+
+	if (reactor_alive) {
+		reactor_quit = 1;
+		write(reactor_eventfd, &one, sizeof(one));
+		while (++wait < 50 && reactor_alive) {
+			usleep(10000);
+		}
+	}
+	if (!reactor_alive && reactor_epfd >= 0) {
+		close(reactor_epfd);
+		close(reactor_eventfd);
+		reactor_epfd = -1;
+		reactor_eventfd = -1;
+	}
+	if (wakefd >= 0) {
+		close(wakefd);
+		wakefd = -1;
+	}
+}
+
+#endif
@@ -0,0 +1,554 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <linux/uhid.h>
+
+// Virtual Teensys for testing the plugin with no hardware. Each one is a
+// /dev/uhid device with the Teensy ids, name and HID report descriptor, so
+// the plugin finds it through udev like a real board plugged in, and it
+// speaks the Flight Sim Controls protocol from the Teensy side.
+//
+//   teensy-virtual [options] [items file]
+//     -n <count>     virtual Teensys, default 1
+//     -r <rate>      input reports a second from each, default 50
+//     -w <writes>    value writes in each input report, default 4
+//     -t <seconds>   run time, default until Ctrl-C
+//     -p <seconds>   unplug and plug every Teensy back in this often
+//     -m             accept multi write (0x08) when the plugin offers it
+//
+// The items file has a line for each item: int, float or command then
+// its name, as a sketch would declare them. Needs write access to
+// /dev/uhid, which usually means running as root.
+
+const int MaxDevices = 16;
+const int MaxItems = 1000;
+
+// Teensy core usb_desc.c, flightsim_report_desc with 64 byte reports
+const uint8_t ReportDescriptor[] = {
+    0x06, 0x1C, 0xFF,   // Usage page = 0xFF1C
+    0x0A, 0x39, 0xA7,   // Usage = 0xA739
+    0xA1, 0x01,         // Collection 0x01
+    0x75, 0x08,         // report size = 8 bits
+    0x15, 0x00,         // logical minimum = 0
+    0x26, 0xFF, 0x00,   // logical maximum = 255
+    0x95, 64,           // report count
+    0x09, 0x01,         // usage
+    0x81, 0x02,         // Input (array)
+    0x95, 64,           // report count
+    0x09, 0x02,         // usage
+    0x91, 0x02,         // Output (array)
+    0xC0                // end collection
+};
+
+enum ItemType {
+    ItemCommand,
+    ItemInt,
+    ItemFloat
+};
+
+struct VirtualItem {
+    int type;
+    char name[256];
+    double value;       // latest value, from the plugin or made up here
+};
+
+struct VirtualTeensy {
+    int fd;
+    bool opened;        // the plugin has the hidraw device open
+    bool enabled;       // the plugin sent an enable message
+    bool multiWrite;
+    uint8_t report[64];
+    int pos;
+    int nextItem;
+    uint32_t reportsIn;
+    uint32_t reportsOut;
+    uint32_t valuesIn;
+    uint32_t enables;
+    uint32_t registrations;
+    uint32_t plugs;
+    VirtualItem items[MaxItems];
+};
+
+static volatile sig_atomic_t quit = 0;
+static VirtualTeensy devices[MaxDevices];
+static int deviceCount = 1;
+static VirtualItem itemList[MaxItems];
+static int itemCount = 0;
+static bool offerMulti = false;
+
+static uint64_t nowMicros()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void stopRequested(int signum)
+{
+    quit = 1;
+}
+
+static bool addItem(int type, const char* name)
+{
+    if (itemCount == MaxItems || strlen(name) > 200) {
+        return false;
+    }
+
+    itemList[itemCount].type = type;
+    strcpy(itemList[itemCount].name, name);
+    itemList[itemCount].value = 0;
+    itemCount++;
+    return true;
+}
+
+static bool loadItems(const char* filename)
+{
+    FILE* inf = fopen(filename, "r");
+    if (!inf) {
+        printf("Failed to open %s\n", filename);
+        return false;
+    }
+
+    char line[1024];
+    int lineNum = 0;
+    while (fgets(line, 1024, inf) != 0) {
+        lineNum++;
+
+        char* pos = strchr(line, '#');
+        if (pos) {
+            *pos = '\0';
+        }
+
+        char type[16];
+        char name[256];
+        int fields = sscanf(line, "%15s %255s", type, name);
+        if (fields <= 0) {
+            continue;
+        }
+
+        int itemType;
+        if (fields == 2 && strcmp(type, "int") == 0) {
+            itemType = ItemInt;
+        }
+        else if (fields == 2 && strcmp(type, "float") == 0) {
+            itemType = ItemFloat;
+        }
+        else if (fields == 2 && strcmp(type, "command") == 0) {
+            itemType = ItemCommand;
+        }
+        else {
+            printf("Error in items file: Line %d must be int, float or command then a name\n", lineNum);
+            fclose(inf);
+            return false;
+        }
+
+        if (!addItem(itemType, name)) {
+            printf("Error in items file: Line %d has too long a name or too many items\n", lineNum);
+            fclose(inf);
+            return false;
+        }
+    }
+
+    fclose(inf);
+    return true;
+}
+
+static bool sendEvent(VirtualTeensy* vt, struct uhid_event* ev)
+{
+    ssize_t n = write(vt->fd, ev, sizeof(*ev));
+    if (n != sizeof(*ev)) {
+        printf("Virtual Teensy %d: uhid write failed, errno = %d\n", (int)(vt - devices), errno);
+        return false;
+    }
+    return true;
+}
+
+static void flushReport(VirtualTeensy* vt)
+{
+    if (vt->pos == 0) {
+        return;
+    }
+
+    struct uhid_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = UHID_INPUT2;
+    ev.u.input2.size = 64;
+    memcpy(ev.u.input2.data, vt->report, 64);
+    if (sendEvent(vt, &ev)) {
+        vt->reportsOut++;
+    }
+    memset(vt->report, 0, 64);
+    vt->pos = 0;
+}
+
+// Packs messages into reports like the Teensy library: back to back, and
+// one too long for the rest of the report continued in 0xFF fragments
+static void sendMessage(VirtualTeensy* vt, const uint8_t* msg, int len)
+{
+    if (64 - vt->pos < 3 || (len <= 64 && vt->pos + len > 64)) {
+        flushReport(vt);
+    }
+
+    int part = len < 64 - vt->pos ? len : 64 - vt->pos;
+    memcpy(vt->report + vt->pos, msg, part);
+    vt->pos += part;
+
+    uint8_t fragmentId = 1;
+    while (part < len) {
+        flushReport(vt);
+        int chunk = len - part < 61 ? len - part : 61;
+        vt->report[0] = chunk + 3;
+        vt->report[1] = 0xFF;
+        vt->report[2] = fragmentId++;
+        memcpy(vt->report + 3, msg + part, chunk);
+        vt->pos = chunk + 3;
+        part += chunk;
+    }
+    if (vt->pos == 64) {
+        flushReport(vt);
+    }
+}
+
+static void sendRegistrations(VirtualTeensy* vt)
+{
+    uint8_t msg[256];
+
+    for (int id = 0; id < itemCount; id++) {
+        int len = strlen(vt->items[id].name);
+        msg[0] = len + 6;
+        msg[1] = 1;
+        msg[2] = id & 255;
+        msg[3] = id >> 8;
+        msg[4] = vt->items[id].type;
+        msg[5] = 0;
+        memcpy(msg + 6, vt->items[id].name, len);
+        sendMessage(vt, msg, len + 6);
+        vt->registrations++;
+    }
+    flushReport(vt);
+}
+
+static void receiveValue(VirtualTeensy* vt, int id, int type, const uint8_t* bytes)
+{
+    int32_t value = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (bytes[3] << 24);
+
+    vt->valuesIn++;
+    if (id >= itemCount) {
+        return;
+    }
+    if (type == ItemInt) {
+        vt->items[id].value = value;
+    }
+    else if (type == ItemFloat) {
+        float f;
+        memcpy(&f, &value, 4);
+        vt->items[id].value = f;
+    }
+}
+
+// A report from the plugin, as the Teensy library decodes it
+static void receiveReport(VirtualTeensy* vt, const uint8_t* report)
+{
+    vt->reportsIn++;
+    for (int i = 0; i < 64 && report[i] >= 2 && i + report[i] <= 64; i += report[i]) {
+        const uint8_t* msg = report + i;
+        if (msg[1] == 3 && msg[0] >= 4) {
+            vt->enables++;
+            if (msg[2] == 1) {
+                vt->enabled = true;
+                if (offerMulti && (msg[3] & 1)) {
+                    uint8_t reply[4] = { 4, 7, 1, 0 };
+                    sendMessage(vt, reply, 4);
+                    vt->multiWrite = true;
+                }
+                sendRegistrations(vt);
+            }
+            else if (msg[2] == 2) {
+                vt->enabled = true;
+            }
+            else if (msg[2] == 3) {
+                vt->enabled = false;
+            }
+        }
+        else if (msg[1] == 2 && msg[0] >= 10) {
+            receiveValue(vt, msg[2] | (msg[3] << 8), msg[4], msg + 6);
+        }
+        else if (msg[1] == 8 && vt->multiWrite && msg[0] == 4 + 6 * msg[3]) {
+            for (int n = 0; n < msg[3]; n++) {
+                const uint8_t* v = msg + 4 + 6 * n;
+                receiveValue(vt, v[0] | (v[1] << 8), msg[2], v + 2);
+            }
+        }
+    }
+}
+
+// One input report of value writes and command presses, taking the items
+// in turn like a panel of knobs and switches that are always moving
+static void sendInput(VirtualTeensy* vt, int writes)
+{
+    uint8_t msg[10];
+
+    for (int n = 0; n < writes && itemCount > 0; n++) {
+        int id = vt->nextItem;
+        vt->nextItem = (vt->nextItem + 1) % itemCount;
+        VirtualItem* item = &vt->items[id];
+
+        msg[2] = id & 255;
+        msg[3] = id >> 8;
+        if (item->type == ItemCommand) {
+            msg[0] = 4;
+            msg[1] = 6;     // command once
+            sendMessage(vt, msg, 4);
+            continue;
+        }
+
+        int32_t value;
+        if (item->type == ItemInt) {
+            item->value += 1;
+            value = (int32_t)item->value;
+        }
+        else {
+            item->value += 0.5;
+            float f = item->value;
+            memcpy(&value, &f, 4);
+        }
+        msg[0] = 10;
+        msg[1] = 2;
+        msg[4] = item->type;
+        msg[5] = 0;
+        memcpy(msg + 6, &value, 4);
+        sendMessage(vt, msg, 10);
+    }
+    flushReport(vt);
+}
+
+static bool plugIn(VirtualTeensy* vt, int num)
+{
+    vt->fd = open("/dev/uhid", O_RDWR | O_CLOEXEC | O_NONBLOCK);
+    if (vt->fd < 0) {
+        printf("Unable to open /dev/uhid, errno = %d\n", errno);
+        return false;
+    }
+
+    struct uhid_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = UHID_CREATE2;
+    snprintf((char*)ev.u.create2.name, sizeof(ev.u.create2.name), "Teensyduino Teensy Flight Sim Controls");
+    snprintf((char*)ev.u.create2.phys, sizeof(ev.u.create2.phys), "teensy-virtual/%d", num);
+    snprintf((char*)ev.u.create2.uniq, sizeof(ev.u.create2.uniq), "virtual%d", num);
+    memcpy(ev.u.create2.rd_data, ReportDescriptor, sizeof(ReportDescriptor));
+    ev.u.create2.rd_size = sizeof(ReportDescriptor);
+    ev.u.create2.bus = BUS_USB;
+    ev.u.create2.vendor = 0x16C0;
+    ev.u.create2.product = 0x0488;
+    ev.u.create2.version = 0x0100;
+    if (!sendEvent(vt, &ev)) {
+        close(vt->fd);
+        vt->fd = -1;
+        return false;
+    }
+
+    vt->opened = false;
+    vt->enabled = false;
+    vt->multiWrite = false;
+    vt->pos = 0;
+    memset(vt->report, 0, 64);
+    vt->plugs++;
+    return true;
+}
+
+static void unplug(VirtualTeensy* vt)
+{
+    if (vt->fd < 0) {
+        return;
+    }
+
+    struct uhid_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = UHID_DESTROY;
+    sendEvent(vt, &ev);
+    close(vt->fd);
+    vt->fd = -1;
+}
+
+static void readEvents(VirtualTeensy* vt)
+{
+    struct uhid_event ev;
+
+    while (read(vt->fd, &ev, sizeof(ev)) > 0) {
+        switch (ev.type) {
+        case UHID_OPEN:
+            vt->opened = true;
+            break;
+
+        case UHID_CLOSE:
+            vt->opened = false;
+            vt->enabled = false;
+            break;
+
+        case UHID_OUTPUT:
+            // hidraw passes on the report number, 0, ahead of the report
+            if (ev.u.output.size == 65 && ev.u.output.data[0] == 0) {
+                receiveReport(vt, ev.u.output.data + 1);
+            }
+            else if (ev.u.output.size == 64) {
+                receiveReport(vt, ev.u.output.data);
+            }
+            break;
+
+        case UHID_GET_REPORT: {
+            struct uhid_event reply;
+            memset(&reply, 0, sizeof(reply));
+            reply.type = UHID_GET_REPORT_REPLY;
+            reply.u.get_report_reply.id = ev.u.get_report.id;
+            reply.u.get_report_reply.err = EIO;
+            sendEvent(vt, &reply);
+            break;
+        }
+
+        case UHID_SET_REPORT: {
+            struct uhid_event reply;
+            memset(&reply, 0, sizeof(reply));
+            reply.type = UHID_SET_REPORT_REPLY;
+            reply.u.set_report_reply.id = ev.u.set_report.id;
+            reply.u.set_report_reply.err = EIO;
+            sendEvent(vt, &reply);
+            break;
+        }
+        }
+    }
+}
+
+static void printStats(double seconds)
+{
+    for (int i = 0; i < deviceCount; i++) {
+        VirtualTeensy* vt = &devices[i];
+        printf("Virtual Teensy %d: plugged in %u times, %u enables, %u items registered%s\n", i,
+            vt->plugs, vt->enables, vt->registrations, vt->multiWrite ? ", multi write" : "");
+        printf("  %u reports sent (%.0f a second), %u reports received with %u values\n",
+            vt->reportsOut, vt->reportsOut / seconds, vt->reportsIn, vt->valuesIn);
+    }
+}
+
+static void usage()
+{
+    printf("Usage: teensy-virtual [-n count] [-r rate] [-w writes] [-t seconds] [-p seconds] [-m] [items file]\n");
+    printf("  -n <count>     virtual Teensys, default 1\n");
+    printf("  -r <rate>      input reports a second from each, default 50\n");
+    printf("  -w <writes>    value writes in each input report, default 4\n");
+    printf("  -t <seconds>   run time, default until Ctrl-C\n");
+    printf("  -p <seconds>   unplug and plug every Teensy back in this often\n");
+    printf("  -m             accept multi write when the plugin offers it\n");
+}
+
+int main(int argc, char* argv[])
+{
+    double rate = 50;
+    int writes = 4;
+    double runSeconds = 0;
+    double replugSeconds = 0;
+    const char* itemsFile = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:w:t:p:m")) != -1) {
+        switch (opt) {
+        case 'n': deviceCount = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'w': writes = atoi(optarg); break;
+        case 't': runSeconds = atof(optarg); break;
+        case 'p': replugSeconds = atof(optarg); break;
+        case 'm': offerMulti = true; break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (optind < argc) {
+        itemsFile = argv[optind];
+    }
+    if (deviceCount < 1 || deviceCount > MaxDevices || rate < 0 || writes < 0) {
+        usage();
+        return 1;
+    }
+
+    if (itemsFile) {
+        if (!loadItems(itemsFile)) {
+            return 1;
+        }
+    }
+    else {
+        addItem(ItemInt, "sim/test1");
+        addItem(ItemFloat, "sim/airspeed");
+        addItem(ItemCommand, "sim/test/command");
+    }
+
+    signal(SIGINT, stopRequested);
+    signal(SIGTERM, stopRequested);
+
+    for (int i = 0; i < deviceCount; i++) {
+        memcpy(devices[i].items, itemList, itemCount * sizeof(VirtualItem));
+        if (!plugIn(&devices[i], i)) {
+            return 1;
+        }
+    }
+    printf("%d virtual Teensys with %d items, %.0f reports a second of %d writes\n",
+        deviceCount, itemCount, rate, writes);
+
+    uint64_t start = nowMicros();
+    uint64_t lastPlug = start;
+    uint64_t inputs = 0;
+    struct pollfd fds[MaxDevices];
+    while (!quit) {
+        uint64_t now = nowMicros();
+        if (runSeconds > 0 && now - start >= runSeconds * 1000000) {
+            break;
+        }
+
+        if (replugSeconds > 0 && now - lastPlug >= replugSeconds * 1000000) {
+            lastPlug = now;
+            for (int i = 0; i < deviceCount; i++) {
+                unplug(&devices[i]);
+                if (!plugIn(&devices[i], i)) {
+                    quit = 1;
+                }
+            }
+        }
+
+        // every report due since the start, so a late wakeup catches up
+        uint64_t due = (uint64_t)((now - start) * rate / 1000000);
+        for (; inputs < due; inputs++) {
+            for (int i = 0; i < deviceCount; i++) {
+                if (devices[i].opened && devices[i].enabled) {
+                    sendInput(&devices[i], writes);
+                }
+            }
+        }
+
+        for (int i = 0; i < deviceCount; i++) {
+            fds[i].fd = devices[i].fd;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        int wait = rate > 0 ? (int)(1000 / rate) : 100;
+        if (poll(fds, deviceCount, wait < 1 ? 1 : wait) > 0) {
+            for (int i = 0; i < deviceCount; i++) {
+                if (fds[i].revents & POLLIN) {
+                    readEvents(&devices[i]);
+                }
+            }
+        }
+    }
+
+    printStats((nowMicros() - start) / 1000000.0);
+    for (int i = 0; i < deviceCount; i++) {
+        unplug(&devices[i]);
+    }
+    return 0;
+}